@@ -31,195 +31,945 @@
 #include <unistd.h>
 #include <limits.h>
 #include <libgen.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 
 #include "sfs.h"
 #include "util.h"
 #include "config.h"
+#include "batch.h"
+#include "stats.h"
+#include "pool.h"
+#include "publish.h"
+#include "window.h"
+#include "batchfmt.h"
+#include "journal.h"
+#include "path.h"
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
 
-static void batch_clear (SfsState* state);
-static void batch_flush (SfsState* state);
+/* Events are pushed by the fuse threads to a bounded multi-producer
+ * ring, and written by a single writer thread owning the batch files.
+ * Producers reserve a slot with the space semaphore and a ticket with
+ * an atomic increment, then publish the slot by setting its sequence
+ * to ticket + 1. No lock is taken unless the ring is full and the
+ * overflow policy is to block. */
+typedef struct {
+	// must still be zero-terminated for logging
+	char* line;
+	int len;
+	int shard;
+	BatchType type;
+	// JournalKind of a journal record, -1 for a path
+	int journal;
+	// microseconds, for binary batches
+	uint64_t time;
+	// written to the file through the released handle, 0 if unknown
+	uint64_t bytes;
+} BatchEvent;
 
-static void* batch_timer_handler (void* arg) {
-	SfsState* state = (SfsState*) arg;
-	
-	while (1) {
-		struct timespec flush_ts = state->batch_flush_ts;
-
-		struct timespec sleep_ts = flush_ts;
-		while (sleep_ts.tv_sec > 0 || sleep_ts.tv_nsec > 0) {
-			struct timespec rem_ts;
-			if (nanosleep (&sleep_ts, &rem_ts) < 0 && errno == EINTR) {
-				sleep_ts = rem_ts;
-			} else {
-				break;
-			}
-		}
-		
-		pthread_mutex_lock (&(state->batch_mutex));
-		struct timespec curtime, difftime, dummy;
-		sfs_get_monotonic_time (state, &curtime);
-		// curtime - batch_time
-		sfs_timespec_subtract (&difftime, &curtime, &(state->batch_time));
-		if (sfs_timespec_subtract (&dummy, &flush_ts, &difftime)) {
-			// diff time > flush time
-			batch_flush (state);
-		}
-		pthread_mutex_unlock (&(state->batch_mutex));
+typedef struct {
+	volatile uint64_t seq;
+	BatchEvent event;
+} BatchSlot;
+
+typedef struct {
+	BatchSlot* slots;
+	uint64_t mask;
+	volatile uint64_t tail;
+	// only changed by the writer
+	uint64_t head;
+	sem_t items;
+	sem_t space;
+	// events written, and durable if requested
+	pthread_mutex_t commit_mutex;
+	pthread_cond_t commit_cond;
+	uint64_t committed;
+} BatchQueue;
+
+// events written with a single writev()
+#define BATCH_MAX_GROUP IOV_MAX
+// time constant of the event rate, in flush intervals
+#define BATCH_RATE_HORIZON 10
+
+static BatchQueue queue = {
+	.commit_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.commit_cond = PTHREAD_COND_INITIALIZER
+};
+
+/* An open batch, each shard and type has its own so that interleaved rec
+ * and norec events don't seal each other's batch. Owned by the writer
+ * thread. */
+typedef struct {
+	int shard;
+	BatchType type;
+	int tmp_file;
+	char* tmp_path;
+	int binary;
+	int events;
+	// written to the files of the batch, for batch_max_bytes
+	uint64_t bytes;
+	// when it was opened, for the flush timer
+	struct timespec time;
+	/* the paths of the events, and their ancestors with a trailing slash,
+	 * to order the batch against the other type */
+	SfsSet* order_set;
+	int order_full;
+	// encoder of a binary batch, a failed write leaves it without trailer
+	BatchfmtWriter fmt;
+	int fmt_failed;
+	// renames and written ranges of its events
+	JournalFile journals[JOURNAL_KINDS];
+	/* events per second of the stream, kept across batches, and the
+	 * time of its last update in microseconds */
+	double rate;
+	uint64_t rate_time;
+	// events of the group not written yet
+	struct iovec iov[BATCH_MAX_GROUP];
+	BatchEvent* written[BATCH_MAX_GROUP];
+	int count;
+} Batch;
+
+// see BATCH_INDEX
+static Batch* batches;
+static int batch_count;
+static const char* batch_type_names[BATCH_TYPES] = { "norec", "rec", "large" };
+
+// encoded records of a group
+static unsigned char* batch_fmt_buf;
+static size_t batch_fmt_size;
+
+static void batch_clear (SfsState* state, Batch* batch);
+static void batch_flush (SfsState* state, Batch* batch);
+static int batch_append (SfsState* state, Batch* batch, struct iovec* iov, int count, ssize_t len, int sync);
+
+/* The timestamp and subid are taken anew for each name, so that batches
+ * named when sealed sort in the order they were sealed. */
+static int batch_make_name (SfsState* state, Batch* batch, char** name) {
+	struct timespec curtime;
+	sfs_get_monotonic_time (state, &curtime);
+
+	if (curtime.tv_sec == state->batch_time.tv_sec) {
+		// same second, increment subid
+		state->batch_subid++;
+	} else {
+		state->batch_subid = 0;
 	}
+	state->batch_time = curtime;
 
-	return NULL;
+	if (asprintf(name, "%ld_%s_%s_%d_%05d_%s.%s", curtime.tv_sec, state->node_name, state->hostname, state->pid, state->batch_subid, batch_type_names[batch->type], batch->binary ? "batch2" : "batch") < 0) {
+		*name = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+#ifdef HAVE_IO_URING
+/* Optional io_uring engine. The tmp directory is kept open and
+ * registered with the ring, and creating a batch or appending to it is
+ * a chain of linked requests submitted with one syscall. Publishing is
+ * left to the publisher thread. Any failure of the engine falls back to
+ * the blocking syscalls. */
+enum {
+	URING_TMP_DIR
+};
+
+static SfsUring batch_ring = { .fd = -1 };
+static int batch_dir_fds[1] = { -1 };
+static char* batch_dir_paths[1];
+
+static void batch_uring_init (SfsState* state) {
+	static const int ops[] = { IORING_OP_OPENAT, IORING_OP_WRITEV, IORING_OP_FSYNC };
+	int fds[1] = { -1 };
+
+	if (!uring_init (&batch_ring, 8)) {
+		syslog(LOG_WARNING, "[batch_uring] cannot setup io_uring, using blocking syscalls: %s", strerror (errno));
+		return;
+	}
+
+	if (!uring_supports (&batch_ring, ops, sizeof (ops) / sizeof (ops[0])) || !uring_register_files (&batch_ring, fds, 1)) {
+		syslog(LOG_WARNING, "[batch_uring] io_uring lacks the needed operations (Linux >= 5.6), using blocking syscalls");
+		close (batch_ring.fd);
+		batch_ring.fd = -1;
+		return;
+	}
+
+	syslog(LOG_INFO, "[batch_uring] writing batches with io_uring");
 }
 
-int batch_start_timer (SfsState* state) {
-	pthread_t timer_thread;
-	if (pthread_create (&timer_thread, NULL, batch_timer_handler, state) != 0) {
-		syslog(LOG_CRIT, "[init_thread] cannot start timer thread: %s", strerror (errno));
+static int batch_uring_dir (int index, const char* path) {
+	if (batch_dir_fds[index] >= 0 && !strcmp (batch_dir_paths[index], path)) {
+		return 1;
+	}
+
+	int fd = open (path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		syslog(LOG_CRIT, "[batch_uring] cannot open directory %s: %s", path, strerror (errno));
 		return 0;
 	}
-	
-	if (pthread_detach (timer_thread) != 0) {
-		syslog(LOG_CRIT, "[init_thread] cannot detach timer thread: %s", strerror (errno));
+	if (!uring_update_file (&batch_ring, index, fd)) {
+		syslog(LOG_CRIT, "[batch_uring] cannot register directory %s: %s", path, strerror (errno));
+		close (fd);
 		return 0;
 	}
 
+	if (batch_dir_fds[index] >= 0) {
+		close (batch_dir_fds[index]);
+		free (batch_dir_paths[index]);
+	}
+	batch_dir_fds[index] = fd;
+	batch_dir_paths[index] = strdup (path);
 	return 1;
 }
 
-static void batch_clear (SfsState* state) {
-	if (state->batch_tmp_file >= 0) {
-		if (close (state->batch_tmp_file) < 0) {
+/* Whether the engine is usable, reopening the directory if the config
+ * changed. */
+static int batch_uring_ready (SfsState* state) {
+	return batch_ring.fd >= 0 &&
+		batch_uring_dir (URING_TMP_DIR, state->batch_tmp_dir);
+}
+
+static void batch_uring_sync_error (SfsState* state, int index, int res) {
+	if (res < 0) {
+		syslog (LOG_CRIT, "[sync_path] cannot fsync() path %s, this may lead to batch loss: %s", batch_dir_paths[index], strerror (-res));
+	}
+}
+
+// openat + fsync of the tmp dir
+static int batch_uring_create (SfsState* state, const char* name, int flags, mode_t mode) {
+	int res[2];
+
+	struct io_uring_sqe* sqe = uring_get_sqe (&batch_ring);
+	sqe->opcode = IORING_OP_OPENAT;
+	// openat doesn't take registered files
+	sqe->fd = batch_dir_fds[URING_TMP_DIR];
+	sqe->addr = (uintptr_t) name;
+	sqe->len = mode;
+	sqe->open_flags = flags;
+	sqe->flags = IOSQE_IO_LINK;
+
+	sqe = uring_get_sqe (&batch_ring);
+	sqe->opcode = IORING_OP_FSYNC;
+	sqe->fd = URING_TMP_DIR;
+	sqe->flags = IOSQE_FIXED_FILE;
+
+	if (!uring_submit_wait (&batch_ring, res)) {
+		return -1;
+	}
+	if (res[0] < 0) {
+		errno = -res[0];
+		return -1;
+	}
+	batch_uring_sync_error (state, URING_TMP_DIR, res[1]);
+	return res[0];
+}
+
+// writev at the current position, linked to fdatasync with sync
+static int batch_uring_append (SfsState* state, Batch* batch, struct iovec* iov, int count, ssize_t len, int sync) {
+	int res[2];
+
+	struct io_uring_sqe* sqe = uring_get_sqe (&batch_ring);
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = batch->tmp_file;
+	sqe->addr = (uintptr_t) iov;
+	sqe->len = count;
+	sqe->off = (uint64_t) -1;
+	if (sync) {
+		sqe->flags = IOSQE_IO_LINK;
+		sqe = uring_get_sqe (&batch_ring);
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = batch->tmp_file;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	}
+
+	if (!uring_submit_wait (&batch_ring, res)) {
+		return 0;
+	}
+	if (res[0] < len) {
+		// a short write cancels the fdatasync
+		errno = res[0] < 0 ? -res[0] : ENOSPC;
+		return 0;
+	}
+	if (sync && res[1] < 0) {
+		syslog(LOG_CRIT, "[batch_commit] cannot fdatasync() batch %s, this may lead to batch loss: %s", batch->tmp_path, strerror (-res[1]));
+	}
+	return 1;
+}
+#endif
+
+static void batch_clear (SfsState* state, Batch* batch) {
+	int i;
+
+	if (batch->tmp_file >= 0) {
+		if (close (batch->tmp_file) < 0) {
 			syslog(LOG_WARNING, "[batch_clear] error while closing tmp batch: %s", strerror (errno));
 		}
-		state->batch_tmp_file = -1;
+		batch->tmp_file = -1;
 	}
-	if (state->batch_tmp_path) {
-		free (state->batch_tmp_path);
-		state->batch_tmp_path = NULL;
+	if (batch->tmp_path) {
+		free (batch->tmp_path);
+		batch->tmp_path = NULL;
 	}
-	if (state->batch_name) {
-		free (state->batch_name);
-		state->batch_name = NULL;
+	batch->events = 0;
+	batch->bytes = 0;
+	batch->count = 0;
+	batchfmt_writer_free (&(batch->fmt));
+	batch->fmt_failed = 0;
+	sfs_set_clear (batch->order_set);
+	batch->order_full = 0;
+	for (i=0; i < JOURNAL_KINDS; i++) {
+		journal_discard (&(batch->journals[i]));
 	}
-	state->batch_events = 0;
-	state->batch_bytes = 0;
-	sfs_set_clear (state->batch_file_set);
+	sfs_set_clear (state->batch_file_set[BATCH_INDEX (batch->shard, batch->type)]);
+	window_discard (batch->shard, batch->type);
 }
 
-static void batch_flush (SfsState* state) {
-	const char* batch_dir = state->batch_dir;
-	char* batch_path = NULL;
-	
-	if (state->batch_tmp_file < 0) {
+/* Seal the batch and hand it to the publisher, the next event of its
+ * type opens a new one. */
+static void batch_flush (SfsState* state, Batch* batch) {
+	char* name = NULL;
+	int i;
+
+	if (batch->tmp_file < 0) {
 		goto cleanup;
 	}
 
 	if (state->log_debug) {
-		syslog(LOG_DEBUG, "[batch_flush] flushing %s", state->batch_tmp_path);
+		syslog(LOG_DEBUG, "[batch_flush] flushing %s", batch->tmp_path);
 	}
-	
-	if (close (state->batch_tmp_file) < 0) {
-		syslog(LOG_WARNING, "[batch_flush] error while closing fd %d of tmp batch %s: %s", state->batch_tmp_file, state->batch_tmp_path, strerror (errno));
+
+	if (!batch_make_name (state, batch, &name)) {
+		// the file stays in the tmp dir and is published at the next startup
+		syslog(LOG_CRIT, "[batch_flush] batchname asprintf failed for %s: %s", batch->tmp_path, strerror (errno));
+		goto cleanup;
 	}
-	state->batch_tmp_file = -1;
-	
-	if (asprintf(&batch_path, "%s/%s", batch_dir, state->batch_name) < 0) {
-		syslog(LOG_CRIT, "[batch_flush] batch_path asprintf of %s/%s failed: %s", batch_dir, state->batch_name, strerror (errno));
+
+	if (batch->binary && !batch->fmt_failed) {
+		unsigned char trailer[BATCHFMT_TRAILER_SIZE];
+		struct iovec iov = { trailer, batchfmt_write_trailer (&(batch->fmt), trailer) };
+		if (!batch_append (state, batch, &iov, 1, iov.iov_len, state->batch_group_commit)) {
+			syslog(LOG_CRIT, "[batch_flush] cannot write the trailer of %s: %s", batch->tmp_path, strerror (errno));
+		}
+	}
+
+	PublishJournal journals[JOURNAL_KINDS];
+	for (i=0; i < JOURNAL_KINDS; i++) {
+		journal_seal (state, &(batch->journals[i]), name, &(journals[i]));
+	}
+	window_seal (state, batch->shard, batch->type, batch->tmp_path, name);
+	publish_batch (state, batch->shard, batch->type, batch->tmp_file, batch->tmp_path, name, journals);
+	batch->tmp_file = -1;
+	batch->tmp_path = NULL;
+	name = NULL;
+
+cleanup:
+	free (name);
+	batch_clear (state, batch);
+}
+
+static int batch_open (SfsState* state, Batch* batch, BatchEvent* event) {
+	const char* batch_tmp_dir = state->batch_tmp_dir;
+	const char* line = event->line;
+	char* name = NULL;
+	int ret = 0;
+
+	batch->binary = state->batch_format == BATCH_FORMAT_BINARY;
+	sfs_get_monotonic_time (state, &(batch->time));
+
+	if (pool_claim (state, &(batch->tmp_file), &(batch->tmp_path))) {
+		goto opened;
+	}
+
+	// the tmp name is only kept if the batch is recovered at startup
+	if (!batch_make_name (state, batch, &name)) {
+		syslog(LOG_CRIT, "[batch_event] batchname asprintf failed for event %s: %s", line, strerror (errno));
 		goto cleanup;
 	}
 
-	if (rename (state->batch_tmp_path, batch_path) < 0) {
-		syslog(LOG_CRIT, "[batch_flush] rename of %s to %s failed: %s", state->batch_tmp_path, batch_path, strerror (errno));
+	if (asprintf(&(batch->tmp_path), "%s/%s", batch_tmp_dir, name) < 0) {
+		batch->tmp_path = NULL;
+		syslog(LOG_CRIT, "[batch_event] batchpath asprintf failed for event %s, batchname %s: %s", line, name, strerror (errno));
 		goto cleanup;
 	}
-	sfs_sync_path (state->batch_dir, 0);
-	sfs_sync_path (state->batch_tmp_dir, 0);
+
+	int extra_flags = 0;
+	if (state->use_osync && !state->batch_group_commit) {
+		extra_flags |= O_SYNC;
+	}
+
+	int flags = extra_flags | O_CREAT | O_WRONLY;
+	mode_t mode = 0666 & (~(state->fuse_umask));
+	#ifdef HAVE_IO_URING
+	if (batch_uring_ready (state)) {
+		batch->tmp_file = batch_uring_create (state, name, flags, mode);
+	} else
+	#endif
+	{
+		batch->tmp_file = open (batch->tmp_path, flags, mode);
+		if (batch->tmp_file >= 0) {
+			sfs_sync_path (state->batch_tmp_dir, 0);
+		}
+	}
+	if (batch->tmp_file < 0) {
+		syslog(LOG_CRIT, "[batch_event] cannot open batch %s for writing event %s: %s", batch->tmp_path, line, strerror (errno));
+		goto cleanup;
+	}
+
+opened:
+	if (state->log_debug) {
+		syslog (LOG_DEBUG, "Created batch %s", batch->tmp_path);
+	}
+
+	if (batch->binary) {
+		unsigned char header[BATCHFMT_HEADER_SIZE];
+		struct iovec iov = { header, batchfmt_writer_init (&(batch->fmt), event->time, header) };
+		if (!batch_append (state, batch, &iov, 1, iov.iov_len, 0)) {
+			syslog(LOG_CRIT, "[batch_event] cannot write the header of %s: %s", batch->tmp_path, strerror (errno));
+			batch->fmt_failed = 1;
+			goto cleanup;
+		}
+	}
+	ret = 1;
 
 cleanup:
-	if (batch_path) {
-		free (batch_path);
+	free (name);
+	return ret;
+}
+
+static void batch_commit_stats (int count) {
+	stats_inc (STAT_BATCH_COMMITS);
+	stats_add (STAT_BATCH_COMMIT_EVENTS, count);
+	if (count == 1) {
+		stats_inc (STAT_BATCH_COMMIT_SIZE_1);
+	} else if (count < 16) {
+		stats_inc (STAT_BATCH_COMMIT_SIZE_2_15);
+	} else if (count < 128) {
+		stats_inc (STAT_BATCH_COMMIT_SIZE_16_127);
+	} else {
+		stats_inc (STAT_BATCH_COMMIT_SIZE_128);
 	}
-	batch_clear (state);
 }
 
-// Line with length but must still be zero-terminated!
-void batch_event (const char* line, int len, const char* type) {
-	SfsState* state = SFS_STATE;
+/* Write len bytes and with sync make them durable, returns 0 if the
+ * write failed. */
+static int batch_append (SfsState* state, Batch* batch, struct iovec* iov, int count, ssize_t len, int sync) {
+	#ifdef HAVE_IO_URING
+	if (batch_uring_ready (state)) {
+		return batch_uring_append (state, batch, iov, count, len, sync);
+	}
+	#endif
 
-	if (state->log_debug) {
-		syslog (LOG_DEBUG, "[batch_event] batching %s", line);
+	ssize_t retstat = writev (batch->tmp_file, iov, count);
+	if (retstat < len) {
+		if (retstat >= 0) {
+			// short write, most likely out of space
+			errno = ENOSPC;
+		}
+		return 0;
 	}
 
-	pthread_mutex_lock (&(state->batch_mutex));
-	if (state->batch_type && strcmp (state->batch_type, type)) {
-		batch_flush (state);
+	if (sync && fdatasync (batch->tmp_file) < 0) {
+		syslog(LOG_CRIT, "[batch_commit] cannot fdatasync() batch %s, this may lead to batch loss: %s", batch->tmp_path, strerror (errno));
 	}
-	state->batch_type = type;
-	
-	if (state->batch_tmp_file < 0) {
-		struct timespec curtime;
-		sfs_get_monotonic_time (state, &curtime);
-		
-		int subid = state->batch_subid;
-		if (curtime.tv_sec == state->batch_time.tv_sec) {
-			// same second, increment subid
-			subid++;
-		} else {
-			subid = 0;
+	return 1;
+}
+
+/* Append the events gathered for the batch with a single writev(), and
+ * with group commit make them durable with a single fdatasync(). */
+static void batch_commit (SfsState* state, Batch* batch) {
+	int count = batch->count;
+	ssize_t len = 0;
+	int i;
+
+	if (!count) {
+		return;
+	}
+	batch->count = 0;
+
+	for (i=0; i < count; i++) {
+		len += batch->iov[i].iov_len;
+	}
+
+	if (!batch_append (state, batch, batch->iov, count, len, state->batch_group_commit)) {
+		for (i=0; i < count; i++) {
+			syslog(LOG_CRIT, "[batch_event] error while writing batch event %s to %s with fd %d, clearing batch file: %s", batch->written[i]->line, batch->tmp_path, batch->tmp_file, strerror(errno));
 		}
-		
-		const char* node_name = state->node_name;
-		const char* batch_tmp_dir = state->batch_tmp_dir;
+		batch->fmt_failed = 1;
+		batch_flush (state, batch);
+		return;
+	}
+
+	for (i=0; i < count; i++) {
+		window_add (batch->shard, batch->type, batch->written[i]->line, batch->written[i]->len);
+	}
+
+	if (state->batch_group_commit) {
+		batch_commit_stats (count);
+	}
+}
 
-		if (asprintf(&(state->batch_name), "%ld_%s_%s_%d_%05d_%s.batch", curtime.tv_sec, node_name, state->hostname, state->pid, subid, type) < 0) {
-			syslog(LOG_CRIT, "[batch_event] batchname asprintf failed for event %s: %s", line, strerror (errno));
-			goto error;
+static double batch_flush_seconds (SfsState* state) {
+	return state->batch_flush_ts.tv_sec + state->batch_flush_ts.tv_nsec / 1e9;
+}
+
+/* Add an event at time to the rate of the stream, an exponentially
+ * weighted average over BATCH_RATE_HORIZON flush intervals. A single
+ * event after a quiet period counts for little. */
+static void batch_rate_update (SfsState* state, Batch* batch, uint64_t time) {
+	double tau = batch_flush_seconds (state) * BATCH_RATE_HORIZON;
+	if (time > batch->rate_time) {
+		if (batch->rate_time) {
+			batch->rate *= exp (-((time - batch->rate_time) / 1e6) / tau);
 		}
+		batch->rate_time = time;
+	}
+	batch->rate += 1 / tau;
+}
+
+/* Events the batch can take. With batch_adaptive it's the number of
+ * events expected within batch_flush_msec, so that under sustained load
+ * batches only end when they get too old. */
+static int batch_event_limit (SfsState* state, Batch* batch) {
+	if (!state->batch_adaptive) {
+		return state->batch_max_events;
+	}
+
+	double expected = batch->rate * batch_flush_seconds (state);
+	if (expected <= state->batch_max_events) {
+		return state->batch_max_events;
+	} else if (expected >= state->batch_adaptive_max_events) {
+		return state->batch_adaptive_max_events;
+	}
+	return (int) expected;
+}
+
+/* Record the path of line, and its ancestors with a trailing slash. */
+static void batch_track (Batch* batch, const char* line, int len) {
+	int i;
 
-		if (asprintf(&(state->batch_tmp_path), "%s/%s", batch_tmp_dir, state->batch_name) < 0) {
-			syslog(LOG_CRIT, "[batch_event] batchpath asprintf failed for event %s, batchname %s: %s", line, state->batch_name, strerror (errno));
-			goto error;
+	if (!sfs_set_add_len (batch->order_set, line, len - 1) &&
+		!sfs_set_contains_len (batch->order_set, line, len - 1)) {
+		// past the budget, any event is assumed to depend on the batch
+		batch->order_full = 1;
+	}
+	for (i=1; i < len - 1; i++) {
+		if (line[i] == '/') {
+			sfs_set_add_len (batch->order_set, line, i + 1);
+		}
+	}
+}
+
+/* Whether the event at line touches a path of the open batch, one of its
+ * ancestors or one of its descendants. Such a batch must be read before
+ * the event by the sync daemon. */
+static int batch_depends (Batch* batch, char* line, int len) {
+	int ret = 0;
+	int i;
+
+	if (batch->tmp_file < 0 || !batch->events) {
+		return 0;
+	}
+	// the root is an ancestor of any path
+	if (batch->order_full || len == 2 || sfs_set_contains_len (batch->order_set, "/", 1) ||
+		sfs_set_contains_len (batch->order_set, line, len - 1)) {
+		return 1;
+	}
+	for (i=1; i < len - 1; i++) {
+		if (line[i] == '/' && sfs_set_contains_len (batch->order_set, line, i)) {
+			return 1;
 		}
+	}
+
+	// descendants recorded the path with a trailing slash
+	line[len - 1] = '/';
+	ret = sfs_set_contains_len (batch->order_set, line, len);
+	line[len - 1] = '\n';
+	return ret;
+}
 
-		int extra_flags = 0;
-		if (state->use_osync) {
-			extra_flags |= O_SYNC;
+/* Write events to the open batch of their shard and type. A batch is
+ * sealed when full, or before an event that depends on it goes to the
+ * other type of the shard. Large batches are a stream of their own and
+ * are not ordered against the others. */
+static void batch_write (SfsState* state, BatchEvent* events, int count) {
+	size_t used = 0;
+	int i;
+
+	// binary batches may still be open if the buffer exists
+	if (batch_fmt_buf || state->batch_format == BATCH_FORMAT_BINARY) {
+		// room for the worst case, records point into the buffer until written
+		size_t size = 0;
+		for (i=0; i < count; i++) {
+			size += BATCHFMT_RECORD_BOUND (events[i].len);
+		}
+		if (size > batch_fmt_size) {
+			unsigned char* buf = realloc (batch_fmt_buf, size);
+			if (!buf) {
+				for (i=0; i < count; i++) {
+					syslog(LOG_CRIT, "[batch_event] cannot allocate the encoding of batch event %s", events[i].line);
+				}
+				return;
+			}
+			batch_fmt_buf = buf;
+			batch_fmt_size = size;
 		}
+	}
 
-		state->batch_tmp_file = open (state->batch_tmp_path, extra_flags | O_CREAT | O_WRONLY, 0666 & (~(state->fuse_umask)));
-		if (state->batch_tmp_file < 0) {
-			syslog(LOG_CRIT, "[batch_event] cannot open batch %s for writing event %s: %s", state->batch_tmp_path, line, strerror (errno));
-			goto error;
+	for (i=0; i < count; i++) {
+		BatchEvent* event = &(events[i]);
+		Batch* batch = &(batches[BATCH_INDEX (event->shard, event->type)]);
+		Batch* other = NULL;
+		if (event->type != BATCH_TYPE_LARGE) {
+			other = &(batches[BATCH_INDEX (event->shard, event->type == BATCH_TYPE_REC ? BATCH_TYPE_NOREC : BATCH_TYPE_REC)]);
 		}
-		
 		if (state->log_debug) {
-			syslog (LOG_DEBUG, "Created batch %s", state->batch_tmp_path);
+			syslog (LOG_DEBUG, "[batch_event] batching %s", event->line);
+		}
+
+		if (other && event->journal < 0 && batch_depends (other, event->line, event->len)) {
+			// seal it first, so that its name sorts before the batch of this event
+			if (state->log_debug) {
+				syslog (LOG_DEBUG, "[batch_event] %s depends on %s, sealing it", event->line, other->tmp_path);
+			}
+			batch_commit (state, other);
+			batch_flush (state, other);
+			stats_inc (STAT_BATCH_ORDER_SEALS);
+		}
+
+		if (batch->tmp_file < 0 && !batch_open (state, batch, event)) {
+			batch_flush (state, batch);
+			continue;
+		}
+
+		if (event->journal >= 0) {
+			// goes to the rename or extents journal of the open batch
+			journal_append (state, &(batch->journals[event->journal]), batch->tmp_path, event->line, event->len);
+			continue;
+		}
+
+		struct iovec* iov = &(batch->iov[batch->count]);
+		if (batch->binary) {
+			// without the newline
+			BatchfmtOp op = BATCHFMT_OP_NOREC;
+			if (event->type == BATCH_TYPE_REC) {
+				op = BATCHFMT_OP_REC;
+			} else if (event->bytes) {
+				op = BATCHFMT_OP_WRITTEN;
+			}
+			size_t size = batchfmt_write_record (&(batch->fmt), op, event->time, event->line, event->len - 1, event->bytes, batch_fmt_buf + used);
+			if (!size) {
+				syslog(LOG_CRIT, "[batch_event] cannot allocate the encoding of batch event %s", event->line);
+				continue;
+			}
+			iov->iov_base = batch_fmt_buf + used;
+			iov->iov_len = size;
+			used += size;
+		} else {
+			iov->iov_base = event->line;
+			iov->iov_len = event->len;
+		}
+		batch->written[batch->count++] = event;
+		batch_track (batch, event->line, event->len);
+		batch_rate_update (state, batch, event->time);
+		batch->bytes += event->bytes;
+
+		if (batch->events++ >= batch_event_limit (state, batch) || batch->bytes >= state->batch_max_bytes) {
+			batch_commit (state, batch);
+			batch_flush (state, batch);
+			stats_inc (STAT_BATCH_FLUSH_FULL);
+		}
+	}
+
+	for (i=0; i < batch_count; i++) {
+		if (batches[i].tmp_file >= 0) {
+			batch_commit (state, &(batches[i]));
 		}
+	}
+}
 
-		sfs_sync_path (state->batch_tmp_dir, 0);
+/* The open batch due first, NULL if none is open. Its absolute deadline
+ * is stored in deadline, batch times come from the realtime clock as
+ * required by sem_timedwait(). past is set if it's already due. */
+static Batch* batch_next_due (SfsState* state, struct timespec* deadline, int* past) {
+	struct timespec curtime, dummy;
+	Batch* due = NULL;
+	int i;
 
-		state->batch_time = curtime;
-		state->batch_subid = subid;
-    }
+	for (i=0; i < batch_count; i++) {
+		Batch* batch = &(batches[i]);
+		if (batch->tmp_file < 0) {
+			continue;
+		}
+		if (!due || batch->time.tv_sec < due->time.tv_sec ||
+			(batch->time.tv_sec == due->time.tv_sec && batch->time.tv_nsec < due->time.tv_nsec)) {
+			due = batch;
+		}
+	}
+	if (!due) {
+		return NULL;
+	}
 
-	if (write (state->batch_tmp_file, line, len) < 0) {
-		syslog(LOG_CRIT, "[batch_event] error while writing batch event %s to %s with fd %d, clearing batch file: %s", line, state->batch_tmp_path, state->batch_tmp_file, strerror(errno));
-		goto error;
+	deadline->tv_sec = due->time.tv_sec + state->batch_flush_ts.tv_sec;
+	deadline->tv_nsec = due->time.tv_nsec + state->batch_flush_ts.tv_nsec;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
 	}
 
-	if (state->batch_events++ >= state->batch_max_events ||
-		state->batch_bytes >= state->batch_max_bytes) {
-		batch_flush (state);
+	sfs_get_monotonic_time (state, &curtime);
+	*past = sfs_timespec_subtract (&dummy, deadline, &curtime);
+	return due;
+}
+
+/* With batch_adaptive, once the queue is empty seal the batches that are
+ * not expected to get another event before their deadline: waiting
+ * would only delay the replication of the events they have. */
+static void batch_flush_idle (SfsState* state) {
+	struct timespec curtime;
+	int queued;
+	int i;
+
+	if (sem_getvalue (&queue.items, &queued) < 0 || queued > 0) {
+		return;
 	}
 
-	pthread_mutex_unlock (&(state->batch_mutex));
-	return;
+	sfs_get_monotonic_time (state, &curtime);
+	uint64_t now = curtime.tv_sec * 1000000ULL + curtime.tv_nsec / 1000;
+	double flush = batch_flush_seconds (state);
+	double tau = flush * BATCH_RATE_HORIZON;
 
-error:
-	batch_flush (state);
-	pthread_mutex_unlock (&(state->batch_mutex));
+	for (i=0; i < batch_count; i++) {
+		Batch* batch = &(batches[i]);
+		if (batch->tmp_file < 0) {
+			continue;
+		}
+
+		double age = (curtime.tv_sec - batch->time.tv_sec) + (curtime.tv_nsec - batch->time.tv_nsec) / 1e9;
+		double rate = batch->rate;
+		if (now > batch->rate_time) {
+			rate *= exp (-((now - batch->rate_time) / 1e6) / tau);
+		}
+		if (rate * (flush - age) < 1) {
+			batch_flush (state, batch);
+			stats_inc (STAT_BATCH_FLUSH_IDLE);
+		}
+	}
 }
 
-void batch_file_event (const char* path, const char* type) {
+/* Pop the next event, the caller already took it from the items semaphore. */
+static void batch_take (BatchEvent* event) {
+	BatchSlot* slot = &(queue.slots[queue.head & queue.mask]);
+	while (slot->seq != queue.head + 1) {
+		// another producer took an earlier ticket but didn't publish it yet
+		sched_yield ();
+	}
+	__sync_synchronize ();
+	*event = slot->event;
+	queue.head++;
+	sem_post (&queue.space);
+}
+
+/* Collect more events after the first one: with group commit wait up to
+ * batch_commit_window_usec for them, otherwise take what's queued. */
+static int batch_gather (SfsState* state, BatchEvent* events) {
+	int max = BATCH_MAX_GROUP;
+	int count = 1;
+	struct timespec window;
+
+	if (state->batch_group_commit) {
+		max = state->batch_commit_max_events;
+		clock_gettime (CLOCK_REALTIME, &window);
+		window.tv_nsec += (long) state->batch_commit_window_usec * 1000;
+		window.tv_sec += window.tv_nsec / 1000000000;
+		window.tv_nsec %= 1000000000;
+	}
+
+	while (count < max) {
+		if (sem_trywait (&queue.items) < 0 &&
+			(!state->batch_group_commit || sem_timedwait (&queue.items, &window) < 0)) {
+			break;
+		}
+		batch_take (&(events[count++]));
+	}
+	return count;
+}
+
+static void* batch_writer (void* arg) {
+	SfsState* state = (SfsState*) arg;
+	BatchEvent events[BATCH_MAX_GROUP];
+
+	while (1) {
+		struct timespec deadline;
+		int past = 0;
+		int ret;
+		int i;
+
+		Batch* due = batch_next_due (state, &deadline, &past);
+		if (due) {
+			if (past) {
+				batch_flush (state, due);
+				stats_inc (STAT_BATCH_FLUSH_AGE);
+				continue;
+			}
+			ret = sem_timedwait (&queue.items, &deadline);
+		} else {
+			ret = sem_wait (&queue.items);
+		}
+
+		if (ret < 0) {
+			if (errno == ETIMEDOUT) {
+				batch_flush (state, due);
+				stats_inc (STAT_BATCH_FLUSH_AGE);
+			}
+			continue;
+		}
+
+		batch_take (&(events[0]));
+		int count = batch_gather (state, events);
+		batch_write (state, events, count);
+		if (state->batch_adaptive) {
+			batch_flush_idle (state);
+		}
+		for (i=0; i < count; i++) {
+			free (events[i].line);
+		}
+
+		// wake up the requests waiting for their events
+		pthread_mutex_lock (&(queue.commit_mutex));
+		queue.committed += count;
+		pthread_cond_broadcast (&(queue.commit_cond));
+		pthread_mutex_unlock (&(queue.commit_mutex));
+	}
+
+	return NULL;
+}
+
+// returns 0 if the event was dropped
+static int batch_push (SfsState* state, char* line, int len, int shard, BatchType type, int journal, uint64_t bytes, uint64_t* ticket) {
+	if (sem_trywait (&queue.space) < 0) {
+		stats_inc (STAT_BATCH_QUEUE_FULL);
+		if (state->batch_queue_overflow == BATCH_OVERFLOW_DROP) {
+			stats_inc (STAT_BATCH_EVENTS_DROPPED);
+			syslog(LOG_CRIT, "[batch_event] queue full, dropping event %s", line);
+			free (line);
+			return 0;
+		}
+
+		// backpressure, wait for the writer to catch up
+		while (sem_wait (&queue.space) < 0 && errno == EINTR);
+	}
+
+	struct timespec now;
+	clock_gettime (CLOCK_REALTIME, &now);
+
+	*ticket = __sync_fetch_and_add (&queue.tail, 1);
+	BatchSlot* slot = &(queue.slots[*ticket & queue.mask]);
+	slot->event.line = line;
+	slot->event.len = len;
+	slot->event.shard = shard;
+	slot->event.type = type;
+	slot->event.journal = journal;
+	slot->event.time = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+	slot->event.bytes = bytes;
+	__sync_synchronize ();
+	slot->seq = *ticket + 1;
+	sem_post (&queue.items);
+	return 1;
+}
+
+int batch_start_writer (SfsState* state) {
+	if (state->batch_io_uring) {
+		#ifdef HAVE_IO_URING
+		batch_uring_init (state);
+		#else
+		syslog(LOG_WARNING, "[init_thread] batch_io_uring requires building with make IO_URING=1");
+		#endif
+	}
+
+	uint64_t size = 1;
+	while (size < (uint64_t) state->batch_queue_size) {
+		size <<= 1;
+	}
+
+	queue.slots = calloc (size, sizeof (BatchSlot));
+	if (!queue.slots) {
+		syslog(LOG_CRIT, "[init_thread] cannot allocate batch queue of %llu events", (unsigned long long) size);
+		return 0;
+	}
+	queue.mask = size - 1;
+
+	if (sem_init (&queue.items, 0, 0) < 0 || sem_init (&queue.space, 0, size) < 0) {
+		syslog(LOG_CRIT, "[init_thread] cannot init batch queue semaphores: %s", strerror (errno));
+		return 0;
+	}
+
+	batch_count = state->batch_shards * BATCH_TYPES;
+	batches = calloc (batch_count, sizeof (Batch));
+	if (!batches) {
+		syslog(LOG_CRIT, "[init_thread] cannot allocate %d open batches", batch_count);
+		return 0;
+	}
+
+	int i, j;
+	for (i=0; i < batch_count; i++) {
+		batches[i].shard = i / BATCH_TYPES;
+		batches[i].type = i % BATCH_TYPES;
+		batches[i].tmp_file = -1;
+		for (j=0; j < JOURNAL_KINDS; j++) {
+			batches[i].journals[j].kind = j;
+			batches[i].journals[j].fd = -1;
+		}
+		batches[i].order_set = sfs_set_new (state->batch_dedup_max_bytes);
+		if (!batches[i].order_set) {
+			syslog(LOG_CRIT, "[init_thread] cannot allocate the batch order set");
+			return 0;
+		}
+	}
+
+	if (!window_init (state) || !publish_start (state) || !pool_start (state)) {
+		return 0;
+	}
+
+	pthread_t writer_thread;
+	if (pthread_create (&writer_thread, NULL, batch_writer, state) != 0) {
+		syslog(LOG_CRIT, "[init_thread] cannot start batch writer thread: %s", strerror (errno));
+		return 0;
+	}
+	
+	if (pthread_detach (writer_thread) != 0) {
+		syslog(LOG_CRIT, "[init_thread] cannot detach batch writer thread: %s", strerror (errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Wait until the first count events ever queued are committed. */
+static void batch_wait (uint64_t count) {
+	pthread_mutex_lock (&(queue.commit_mutex));
+	while (queue.committed < count) {
+		pthread_cond_wait (&(queue.commit_cond), &(queue.commit_mutex));
+	}
+	pthread_mutex_unlock (&(queue.commit_mutex));
+}
+
+/* Wait until all the events queued so far are in the tmp batch. */
+void batch_drain (void) {
+	if (queue.slots) {
+		batch_wait (queue.tail);
+	}
+}
+
+/* Queue the event of path. bytes is how much was written to it through
+ * the handle just released, and puts it in a large batch when it reaches
+ * batch_large_bytes. The extents journal record of the handle, if any,
+ * is owned and goes to the journal of the same batch. */
+static void batch_event (const char* path, const char* type, uint64_t bytes, char* record, int record_len) {
 	SfsState* state = SFS_STATE;
 	const char* ignore_path_prefix = state->ignore_path_prefix;
 	
@@ -232,20 +982,194 @@ void batch_file_event (const char* path, const char* type) {
 	} else if (strstr(path, ".fuse_hidden") != NULL) {
 		// skip fuse hidden files
 	} else {
-		if (sfs_set_add (state->batch_file_set, path)) {
+		// like with O_SYNC, return once the event is on disk
+		int durable = state->use_osync || state->batch_group_commit;
+		BatchType batch_type = strcmp (type, "rec") ? BATCH_TYPE_NOREC : BATCH_TYPE_REC;
+		if (batch_type == BATCH_TYPE_NOREC && state->batch_large_bytes && bytes >= state->batch_large_bytes) {
+			batch_type = BATCH_TYPE_LARGE;
+		}
+		int shard = batch_shard (state, path);
+		uint64_t ticket;
+
+		if (window_pending (state, path, batch_type)) {
+			// already durable in a sealed batch, which copies the whole file
+			free (record);
+			return;
+		}
+
+		if (record) {
+			// before the path, so that it's in the journal of its batch
+			batch_push (state, record, record_len, shard, batch_type, JOURNAL_EXTENTS, 0, &ticket);
+			record = NULL;
+		}
+
+		if (sfs_set_add (state->batch_file_set[BATCH_INDEX (shard, batch_type)], path)) {
+			if (durable) {
+				// the same path may still be queued
+				batch_wait (queue.tail);
+			}
 			return;
 		}
 		
 		int len = strlen(path);
-		char nlpath[len+2];
-		strncpy (nlpath, path, len);
+		char* nlpath = malloc (len+2);
+		if (!nlpath) {
+			syslog(LOG_CRIT, "[batch_event] cannot allocate event %s", path);
+			return;
+		}
+		memcpy (nlpath, path, len);
 		nlpath[len] = '\n';
 		nlpath[len+1] = '\0';
-		batch_event (nlpath, len+1, type);
+		if (batch_push (state, nlpath, len+1, shard, batch_type, -1, bytes, &ticket) && durable) {
+			batch_wait (ticket + 1);
+		}
+		return;
 	}
+	free (record);
+}
+
+void batch_file_event (const char* path, const char* type) {
+	batch_event (path, type, 0, NULL, 0);
 }
 
-void batch_bytes_written (int bytes) {
+/* A file was released after bytes were written through its handle,
+ * record is its extents journal record or NULL. */
+void batch_written_event (const char* path, uint64_t bytes, char* record, int record_len) {
+	batch_event (path, "norec", bytes, record, record_len);
+}
+
+// paths that never get an event
+static int batch_ignored (SfsState* state, const char* path) {
+	const char* ignore_path_prefix = state->ignore_path_prefix;
+	return !strcmp (path, "/.sfs.conf") || !strcmp (path, "/.sfs.mounted") ||
+		(ignore_path_prefix && strstr (path, ignore_path_prefix) == path) ||
+		strstr (path, ".fuse_hidden") != NULL;
+}
+
+/* Record the rename of st from path to newpath in the journal of the
+ * batch getting its events, rec for directories and norec otherwise,
+ * which must be emitted right after. With shards it's the batch of
+ * newpath, which would copy the renamed files. */
+void batch_rename_event (const char* path, const char* newpath, const struct stat* st) {
 	SfsState* state = SFS_STATE;
-	__sync_add_and_fetch (&state->batch_bytes, bytes);
+	uint64_t ticket;
+	char* line;
+
+	// st_ino is 0 if the source could not be stat'ed
+	if (!state->rename_journal_dir || !st->st_ino || batch_ignored (state, path) || batch_ignored (state, newpath)) {
+		return;
+	}
+	// records are tab and newline separated, rsync copies these instead
+	if (strpbrk (path, "\t\n") || strpbrk (newpath, "\t\n")) {
+		return;
+	}
+
+	int len = asprintf (&line, "%llu\t%ld.%09ld\t%c\t%s\t%s\n", (unsigned long long) st->st_ino, (long) st->st_mtim.tv_sec, st->st_mtim.tv_nsec, path_kind (st->st_mode), path, newpath);
+	if (len < 0) {
+		syslog(LOG_CRIT, "[batch_event] cannot allocate journal record of %s: %s", path, strerror (errno));
+		return;
+	}
+	BatchType type = S_ISDIR (st->st_mode) ? BATCH_TYPE_REC : BATCH_TYPE_NOREC;
+	batch_push (state, line, len, batch_shard (state, newpath), type, JOURNAL_RENAMES, 0, &ticket);
+}
+
+/* Shard of the events of path, by the hash of the path or of its top
+ * level entry. */
+int batch_shard (SfsState* state, const char* path) {
+	// FNV-1a
+	uint32_t hash = 2166136261U;
+	const char* p;
+
+	if (state->batch_shards <= 1) {
+		return 0;
+	}
+	for (p=path; *p; p++) {
+		if (state->batch_shard_key == BATCH_SHARD_TOP && *p == '/' && p != path) {
+			break;
+		}
+		hash = (hash ^ (unsigned char) *p) * 16777619U;
+	}
+	return hash % state->batch_shards;
+}
+
+/* Shard of a batch left in the tmp dir, from its first event. Batches
+ * without events go to the first shard. */
+int batch_file_shard (SfsState* state, const char* tmp_path) {
+	char buf[PATH_MAX + BATCHFMT_HEADER_SIZE + 32];
+	int shard = 0;
+
+	if (state->batch_shards <= 1) {
+		return 0;
+	}
+
+	int fd = open (tmp_path, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	ssize_t size = read (fd, buf, sizeof (buf) - 1);
+	close (fd);
+	if (size <= 0) {
+		return 0;
+	}
+
+	BatchfmtReader reader;
+	if (batchfmt_reader_init (&reader, buf, size)) {
+		BatchfmtRecord record;
+		if (batchfmt_read (&reader, &record) == BATCHFMT_RECORD) {
+			shard = batch_shard (state, record.path);
+		}
+		batchfmt_reader_free (&reader);
+	} else {
+		buf[size] = '\0';
+		char* nl = strchr (buf, '\n');
+		if (nl) {
+			*nl = '\0';
+			shard = batch_shard (state, buf);
+		}
+	}
+	return shard;
+}
+
+/* Directory the batches of shard are published to, NULL if out of
+ * memory. */
+char* batch_shard_dir (SfsState* state, int shard) {
+	char* path;
+
+	if (state->batch_shards <= 1) {
+		return strdup (state->batch_dir);
+	}
+	if (asprintf (&path, "%s/shard%02d", state->batch_dir, shard) < 0) {
+		return NULL;
+	}
+	return path;
+}
+
+/* Directory the batches of shard and type are published to, large
+ * batches go to a subdirectory of the shard. NULL if out of memory. */
+char* batch_stream_dir (SfsState* state, int shard, BatchType type) {
+	char* dir = batch_shard_dir (state, shard);
+	char* path;
+
+	if (!dir || type != BATCH_TYPE_LARGE) {
+		return dir;
+	}
+	if (asprintf (&path, "%s/large", dir) < 0) {
+		path = NULL;
+	}
+	free (dir);
+	return path;
+}
+
+// type of a batch from its name, the last field before the extension
+BatchType batch_name_type (const char* name) {
+	const char* type = strrchr (name, '_');
+	int i;
+
+	for (i=0; type && i < BATCH_TYPES; i++) {
+		size_t len = strlen (batch_type_names[i]);
+		if (!strncmp (type + 1, batch_type_names[i], len) && type[len + 1] == '.') {
+			return i;
+		}
+	}
+	return BATCH_TYPE_NOREC;
 }
@@ -22,11 +22,23 @@
 #ifndef SFS_BATCH_H
 #define SFS_BATCH_H
 
+#include <sys/stat.h>
 #include "sfs.h"
 
-void batch_event (const char* line, int len);
+// upper bound of batch_shards
+#define BATCH_MAX_SHARDS 64
+// open batch of a shard and type
+#define BATCH_INDEX(shard, type) ((shard) * BATCH_TYPES + (type))
+
 void batch_file_event (const char* path, const char* type);
-void batch_bytes_written (int bytes);
-int batch_start_timer (SfsState* state);
+void batch_rename_event (const char* path, const char* newpath, const struct stat* st);
+void batch_written_event (const char* path, uint64_t bytes, char* record, int record_len);
+int batch_start_writer (SfsState* state);
+void batch_drain (void);
+int batch_shard (SfsState* state, const char* path);
+int batch_file_shard (SfsState* state, const char* tmp_path);
+char* batch_shard_dir (SfsState* state, int shard);
+char* batch_stream_dir (SfsState* state, int shard, BatchType type);
+BatchType batch_name_type (const char* name);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,142 @@
+/*
+ *  batchcat.c - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* sfs-batch-cat: print batches in the text format, one path per line.
+ * Text batches are printed as they are. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "batchfmt.h"
+
+static int strict = 0;
+static int verbose = 0;
+
+static void usage (void) {
+	fprintf (stderr, "Usage: sfs-batch-cat [-s] [-l] BATCH...\n\n");
+	fprintf (stderr, "  -s  fail on batches without trailer\n");
+	fprintf (stderr, "  -l  print the time, type and written bytes of each record\n");
+}
+
+static int read_file (const char* path, unsigned char** data, size_t* size) {
+	FILE* file = fopen (path, "r");
+	if (!file) {
+		return 0;
+	}
+
+	size_t alloc = 65536;
+	*size = 0;
+	*data = malloc (alloc);
+	while (*data) {
+		*size += fread (*data + *size, 1, alloc - *size, file);
+		if (*size < alloc) {
+			break;
+		}
+		alloc *= 2;
+		unsigned char* bigger = realloc (*data, alloc);
+		if (!bigger) {
+			free (*data);
+		}
+		*data = bigger;
+	}
+
+	int ok = *data && !ferror (file);
+	fclose (file);
+	return ok;
+}
+
+static int cat_batch (const char* path) {
+	unsigned char* data = NULL;
+	size_t size;
+	BatchfmtReader reader;
+	BatchfmtRecord record;
+	BatchfmtStatus status;
+	int ret = 0;
+
+	if (!read_file (path, &data, &size)) {
+		fprintf (stderr, "sfs-batch-cat: cannot read %s: %s\n", path, strerror (errno));
+		goto cleanup;
+	}
+
+	if (!batchfmt_is_binary (data, size)) {
+		fwrite (data, 1, size, stdout);
+		ret = 1;
+		goto cleanup;
+	}
+
+	if (!batchfmt_reader_init (&reader, data, size)) {
+		fprintf (stderr, "sfs-batch-cat: %s: unsupported batch version\n", path);
+		goto cleanup;
+	}
+	while ((status = batchfmt_read (&reader, &record)) == BATCHFMT_RECORD) {
+		if (verbose) {
+			printf ("%" PRIu64 ".%06" PRIu64 " %s %" PRIu64 " ", record.time / 1000000, record.time % 1000000, record.op == BATCHFMT_OP_REC ? "rec" : "norec", record.bytes);
+		}
+		fwrite (record.path, 1, record.len, stdout);
+		putchar ('\n');
+	}
+	batchfmt_reader_free (&reader);
+
+	if (status == BATCHFMT_EOF || (status == BATCHFMT_TRUNCATED && !strict)) {
+		ret = 1;
+	} else {
+		fprintf (stderr, "sfs-batch-cat: %s: %s\n", path, batchfmt_strerror (status));
+	}
+
+cleanup:
+	free (data);
+	return ret;
+}
+
+int main (int argc, char** argv) {
+	int ret = 0;
+	int opt;
+
+	while ((opt = getopt (argc, argv, "slh")) != -1) {
+		switch (opt) {
+		case 's':
+			strict = 1;
+			break;
+		case 'l':
+			verbose = 1;
+			break;
+		default:
+			usage ();
+			return 2;
+		}
+	}
+	if (optind >= argc) {
+		usage ();
+		return 2;
+	}
+
+	for (; optind < argc; optind++) {
+		if (!cat_batch (argv[optind])) {
+			ret = 1;
+		}
+	}
+	return ret;
+}
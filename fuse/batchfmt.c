@@ -0,0 +1,327 @@
+/*
+ *  batchfmt.c - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "batchfmt.h"
+
+// crc32 as in zlib, 4 bits at a time
+static const uint32_t crc_table[16] = {
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+uint32_t batchfmt_crc32 (uint32_t crc, const void* data, size_t len) {
+	const unsigned char* p = (const unsigned char*) data;
+	crc = ~crc;
+	while (len--) {
+		crc ^= *p++;
+		crc = (crc >> 4) ^ crc_table[crc & 15];
+		crc = (crc >> 4) ^ crc_table[crc & 15];
+	}
+	return ~crc;
+}
+
+int batchfmt_is_binary (const void* data, size_t size) {
+	return size >= 4 && !memcmp (data, BATCHFMT_MAGIC, 4);
+}
+
+static size_t put_varint (unsigned char* buf, uint64_t value) {
+	size_t n = 0;
+	while (value >= 0x80) {
+		buf[n++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	buf[n++] = value;
+	return n;
+}
+
+static void put_le (unsigned char* buf, uint64_t value, int bytes) {
+	int i;
+	for (i=0; i < bytes; i++) {
+		buf[i] = value >> (i * 8);
+	}
+}
+
+static uint64_t get_le (const unsigned char* buf, int bytes) {
+	uint64_t value = 0;
+	int i;
+	for (i=0; i < bytes; i++) {
+		value |= (uint64_t) buf[i] << (i * 8);
+	}
+	return value;
+}
+
+size_t batchfmt_writer_init (BatchfmtWriter* writer, uint64_t time, unsigned char* buf) {
+	memset (writer, 0, sizeof (BatchfmtWriter));
+	writer->time = time;
+
+	memcpy (buf, BATCHFMT_MAGIC, 4);
+	buf[4] = BATCHFMT_VERSION;
+	buf[5] = 0;
+	put_le (buf + 6, 0, 2);
+	put_le (buf + 8, time, 8);
+	writer->crc = batchfmt_crc32 (0, buf, BATCHFMT_HEADER_SIZE);
+	return BATCHFMT_HEADER_SIZE;
+}
+
+/* Encode a record into buf, which must have room for
+ * BATCHFMT_RECORD_BOUND(len) bytes. bytes is only stored with
+ * BATCHFMT_OP_WRITTEN. Returns 0 if out of memory. */
+size_t batchfmt_write_record (BatchfmtWriter* writer, BatchfmtOp op, uint64_t time, const char* path, size_t len, uint64_t bytes, unsigned char* buf) {
+	size_t prefix = 0;
+	size_t n = 0;
+
+	if (len + 1 > writer->prev_size) {
+		size_t size = writer->prev_size ? writer->prev_size : 256;
+		while (size < len + 1) {
+			size *= 2;
+		}
+		char* prev = (char*) realloc (writer->prev, size);
+		if (!prev) {
+			return 0;
+		}
+		writer->prev = prev;
+		writer->prev_size = size;
+	}
+
+	while (prefix < len && prefix < writer->prev_len && path[prefix] == writer->prev[prefix]) {
+		prefix++;
+	}
+	// events from different threads may be a bit out of order
+	if (time < writer->time) {
+		time = writer->time;
+	}
+
+	buf[n++] = op;
+	n += put_varint (buf + n, time - writer->time);
+	n += put_varint (buf + n, prefix);
+	n += put_varint (buf + n, len - prefix);
+	memcpy (buf + n, path + prefix, len - prefix);
+	n += len - prefix;
+	if (op == BATCHFMT_OP_WRITTEN) {
+		n += put_varint (buf + n, bytes);
+	}
+
+	memcpy (writer->prev + prefix, path + prefix, len - prefix);
+	writer->prev_len = len;
+	writer->time = time;
+	writer->crc = batchfmt_crc32 (writer->crc, buf, n);
+	return n;
+}
+
+size_t batchfmt_write_trailer (BatchfmtWriter* writer, unsigned char* buf) {
+	buf[0] = BATCHFMT_OP_END;
+	put_le (buf + 1, batchfmt_crc32 (writer->crc, buf, 1), 4);
+	return BATCHFMT_TRAILER_SIZE;
+}
+
+void batchfmt_writer_free (BatchfmtWriter* writer) {
+	free (writer->prev);
+	writer->prev = NULL;
+	writer->prev_len = writer->prev_size = 0;
+}
+
+// returns 0 if the header is not valid
+int batchfmt_reader_init (BatchfmtReader* reader, const void* data, size_t size) {
+	memset (reader, 0, sizeof (BatchfmtReader));
+	reader->data = (const unsigned char*) data;
+	reader->size = size;
+
+	if (size < BATCHFMT_HEADER_SIZE || !batchfmt_is_binary (data, size) || reader->data[4] < BATCHFMT_MIN_VERSION || reader->data[4] > BATCHFMT_VERSION) {
+		return 0;
+	}
+	reader->time = get_le (reader->data + 8, 8);
+	reader->crc = batchfmt_crc32 (0, data, BATCHFMT_HEADER_SIZE);
+	reader->pos = BATCHFMT_HEADER_SIZE;
+	return 1;
+}
+
+static int get_varint (BatchfmtReader* reader, size_t* pos, uint64_t* value) {
+	int shift = 0;
+	*value = 0;
+	while (*pos < reader->size && shift < 64) {
+		unsigned char byte = reader->data[(*pos)++];
+		*value |= (uint64_t) (byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			return 1;
+		}
+		shift += 7;
+	}
+	return 0;
+}
+
+/* Decode the next record. A record is consumed only when complete, so
+ * after BATCHFMT_TRUNCATED reader->pos is the end of the valid data. */
+BatchfmtStatus batchfmt_read (BatchfmtReader* reader, BatchfmtRecord* record) {
+	size_t pos = reader->pos;
+	uint64_t delta, prefix, suffix;
+	uint64_t bytes = 0;
+
+	if (pos >= reader->size) {
+		return BATCHFMT_TRUNCATED;
+	}
+
+	BatchfmtOp op = (BatchfmtOp) reader->data[pos++];
+	if (op == BATCHFMT_OP_END) {
+		if (reader->size - pos < 4) {
+			return BATCHFMT_TRUNCATED;
+		}
+		uint32_t crc = batchfmt_crc32 (reader->crc, reader->data + reader->pos, 1);
+		if (get_le (reader->data + pos, 4) != crc) {
+			return BATCHFMT_CHECKSUM;
+		}
+		return pos + 4 == reader->size ? BATCHFMT_EOF : BATCHFMT_CORRUPT;
+	}
+	if (op != BATCHFMT_OP_NOREC && op != BATCHFMT_OP_REC && op != BATCHFMT_OP_WRITTEN) {
+		return BATCHFMT_CORRUPT;
+	}
+
+	if (!get_varint (reader, &pos, &delta) || !get_varint (reader, &pos, &prefix) || !get_varint (reader, &pos, &suffix)) {
+		return BATCHFMT_TRUNCATED;
+	}
+	if (prefix > reader->path_len) {
+		return BATCHFMT_CORRUPT;
+	}
+	if (suffix > reader->size - pos) {
+		return BATCHFMT_TRUNCATED;
+	}
+	size_t end = pos + suffix;
+	if (op == BATCHFMT_OP_WRITTEN && !get_varint (reader, &end, &bytes)) {
+		return BATCHFMT_TRUNCATED;
+	}
+
+	size_t len = prefix + suffix;
+	if (len + 1 > reader->path_size) {
+		size_t size = reader->path_size ? reader->path_size : 256;
+		while (size < len + 1) {
+			size *= 2;
+		}
+		char* path = (char*) realloc (reader->path, size);
+		if (!path) {
+			return BATCHFMT_CORRUPT;
+		}
+		reader->path = path;
+		reader->path_size = size;
+	}
+	memcpy (reader->path + prefix, reader->data + pos, suffix);
+	reader->path[len] = '\0';
+	reader->path_len = len;
+	pos = end;
+
+	reader->crc = batchfmt_crc32 (reader->crc, reader->data + reader->pos, pos - reader->pos);
+	reader->pos = pos;
+	reader->time += delta;
+
+	record->op = op;
+	record->time = reader->time;
+	record->path = reader->path;
+	record->len = len;
+	record->bytes = bytes;
+	return BATCHFMT_RECORD;
+}
+
+void batchfmt_reader_free (BatchfmtReader* reader) {
+	free (reader->path);
+	reader->path = NULL;
+}
+
+const char* batchfmt_strerror (BatchfmtStatus status) {
+	switch (status) {
+	case BATCHFMT_RECORD:
+	case BATCHFMT_EOF:
+		return "success";
+	case BATCHFMT_TRUNCATED:
+		return "truncated batch";
+	case BATCHFMT_CORRUPT:
+		return "corrupted batch";
+	case BATCHFMT_CHECKSUM:
+		return "checksum mismatch";
+	}
+	return "unknown error";
+}
+
+/* Make a batch left without trailer readable in strict mode: drop the
+ * last incomplete record and append the trailer. Returns the number of
+ * records, or -1 with errno set. */
+int batchfmt_seal_file (const char* path) {
+	unsigned char* data = NULL;
+	BatchfmtReader reader;
+	BatchfmtRecord record;
+	BatchfmtStatus status;
+	struct stat st;
+	int records = 0;
+	int ret = -1;
+
+	int fd = open (path, O_RDWR);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat (fd, &st) < 0) {
+		goto cleanup;
+	}
+	data = (unsigned char*) malloc (st.st_size ? st.st_size : 1);
+	if (!data) {
+		goto cleanup;
+	}
+	if (pread (fd, data, st.st_size, 0) != st.st_size) {
+		errno = EIO;
+		goto cleanup;
+	}
+
+	if (!batchfmt_reader_init (&reader, data, st.st_size)) {
+		errno = EINVAL;
+		goto cleanup;
+	}
+	while ((status = batchfmt_read (&reader, &record)) == BATCHFMT_RECORD) {
+		records++;
+	}
+	batchfmt_reader_free (&reader);
+
+	if (status == BATCHFMT_TRUNCATED) {
+		unsigned char trailer[BATCHFMT_TRAILER_SIZE];
+		BatchfmtWriter writer;
+		memset (&writer, 0, sizeof (writer));
+		writer.crc = reader.crc;
+		batchfmt_write_trailer (&writer, trailer);
+
+		if (ftruncate (fd, reader.pos) < 0 ||
+			pwrite (fd, trailer, BATCHFMT_TRAILER_SIZE, reader.pos) != BATCHFMT_TRAILER_SIZE ||
+			fsync (fd) < 0) {
+			goto cleanup;
+		}
+	} else if (status != BATCHFMT_EOF) {
+		errno = EINVAL;
+		goto cleanup;
+	}
+	ret = records;
+
+cleanup:
+	free (data);
+	close (fd);
+	return ret;
+}
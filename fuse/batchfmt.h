@@ -0,0 +1,125 @@
+/*
+ *  batchfmt.h - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SFS_BATCHFMT_H
+#define SFS_BATCHFMT_H
+
+/* Binary batch format, version 3. All integers are little endian.
+ *
+ * header:  "SFSB", version (u8), flags (u8, 0), reserved (u16, 0),
+ *          base time in microseconds (u64)
+ * record:  op (u8), time delta from the previous record in microseconds
+ *          (varint), length of the prefix shared with the previous path
+ *          (varint), length of the rest of the path (varint), rest of
+ *          the path, and for BATCHFMT_OP_WRITTEN the bytes written to
+ *          the file (varint)
+ * trailer: BATCHFMT_OP_END (u8), crc32 of all the previous bytes (u32)
+ *
+ * Varints are unsigned LEB128. A batch without trailer was being written
+ * when SFS stopped, its complete records are still valid.
+ *
+ * This header and batchfmt.c only depend on libc, and are also built as
+ * libsfsbatch.a for the consumers of the batches. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BATCHFMT_MAGIC "SFSB"
+#define BATCHFMT_VERSION 3
+// version 2 has no BATCHFMT_OP_WRITTEN records, it's still read
+#define BATCHFMT_MIN_VERSION 2
+#define BATCHFMT_HEADER_SIZE 16
+#define BATCHFMT_TRAILER_SIZE 5
+
+typedef enum {
+	BATCHFMT_OP_END,
+	BATCHFMT_OP_NOREC,
+	BATCHFMT_OP_REC,
+	// a norec event that knows how much of the file was written
+	BATCHFMT_OP_WRITTEN
+} BatchfmtOp;
+
+typedef enum {
+	BATCHFMT_RECORD = 1,
+	BATCHFMT_EOF = 0,
+	// no trailer, the batch was not sealed
+	BATCHFMT_TRUNCATED = -1,
+	BATCHFMT_CORRUPT = -2,
+	BATCHFMT_CHECKSUM = -3
+} BatchfmtStatus;
+
+typedef struct {
+	char* prev;
+	size_t prev_len;
+	size_t prev_size;
+	uint64_t time;
+	uint32_t crc;
+} BatchfmtWriter;
+
+typedef struct {
+	const unsigned char* data;
+	size_t size;
+	size_t pos;
+	uint64_t time;
+	char* path;
+	size_t path_len;
+	size_t path_size;
+	uint32_t crc;
+} BatchfmtReader;
+
+typedef struct {
+	BatchfmtOp op;
+	uint64_t time;
+	// valid until the next call, zero-terminated
+	const char* path;
+	size_t len;
+	// bytes written, 0 unless BATCHFMT_OP_WRITTEN
+	uint64_t bytes;
+} BatchfmtRecord;
+
+uint32_t batchfmt_crc32 (uint32_t crc, const void* data, size_t len);
+int batchfmt_is_binary (const void* data, size_t size);
+
+// buf must have room for BATCHFMT_HEADER_SIZE bytes
+size_t batchfmt_writer_init (BatchfmtWriter* writer, uint64_t time, unsigned char* buf);
+// bytes needed to encode a record of a path of len bytes
+#define BATCHFMT_RECORD_BOUND(len) ((len) + 41)
+size_t batchfmt_write_record (BatchfmtWriter* writer, BatchfmtOp op, uint64_t time, const char* path, size_t len, uint64_t bytes, unsigned char* buf);
+// buf must have room for BATCHFMT_TRAILER_SIZE bytes
+size_t batchfmt_write_trailer (BatchfmtWriter* writer, unsigned char* buf);
+void batchfmt_writer_free (BatchfmtWriter* writer);
+
+int batchfmt_reader_init (BatchfmtReader* reader, const void* data, size_t size);
+BatchfmtStatus batchfmt_read (BatchfmtReader* reader, BatchfmtRecord* record);
+void batchfmt_reader_free (BatchfmtReader* reader);
+const char* batchfmt_strerror (BatchfmtStatus status);
+
+int batchfmt_seal_file (const char* path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,259 @@
+/*
+ *  checksum.c - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* sfs-checksum: content hashes of the files of a batch, from the xattr
+ * stored by SFS while they were written when it still matches their size
+ * and mtime, otherwise by reading them. Run on both sides, the lists
+ * tell which files actually differ, without rsync -c reading them all
+ * again. A file that can't be hashed gets "-", which never matches. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "hash.h"
+#include "path.h"
+
+typedef struct {
+	char* hash;
+	char* path;
+} Entry;
+
+static int store = 0;
+static int cached_only = 0;
+static int verbose = 0;
+
+static void usage (void) {
+	fprintf (stderr, "Usage: sfs-checksum [-w] [-n] [-v] [-d LIST] ROOT [PATH...]\n\n");
+	fprintf (stderr, "Print the hash of each path, read from stdin if none is given.\n\n");
+	fprintf (stderr, "  -d  print only the paths whose hash differs from LIST, the output\n");
+	fprintf (stderr, "      of sfs-checksum on the other side\n");
+	fprintf (stderr, "  -n  don't read the files without a valid stored hash\n");
+	fprintf (stderr, "  -w  store the hashes computed by reading the files\n");
+	fprintf (stderr, "  -v  report the files that had to be read\n");
+}
+
+static int same_file (const struct stat* a, const struct stat* b) {
+	return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* Hash of root/path in hash, "-" if unknown. */
+static void checksum (const char* root, const char* path, char* hash) {
+	char value[HASH_XATTR_MAX];
+	char* fullpath = NULL;
+	struct stat st, after;
+	uint64_t digest;
+	int fd = -1;
+
+	strcpy (hash, "-");
+	if (!path_valid (path) || asprintf (&fullpath, "%s%s", root, path) < 0) {
+		fullpath = NULL;
+		goto cleanup;
+	}
+	fd = open (fullpath, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	if (fd < 0 || fstat (fd, &st) < 0 || !S_ISREG (st.st_mode)) {
+		goto cleanup;
+	}
+
+	ssize_t len = fgetxattr (fd, HASH_XATTR, value, sizeof (value));
+	if (len > 0 && hash_parse (value, len, &st, &digest)) {
+		sprintf (hash, "%016llx", (unsigned long long) digest);
+		goto cleanup;
+	}
+	if (cached_only) {
+		goto cleanup;
+	}
+
+	if (verbose) {
+		fprintf (stderr, "reading %s\n", path);
+	}
+	if (!hash_fd (fd, &digest)) {
+		fprintf (stderr, "sfs-checksum: cannot read %s: %s\n", fullpath, strerror (errno));
+		goto cleanup;
+	}
+	// written meanwhile, the hash may be of neither content
+	if (fstat (fd, &after) < 0 || !same_file (&st, &after)) {
+		goto cleanup;
+	}
+	sprintf (hash, "%016llx", (unsigned long long) digest);
+
+	if (store) {
+		len = hash_format (value, digest, &st);
+		if (fsetxattr (fd, HASH_XATTR, value, len, 0) < 0) {
+			fprintf (stderr, "sfs-checksum: cannot store the hash of %s: %s\n", fullpath, strerror (errno));
+		}
+	}
+
+cleanup:
+	if (fd >= 0) {
+		close (fd);
+	}
+	free (fullpath);
+}
+
+static int entry_cmp (const void* a, const void* b) {
+	return strcmp (((const Entry*) a)->path, ((const Entry*) b)->path);
+}
+
+// hashes printed by sfs-checksum, sorted by path, count is -1 on error
+static Entry* read_list (const char* list, int* count) {
+	FILE* file = fopen (list, "r");
+	Entry* entries = NULL;
+	int size = 0;
+	char* line = NULL;
+	size_t linesize = 0;
+	ssize_t len;
+
+	*count = 0;
+	if (!file) {
+		fprintf (stderr, "sfs-checksum: cannot open %s: %s\n", list, strerror (errno));
+		*count = -1;
+		return NULL;
+	}
+	while ((len = getline (&line, &linesize, file)) > 0) {
+		if (line[len - 1] == '\n') {
+			line[len - 1] = '\0';
+		}
+		char* tab = strchr (line, '\t');
+		if (!tab) {
+			continue;
+		}
+		*tab = '\0';
+		if (*count == size) {
+			size = size ? size * 2 : 1024;
+			Entry* grown = realloc (entries, size * sizeof (Entry));
+			if (!grown) {
+				fprintf (stderr, "sfs-checksum: out of memory\n");
+				exit (1);
+			}
+			entries = grown;
+		}
+		entries[*count].hash = strdup (line);
+		entries[*count].path = strdup (tab + 1);
+		if (!entries[*count].hash || !entries[*count].path) {
+			fprintf (stderr, "sfs-checksum: out of memory\n");
+			exit (1);
+		}
+		(*count)++;
+	}
+	if (ferror (file)) {
+		fprintf (stderr, "sfs-checksum: cannot read %s: %s\n", list, strerror (errno));
+		*count = -1;
+	}
+	free (line);
+	fclose (file);
+	if (*count < 0) {
+		return NULL;
+	}
+
+	qsort (entries, *count, sizeof (Entry), entry_cmp);
+	return entries;
+}
+
+static void emit (const char* root, const char* path, Entry* other, int nother, int compare) {
+	char hash[32];
+
+	checksum (root, path, hash);
+	if (!compare) {
+		printf ("%s\t%s\n", hash, path);
+		return;
+	}
+
+	Entry key = { NULL, (char*) path };
+	Entry* found = bsearch (&key, other, nother, sizeof (Entry), entry_cmp);
+	if (!found || !strcmp (hash, "-") || strcmp (found->hash, hash)) {
+		printf ("%s\n", path);
+	}
+}
+
+int main (int argc, char** argv) {
+	const char* list = NULL;
+	Entry* other = NULL;
+	int nother = 0;
+	int opt;
+
+	while ((opt = getopt (argc, argv, "d:nwvh")) != -1) {
+		switch (opt) {
+		case 'd':
+			list = optarg;
+			break;
+		case 'n':
+			cached_only = 1;
+			break;
+		case 'w':
+			store = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage ();
+			return 2;
+		}
+	}
+	if (argc - optind < 1) {
+		usage ();
+		return 2;
+	}
+
+	// batch paths are absolute within the root
+	char* root = argv[optind++];
+	path_trim_root (root);
+
+	if (list) {
+		other = read_list (list, &nother);
+		if (nother < 0) {
+			return 1;
+		}
+	}
+
+	if (optind < argc) {
+		for (; optind < argc; optind++) {
+			emit (root, argv[optind], other, nother, list != NULL);
+		}
+	} else {
+		char* line = NULL;
+		size_t size = 0;
+		ssize_t linelen;
+		while ((linelen = getline (&line, &size, stdin)) > 0) {
+			if (line[linelen - 1] == '\n') {
+				line[--linelen] = '\0';
+			}
+			if (linelen > 0) {
+				emit (root, line, other, nother, list != NULL);
+			}
+		}
+		free (line);
+	}
+
+	if (fflush (stdout) != 0) {
+		fprintf (stderr, "sfs-checksum: cannot write: %s\n", strerror (errno));
+		return 1;
+	}
+	return 0;
+}
@@ -37,6 +37,9 @@
 #include "config.h"
 #include "util.h"
 #include "setproctitle.h"
+#include "pool.h"
+#include "window.h"
+#include "batch.h"
 
 static UpdateMTime parse_update_mtime (const char* value) {
 	UpdateMTime res = UPDATE_MTIME_TOUCH;
@@ -52,6 +55,42 @@ static UpdateMTime parse_update_mtime (const char* value) {
 	return res;
 }
 
+static BatchOverflow parse_batch_overflow (const char* value) {
+	BatchOverflow res = BATCH_OVERFLOW_BLOCK;
+	if (!strcmp (value, "block")) {
+		res = BATCH_OVERFLOW_BLOCK;
+	} else if (!strcmp (value, "drop")) {
+		res = BATCH_OVERFLOW_DROP;
+	} else {
+		syslog (LOG_WARNING, "Unknown batch_queue_overflow value %s, fallback to block", value);
+	}
+	return res;
+}
+
+static BatchFormat parse_batch_format (const char* value) {
+	BatchFormat res = BATCH_FORMAT_TEXT;
+	if (!strcmp (value, "text")) {
+		res = BATCH_FORMAT_TEXT;
+	} else if (!strcmp (value, "binary")) {
+		res = BATCH_FORMAT_BINARY;
+	} else {
+		syslog (LOG_WARNING, "Unknown batch_format value %s, fallback to text", value);
+	}
+	return res;
+}
+
+static BatchShardKey parse_batch_shard_key (const char* value) {
+	BatchShardKey res = BATCH_SHARD_PATH;
+	if (!strcmp (value, "path")) {
+		res = BATCH_SHARD_PATH;
+	} else if (!strcmp (value, "top")) {
+		res = BATCH_SHARD_TOP;
+	} else {
+		syslog (LOG_WARNING, "Unknown batch_shard_key value %s, fallback to path", value);
+	}
+	return res;
+}
+
 static int parse_facility (const char* facility) {
 	int res = -1;
 	if (!strcmp (facility, "authpriv")) {
@@ -141,12 +180,64 @@ static int ini_handler (void* userdata, const char* section, const char* name,
 		state->batch_max_events = atoi (value);
 	} else if (MATCH("sfs", "batch_max_bytes")) {
 		state->batch_max_bytes = atoll (value);
+	} else if (MATCH("sfs", "batch_large_bytes")) {
+		state->batch_large_bytes = atoll (value);
+	} else if (MATCH("sfs", "batch_adaptive")) {
+		state->batch_adaptive = atoi (value);
+	} else if (MATCH("sfs", "batch_adaptive_max_events")) {
+		state->batch_adaptive_max_events = atoi (value);
 	} else if (MATCH("sfs", "use_osync")) {
 		state->use_osync = atoi (value);
+	} else if (MATCH("sfs", "batch_format")) {
+		state->batch_format = parse_batch_format (value);
+	} else if (MATCH("sfs", "batch_dedup_max_bytes")) {
+		state->batch_dedup_max_bytes = atoll (value);
+	} else if (MATCH("sfs", "batch_dedup_window")) {
+		state->batch_dedup_window = atoi (value);
+	} else if (MATCH("sfs", "batch_shards")) {
+		state->batch_shards = atoi (value);
+	} else if (MATCH("sfs", "batch_shard_key")) {
+		state->batch_shard_key = parse_batch_shard_key (value);
+	} else if (MATCH("sfs", "batch_queue_size")) {
+		state->batch_queue_size = atoi (value);
+	} else if (MATCH("sfs", "batch_queue_overflow")) {
+		state->batch_queue_overflow = parse_batch_overflow (value);
+	} else if (MATCH("sfs", "batch_group_commit")) {
+		state->batch_group_commit = atoi (value);
+	} else if (MATCH("sfs", "batch_commit_window_usec")) {
+		state->batch_commit_window_usec = atoi (value);
+	} else if (MATCH("sfs", "batch_commit_max_events")) {
+		state->batch_commit_max_events = atoi (value);
+	} else if (MATCH("sfs", "batch_io_uring")) {
+		state->batch_io_uring = atoi (value);
+	} else if (MATCH("sfs", "batch_pool_size")) {
+		state->batch_pool_size = atoi (value);
+	} else if (MATCH("sfs", "batch_pool_prealloc")) {
+		state->batch_pool_prealloc = atoll (value);
 	} else if (MATCH("sfs", "forbid_older_mtime")) {
 		state->forbid_older_mtime = atoi (value);
 	} else if (MATCH("sfs", "update_mtime")) {
 		state->update_mtime = parse_update_mtime (value);
+	} else if (MATCH("sfs", "cred_cache_ttl_msec")) {
+		state->cred_cache_ttl_msec = atoi (value);
+	} else if (MATCH("sfs", "content_hash")) {
+		state->content_hash = atoi (value);
+	} else if (MATCH("sfs", "rename_journal_dir")) {
+		if (value[0] != '\0') {
+			state->rename_journal_dir = strndup (value, PATH_MAX);
+		}
+	} else if (MATCH("sfs", "extent_journal_dir")) {
+		if (value[0] != '\0') {
+			state->extent_journal_dir = strndup (value, PATH_MAX);
+		}
+	} else if (MATCH("sfs", "stats_path")) {
+		if (value[0] != '\0') {
+			state->stats_path = strndup (value, PATH_MAX);
+		}
+	} else if (MATCH("sfs", "stats_interval_msec")) {
+		long long msec = atoll(value);
+		state->stats_interval_ts.tv_sec = msec/1000;
+		state->stats_interval_ts.tv_nsec = (msec%1000) * 1000000;
 	} else if (MATCH("log", "ident")) {
 		state->log_ident = strdup (value);
 	} else if (MATCH("log", "facility")) {
@@ -181,10 +272,42 @@ static int config_check (SfsState* state) {
 		syslog(LOG_ERR, "[config] sfs/batch_max_events must be > 0");
 		goto error;
 	}
+	if (state->batch_adaptive && state->batch_adaptive_max_events < state->batch_max_events) {
+		syslog(LOG_ERR, "[config] sfs/batch_adaptive_max_events must be >= batch_max_events");
+		goto error;
+	}
 	if (state->batch_max_bytes <= 0) {
 		syslog(LOG_ERR, "[config] sfs/batch_max_bytes must be > 0");
 		goto error;
 	}
+	if (state->batch_queue_size <= 0) {
+		syslog(LOG_ERR, "[config] sfs/batch_queue_size must be > 0");
+		goto error;
+	}
+	if (state->batch_commit_window_usec < 0 || state->batch_commit_window_usec >= 1000000) {
+		syslog(LOG_ERR, "[config] sfs/batch_commit_window_usec must be >= 0 and < 1000000");
+		goto error;
+	}
+	if (state->batch_commit_max_events <= 0 || state->batch_commit_max_events > IOV_MAX) {
+		syslog(LOG_ERR, "[config] sfs/batch_commit_max_events must be > 0 and <= %d", IOV_MAX);
+		goto error;
+	}
+	if (state->batch_dedup_window < 0 || state->batch_dedup_window > WINDOW_MAX_BATCHES) {
+		syslog(LOG_ERR, "[config] sfs/batch_dedup_window must be >= 0 and <= %d", WINDOW_MAX_BATCHES);
+		goto error;
+	}
+	if (state->batch_shards <= 0 || state->batch_shards > BATCH_MAX_SHARDS) {
+		syslog(LOG_ERR, "[config] sfs/batch_shards must be > 0 and <= %d", BATCH_MAX_SHARDS);
+		goto error;
+	}
+	if (state->batch_pool_size < 0 || state->batch_pool_size > POOL_MAX_FILES) {
+		syslog(LOG_ERR, "[config] sfs/batch_pool_size must be >= 0 and <= %d", POOL_MAX_FILES);
+		goto error;
+	}
+	if (state->stats_interval_ts.tv_sec <= 0 && state->stats_interval_ts.tv_nsec <= 0) {
+		syslog(LOG_ERR, "[config] sfs/stats_interval_msec must be > 0");
+		goto error;
+	}
 	if (!state->log_ident) {
 		state->log_ident = strdup ("sfs-fuse");
 	}
@@ -205,6 +328,15 @@ error:
 static void config_init (SfsState* state) {
 	state->log_facility = -1;
 	state->update_mtime = UPDATE_MTIME_NO;
+	state->cred_cache_ttl_msec = 60000;
+	state->batch_queue_size = 65536;
+	state->batch_dedup_max_bytes = 1024 * 1024;
+	state->batch_commit_window_usec = 1000;
+	state->batch_commit_max_events = 128;
+	state->batch_pool_size = 4;
+	state->batch_shards = 1;
+	state->batch_adaptive_max_events = 100000;
+	state->stats_interval_ts.tv_sec = 10;
 	strcpy (state->hostname, "invalid");
 }
 
@@ -258,6 +390,9 @@ int sfs_config_reload (void) {
 	OLDSFREE(batch_tmp_dir);
 	OLDSFREE(node_name);
 	OLDSFREE(ignore_path_prefix);
+	OLDSFREE(rename_journal_dir);
+	OLDSFREE(extent_journal_dir);
+	OLDSFREE(stats_path);
 	OLDSFREE(log_ident);
 
 	#define NSET(x) state->x = new_state.x;
@@ -268,10 +403,30 @@ int sfs_config_reload (void) {
 	NSET(batch_flush_ts);
 	NSET(batch_max_events);
 	NSET(batch_max_bytes);
+	NSET(batch_large_bytes);
+	NSET(batch_adaptive);
+	NSET(batch_adaptive_max_events);
 	NSET(ignore_path_prefix);
 	NSET(use_osync);
+	// the queue, the ring, the dedup sets and the shards are set up once,
+	// batch_queue_size, batch_io_uring, batch_dedup_max_bytes,
+	// batch_dedup_window, batch_shards and batch_shard_key are only read
+	// at startup
+	NSET(batch_format);
+	NSET(batch_queue_overflow);
+	NSET(batch_group_commit);
+	NSET(batch_commit_window_usec);
+	NSET(batch_commit_max_events);
+	NSET(batch_pool_size);
+	NSET(batch_pool_prealloc);
 	NSET(update_mtime);
 	NSET(forbid_older_mtime);
+	NSET(cred_cache_ttl_msec);
+	NSET(content_hash);
+	NSET(rename_journal_dir);
+	NSET(extent_journal_dir);
+	NSET(stats_path);
+	NSET(stats_interval_ts);
 	NSET(log_ident);
 	NSET(log_facility);
 	NSET(log_debug);
@@ -290,6 +445,9 @@ error:
 	NSFREE(batch_tmp_dir);
 	NSFREE(node_name);
 	NSFREE(ignore_path_prefix);
+	NSFREE(rename_journal_dir);
+	NSFREE(extent_journal_dir);
+	NSFREE(stats_path);
 	NSFREE(log_ident);
 	
 	pthread_mutex_unlock (&(state->config_mutex));
@@ -0,0 +1,255 @@
+/*
+ *  creds.c - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "sfs.h"
+#include "creds.h"
+#include "stats.h"
+
+/* Cache of the supplementary groups of (uid, gid) pairs, to avoid an NSS
+ * lookup for every operation with --perms. Entries expire after
+ * cred_cache_ttl_msec, and the whole cache is dropped as soon as
+ * /etc/passwd or /etc/group are seen changing. */
+
+#define CREDS_BUCKETS 256
+// drop everything rather than growing without bounds
+#define CREDS_MAX_ENTRIES 4096
+#define CREDS_CHECK_MSEC 1000
+
+typedef struct _CredsEntry {
+	uid_t uid;
+	gid_t gid;
+	int ngroups;
+	gid_t* groups;
+	int64_t expire_msec;
+	struct _CredsEntry* next;
+} CredsEntry;
+
+static CredsEntry* creds_buckets[CREDS_BUCKETS];
+static int creds_count = 0;
+static pthread_rwlock_t creds_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static pthread_mutex_t creds_check_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile int64_t creds_check_msec = 0;
+static struct stat creds_passwd_st;
+static struct stat creds_group_st;
+
+static int64_t creds_now_msec (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned int creds_hash (uid_t uid, gid_t gid) {
+	return (uid * 2654435761U ^ gid) % CREDS_BUCKETS;
+}
+
+/* Get the supplementary groups of uid, including gid. Returns the number of
+ * groups in the allocated list, 0 if uid has no passwd entry, -1 on error. */
+static int creds_resolve (uid_t uid, gid_t gid, gid_t** groups) {
+	struct passwd pwd, *result = NULL;
+	char buf[4096];
+
+	*groups = NULL;
+	int err = getpwuid_r (uid, &pwd, buf, sizeof (buf), &result);
+	if (err) {
+		syslog(LOG_CRIT, "[access] cannot read /etc/passwd: %s", strerror(err));
+		return -1;
+	}
+	if (!result) {
+		return 0;
+	}
+
+	int ngroups = 32;
+	while (1) {
+		gid_t* list = realloc (*groups, ngroups * sizeof (gid_t));
+		if (!list) {
+			syslog(LOG_CRIT, "[access] cannot allocate groups for user %s", pwd.pw_name);
+			free (*groups);
+			*groups = NULL;
+			return -1;
+		}
+		*groups = list;
+
+		int n = ngroups;
+		if (getgrouplist (pwd.pw_name, gid, *groups, &n) >= 0) {
+			return n;
+		}
+		// n has been set to the needed size
+		ngroups = n > ngroups ? n : ngroups * 2;
+	}
+}
+
+static void creds_flush (void) {
+	int i;
+
+	pthread_rwlock_wrlock (&creds_lock);
+	for (i=0; i < CREDS_BUCKETS; i++) {
+		CredsEntry* entry = creds_buckets[i];
+		while (entry) {
+			CredsEntry* next = entry->next;
+			free (entry->groups);
+			free (entry);
+			entry = next;
+		}
+		creds_buckets[i] = NULL;
+	}
+	creds_count = 0;
+	pthread_rwlock_unlock (&creds_lock);
+
+	stats_inc (STAT_CRED_CACHE_FLUSHES);
+}
+
+static int creds_file_changed (const char* path, struct stat* old) {
+	struct stat st;
+	if (stat (path, &st) < 0) {
+		memset (&st, 0, sizeof (st));
+	}
+
+	int changed = st.st_ino != old->st_ino || st.st_size != old->st_size
+		|| st.st_mtim.tv_sec != old->st_mtim.tv_sec
+		|| st.st_mtim.tv_nsec != old->st_mtim.tv_nsec;
+	*old = st;
+	return changed;
+}
+
+// stat the files at most once per CREDS_CHECK_MSEC, by a single thread
+static void creds_check_files (int64_t now) {
+	if (now - creds_check_msec < CREDS_CHECK_MSEC) {
+		return;
+	}
+	if (pthread_mutex_trylock (&creds_check_mutex) != 0) {
+		return;
+	}
+
+	if (now - creds_check_msec >= CREDS_CHECK_MSEC) {
+		creds_check_msec = now;
+		// no short-circuit, both stats must be updated
+		int changed = creds_file_changed ("/etc/passwd", &creds_passwd_st);
+		changed |= creds_file_changed ("/etc/group", &creds_group_st);
+		if (changed) {
+			creds_flush ();
+		}
+	}
+
+	pthread_mutex_unlock (&creds_check_mutex);
+}
+
+static gid_t* creds_copy (const gid_t* groups, int ngroups) {
+	gid_t* copy = malloc ((ngroups ? ngroups : 1) * sizeof (gid_t));
+	if (!copy) {
+		syslog(LOG_CRIT, "[access] cannot allocate groups");
+		return NULL;
+	}
+	memcpy (copy, groups, ngroups * sizeof (gid_t));
+	return copy;
+}
+
+static void creds_store (uid_t uid, gid_t gid, const gid_t* groups, int ngroups, int64_t expire) {
+	gid_t* copy = creds_copy (groups, ngroups);
+	if (!copy) {
+		return;
+	}
+
+	unsigned int h = creds_hash (uid, gid);
+	pthread_rwlock_wrlock (&creds_lock);
+	CredsEntry* entry = creds_buckets[h];
+	while (entry && (entry->uid != uid || entry->gid != gid)) {
+		entry = entry->next;
+	}
+
+	if (!entry) {
+		if (creds_count >= CREDS_MAX_ENTRIES) {
+			pthread_rwlock_unlock (&creds_lock);
+			creds_flush ();
+			pthread_rwlock_wrlock (&creds_lock);
+		}
+
+		entry = calloc (1, sizeof (CredsEntry));
+		if (!entry) {
+			pthread_rwlock_unlock (&creds_lock);
+			free (copy);
+			return;
+		}
+		entry->uid = uid;
+		entry->gid = gid;
+		entry->next = creds_buckets[h];
+		creds_buckets[h] = entry;
+		creds_count++;
+	}
+
+	free (entry->groups);
+	entry->groups = copy;
+	entry->ngroups = ngroups;
+	entry->expire_msec = expire;
+	pthread_rwlock_unlock (&creds_lock);
+}
+
+/* Same as creds_resolve(), through the cache. The returned list must be
+ * freed by the caller. */
+int creds_get_groups (uid_t uid, gid_t gid, gid_t** groups) {
+	int ttl = SFS_STATE->cred_cache_ttl_msec;
+	if (ttl <= 0) {
+		return creds_resolve (uid, gid, groups);
+	}
+
+	int64_t now = creds_now_msec ();
+	creds_check_files (now);
+
+	int ngroups = -1;
+	pthread_rwlock_rdlock (&creds_lock);
+	CredsEntry* entry = creds_buckets[creds_hash (uid, gid)];
+	while (entry && (entry->uid != uid || entry->gid != gid)) {
+		entry = entry->next;
+	}
+	if (entry && entry->expire_msec > now) {
+		*groups = creds_copy (entry->groups, entry->ngroups);
+		if (*groups) {
+			ngroups = entry->ngroups;
+		}
+	}
+	pthread_rwlock_unlock (&creds_lock);
+
+	if (ngroups >= 0) {
+		stats_inc (STAT_CRED_CACHE_HITS);
+		return ngroups;
+	}
+
+	stats_inc (STAT_CRED_CACHE_MISSES);
+	ngroups = creds_resolve (uid, gid, groups);
+	if (ngroups >= 0) {
+		// unknown users are cached too
+		creds_store (uid, gid, *groups, ngroups, now + ttl);
+	}
+	return ngroups;
+}
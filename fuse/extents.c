@@ -0,0 +1,406 @@
+/*
+ *  extents.c - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Dirty ranges of the files written through SFS. Each writable handle
+ * merges the ranges of its writes, and on release they become a record
+ * of the extents journal of the batch, next to the rename journal. The
+ * record is only valid if the handle was the only way the file changed
+ * meanwhile: the open inodes are registered, and a second writer or a
+ * truncate by path bumps the generation of the inode, voiding the
+ * records of its handles.
+ *
+ * With content_hash the handle also hashes what's written sequentially
+ * from the start of the file. If that's the whole file at release, the
+ * hash is stored in the HASH_XATTR xattr with its size and mtime, for
+ * sfs-checksum. Any other write voids it like the ranges. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/xattr.h>
+
+#include "sfs.h"
+#include "extents.h"
+#include "hash.h"
+
+#define EXTENTS_BUCKETS 1024
+
+typedef struct ExtentsInode {
+	dev_t dev;
+	ino_t ino;
+	int writers;
+	uint64_t generation;
+	struct ExtentsInode* next;
+} ExtentsInode;
+
+struct SfsExtents {
+	pthread_mutex_t mutex;
+	ExtentsInode* inode;
+	uint64_t generation;
+	off_t open_size;
+	struct timespec open_mtime;
+	// lowest size the handle truncated the file to
+	off_t trunc_size;
+	// ranges are tracked for the journal
+	int journal;
+	SfsExtent* ranges;
+	int count;
+	int size;
+	// the ranges are not known anymore
+	int invalid;
+	// content hash of the first hash_pos bytes, NULL once void
+	int hashing;
+	SfsHash* hash;
+	uint64_t hash_pos;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	ExtentsInode* buckets[EXTENTS_BUCKETS];
+	volatile int count;
+} registry = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static ExtentsInode** extents_bucket (dev_t dev, ino_t ino) {
+	return &(registry.buckets[(ino ^ dev) % EXTENTS_BUCKETS]);
+}
+
+/* Start tracking a file opened for writing, NULL if both the extents
+ * journal and the content hash are disabled or the file can't be
+ * tracked. */
+SfsExtents* extents_open (SfsState* state, int fd) {
+	struct stat statbuf;
+
+	if ((!state->extent_journal_dir && !state->content_hash) || fstat (fd, &statbuf) < 0 || !S_ISREG (statbuf.st_mode)) {
+		return NULL;
+	}
+
+	SfsExtents* ext = calloc (1, sizeof (SfsExtents));
+	if (!ext) {
+		syslog(LOG_CRIT, "[extents] cannot allocate the extents of inode %lu", (unsigned long) statbuf.st_ino);
+		return NULL;
+	}
+	pthread_mutex_init (&(ext->mutex), NULL);
+	ext->journal = state->extent_journal_dir != NULL;
+	ext->hashing = state->content_hash;
+	if (ext->hashing) {
+		// without memory the file is just not hashed
+		ext->hash = hash_new ();
+	}
+	ext->open_size = ext->trunc_size = statbuf.st_size;
+	ext->open_mtime = statbuf.st_mtim;
+
+	pthread_mutex_lock (&(registry.mutex));
+	ExtentsInode** bucket = extents_bucket (statbuf.st_dev, statbuf.st_ino);
+	ExtentsInode* inode;
+	for (inode = *bucket; inode; inode = inode->next) {
+		if (inode->dev == statbuf.st_dev && inode->ino == statbuf.st_ino) {
+			break;
+		}
+	}
+	if (!inode) {
+		inode = calloc (1, sizeof (ExtentsInode));
+		if (!inode) {
+			pthread_mutex_unlock (&(registry.mutex));
+			syslog(LOG_CRIT, "[extents] cannot allocate the extents of inode %lu", (unsigned long) statbuf.st_ino);
+			hash_free (ext->hash);
+			free (ext);
+			return NULL;
+		}
+		inode->dev = statbuf.st_dev;
+		inode->ino = statbuf.st_ino;
+		inode->next = *bucket;
+		*bucket = inode;
+		registry.count++;
+	}
+	if (++inode->writers > 1) {
+		// concurrent writers, none of them knows all the changes
+		inode->generation++;
+		ext->invalid = 1;
+	}
+	ext->inode = inode;
+	ext->generation = inode->generation;
+	pthread_mutex_unlock (&(registry.mutex));
+
+	return ext;
+}
+
+static void extents_clear (SfsExtents* ext) {
+	free (ext->ranges);
+	ext->ranges = NULL;
+	ext->count = ext->size = 0;
+	ext->invalid = 1;
+}
+
+static void extents_void_hash (SfsExtents* ext) {
+	hash_free (ext->hash);
+	ext->hash = NULL;
+}
+
+/* Hash len bytes at offset, from data or read back from fd. */
+static void extents_hash (SfsExtents* ext, int fd, const void* data, uint64_t offset, uint64_t len) {
+	char buf[64 * 1024];
+
+	if (offset != ext->hash_pos) {
+		extents_void_hash (ext);
+		return;
+	}
+	if (data) {
+		hash_update (ext->hash, data, len);
+	} else {
+		// spliced or copied in the kernel, still in the page cache
+		uint64_t done = 0;
+		while (done < len) {
+			ssize_t cur = pread (fd, buf, len - done < sizeof (buf) ? len - done : sizeof (buf), offset + done);
+			if (cur <= 0) {
+				// EBADF on write-only handles
+				extents_void_hash (ext);
+				return;
+			}
+			hash_update (ext->hash, buf, cur);
+			done += cur;
+		}
+	}
+	ext->hash_pos += len;
+}
+
+// merge a range, appends extend the last range in place
+static void extents_add (SfsExtents* ext, uint64_t offset, uint64_t len) {
+	uint64_t end = offset + len;
+	int lo, hi;
+
+	if (!ext->journal || ext->invalid) {
+		return;
+	}
+
+	// first range ending at or after offset, and first one starting past end
+	for (lo = ext->count; lo > 0 && ext->ranges[lo - 1].offset + ext->ranges[lo - 1].len >= offset; lo--);
+	for (hi = lo; hi < ext->count && ext->ranges[hi].offset <= end; hi++);
+
+	if (lo < hi) {
+		// overlapping or adjacent, merged into ranges[lo]
+		uint64_t last = ext->ranges[hi - 1].offset + ext->ranges[hi - 1].len;
+		if (ext->ranges[lo].offset < offset) {
+			offset = ext->ranges[lo].offset;
+		}
+		if (last > end) {
+			end = last;
+		}
+		ext->ranges[lo].offset = offset;
+		ext->ranges[lo].len = end - offset;
+		memmove (ext->ranges + lo + 1, ext->ranges + hi, (ext->count - hi) * sizeof (SfsExtent));
+		ext->count -= hi - lo - 1;
+		return;
+	}
+
+	if (ext->count >= EXTENTS_MAX_RANGES) {
+		extents_clear (ext);
+		return;
+	}
+	if (ext->count == ext->size) {
+		int size = ext->size ? ext->size * 2 : 8;
+		SfsExtent* ranges = realloc (ext->ranges, size * sizeof (SfsExtent));
+		if (!ranges) {
+			extents_clear (ext);
+			return;
+		}
+		ext->ranges = ranges;
+		ext->size = size;
+	}
+	memmove (ext->ranges + lo + 1, ext->ranges + lo, (ext->count - lo) * sizeof (SfsExtent));
+	ext->ranges[lo].offset = offset;
+	ext->ranges[lo].len = len;
+	ext->count++;
+}
+
+/* len bytes were written at offset through the handle of fd. data is
+ * what was written, NULL if it never was in memory. */
+void extents_write (SfsExtents* ext, int fd, const void* data, uint64_t offset, uint64_t len) {
+	if (!ext || !len) {
+		return;
+	}
+
+	pthread_mutex_lock (&(ext->mutex));
+	extents_add (ext, offset, len);
+	if (ext->hash) {
+		extents_hash (ext, fd, data, offset, len);
+	}
+	pthread_mutex_unlock (&(ext->mutex));
+}
+
+/* The handle truncated the file, what was written past size is gone. */
+void extents_truncate (SfsExtents* ext, off_t size) {
+	int i;
+
+	if (!ext) {
+		return;
+	}
+
+	pthread_mutex_lock (&(ext->mutex));
+	if (size < ext->trunc_size) {
+		ext->trunc_size = size;
+	}
+	if (size != ext->hash_pos) {
+		extents_void_hash (ext);
+	}
+	for (i=0; i < ext->count && ext->ranges[i].offset < (uint64_t) size; i++) {
+		if (ext->ranges[i].offset + ext->ranges[i].len > (uint64_t) size) {
+			ext->ranges[i].len = size - ext->ranges[i].offset;
+		}
+	}
+	ext->count = i;
+	pthread_mutex_unlock (&(ext->mutex));
+}
+
+/* The file changed in a way that can't be expressed with ranges. */
+void extents_invalidate (SfsExtents* ext) {
+	if (ext) {
+		pthread_mutex_lock (&(ext->mutex));
+		extents_clear (ext);
+		extents_void_hash (ext);
+		pthread_mutex_unlock (&(ext->mutex));
+	}
+}
+
+/* The file at name relative to dirfd was changed without a handle, as
+ * with fstatat() flags. Only costs a stat while files are tracked. */
+void extents_touch (int dirfd, const char* name, int flags) {
+	struct stat statbuf;
+	ExtentsInode* inode;
+
+	if (!registry.count || fstatat (dirfd, name, &statbuf, flags) < 0) {
+		return;
+	}
+
+	pthread_mutex_lock (&(registry.mutex));
+	for (inode = *extents_bucket (statbuf.st_dev, statbuf.st_ino); inode; inode = inode->next) {
+		if (inode->dev == statbuf.st_dev && inode->ino == statbuf.st_ino) {
+			inode->generation++;
+			break;
+		}
+	}
+	pthread_mutex_unlock (&(registry.mutex));
+}
+
+// store the content hash, or drop the one of the previous content
+static void extents_store_hash (SfsExtents* ext, int fd, const struct stat* st, int current) {
+	char value[HASH_XATTR_MAX];
+
+	if (st->st_size == ext->open_size && st->st_mtim.tv_sec == ext->open_mtime.tv_sec && st->st_mtim.tv_nsec == ext->open_mtime.tv_nsec) {
+		// not written
+		return;
+	}
+
+	if (current && ext->hash && ext->hash_pos == (uint64_t) st->st_size) {
+		int len = hash_format (value, hash_digest (ext->hash), st);
+		if (fsetxattr (fd, HASH_XATTR, value, len, 0) == 0) {
+			return;
+		}
+		if (errno != ENOTSUP) {
+			syslog(LOG_WARNING, "[extents] cannot store the content hash of inode %lu: %s", (unsigned long) st->st_ino, strerror (errno));
+		}
+	}
+	// with coarse timestamps the old one could still match
+	if (fremovexattr (fd, HASH_XATTR) < 0 && errno != ENODATA && errno != ENOTSUP) {
+		syslog(LOG_WARNING, "[extents] cannot remove the content hash of inode %lu: %s", (unsigned long) st->st_ino, strerror (errno));
+	}
+}
+
+/* Stop tracking the handle of fd, before it's closed, and store its
+ * content hash. Returns the journal record of path with its length, or
+ * NULL if there's nothing valid to record or path is NULL or can't be
+ * journaled. ext is freed. */
+char* extents_release (SfsExtents* ext, int fd, const char* path, int* len) {
+	struct stat statbuf;
+	char* record = NULL;
+	char* p;
+	int i;
+
+	if (!ext) {
+		return NULL;
+	}
+
+	pthread_mutex_lock (&(registry.mutex));
+	ExtentsInode* inode = ext->inode;
+	int current = inode->generation == ext->generation;
+	if (--inode->writers == 0) {
+		ExtentsInode** cur = extents_bucket (inode->dev, inode->ino);
+		while (*cur != inode) {
+			cur = &((*cur)->next);
+		}
+		*cur = inode->next;
+		registry.count--;
+		free (inode);
+	}
+	pthread_mutex_unlock (&(registry.mutex));
+
+	if (fstat (fd, &statbuf) < 0) {
+		goto cleanup;
+	}
+	if (ext->hashing) {
+		extents_store_hash (ext, fd, &statbuf, current);
+	}
+
+	if (!ext->journal || ext->invalid || !current || !path) {
+		goto cleanup;
+	}
+	// records are tab and newline separated, the file is copied instead
+	if (strpbrk (path, "\t\n")) {
+		goto cleanup;
+	}
+	// opened for writing but nothing changed
+	if (!ext->count && ext->trunc_size == ext->open_size && statbuf.st_size == ext->open_size) {
+		goto cleanup;
+	}
+
+	// offset+length, with 20 digits each
+	size_t size = strlen (path) + ext->count * 42 + 160;
+	record = malloc (size);
+	if (!record) {
+		syslog(LOG_CRIT, "[extents] cannot allocate the journal record of %s", path);
+		goto cleanup;
+	}
+
+	p = record + sprintf (record, "%llu\t%lld\t%ld.%09ld\t%lld\t%lld\t%ld.%09ld\t", (unsigned long long) statbuf.st_ino,
+						  (long long) ext->open_size, (long) ext->open_mtime.tv_sec, ext->open_mtime.tv_nsec, (long long) ext->trunc_size,
+						  (long long) statbuf.st_size, (long) statbuf.st_mtim.tv_sec, statbuf.st_mtim.tv_nsec);
+	for (i=0; i < ext->count; i++) {
+		p += sprintf (p, "%s%llu+%llu", i ? "," : "", (unsigned long long) ext->ranges[i].offset, (unsigned long long) ext->ranges[i].len);
+	}
+	if (!ext->count) {
+		*p++ = '-';
+	}
+	*len = p - record + sprintf (p, "\t%s\n", path);
+
+cleanup:
+	pthread_mutex_destroy (&(ext->mutex));
+	hash_free (ext->hash);
+	free (ext->ranges);
+	free (ext);
+	return record;
+}
@@ -0,0 +1,51 @@
+/*
+ *  extents.h - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SFS_EXTENTS_H
+#define SFS_EXTENTS_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include "sfs.h"
+
+// past this many disjoint ranges the whole file is considered changed
+#define EXTENTS_MAX_RANGES 256
+
+typedef struct {
+	uint64_t offset;
+	uint64_t len;
+} SfsExtent;
+
+// byte ranges written and content hash of an open handle
+typedef struct SfsExtents SfsExtents;
+
+/* An extents journal record is a line of tab separated fields:
+ * inode, size and mtime (seconds.nanoseconds) at open, size the file was
+ * truncated to, size and mtime at release, ranges as offset+length
+ * separated by commas, path. */
+SfsExtents* extents_open (SfsState* state, int fd);
+void extents_write (SfsExtents* ext, int fd, const void* data, uint64_t offset, uint64_t len);
+void extents_truncate (SfsExtents* ext, off_t size);
+void extents_invalidate (SfsExtents* ext);
+void extents_touch (int dirfd, const char* name, int flags);
+char* extents_release (SfsExtents* ext, int fd, const char* path, int* len);
+
+#endif
@@ -0,0 +1,610 @@
+/*
+ *  extentsync.c - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* sfs-extents: transfer only the written ranges of files, from extents
+ * journals, before the norec batches are synchronized.
+ *
+ * pack runs on the source: the records of each file are chained while
+ * each one starts from the size and mtime the previous one left, and the
+ * ranges are read if the file still has the size and mtime of the last
+ * one. apply runs on the destination: the ranges are written only if the
+ * file has the size and mtime of the first record, then the final size
+ * and mtime are set, so that the rsync of the batch skips the file.
+ * Otherwise the file is left alone and rsync copies it as usual.
+ *
+ * The stream is a header line per file:
+ * F, size truncated to, final size, final mtime, initial size, initial
+ * mtime, number of ranges, path
+ * followed by each range as a line "R offset length" and its data, tab
+ * separated like the journals. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "path.h"
+
+#define EXTENTSYNC_BUF_SIZE (1024 * 1024)
+
+typedef struct {
+	uint64_t offset;
+	uint64_t len;
+} Range;
+
+typedef struct {
+	unsigned long long ino;
+	long long old_size;
+	struct timespec old_mtime;
+	long long trunc_size;
+	long long new_size;
+	struct timespec new_mtime;
+	Range* ranges;
+	int count;
+	char* path;
+	// order in the journals
+	int seq;
+} Record;
+
+static int dryrun = 0;
+static int verbose = 0;
+// larger files are left to rsync
+static long long max_bytes = 64 * 1024 * 1024;
+
+static void usage (void) {
+	fprintf (stderr, "Usage: sfs-extents pack [-v] [-m BYTES] ROOT JOURNAL...\n");
+	fprintf (stderr, "       sfs-extents apply [-n] [-v] ROOT\n\n");
+	fprintf (stderr, "  -m  skip files with more than BYTES written, default 64MiB\n");
+	fprintf (stderr, "  -n  only check the files, don't write them\n");
+	fprintf (stderr, "  -v  report each file\n");
+}
+
+// seconds.nanoseconds
+static int parse_time (const char* str, struct timespec* ts) {
+	char* end;
+	ts->tv_sec = strtol (str, &end, 10);
+	if (*end != '.') {
+		return 0;
+	}
+	ts->tv_nsec = strtol (end + 1, &end, 10);
+	return *end == '\0' && ts->tv_nsec >= 0 && ts->tv_nsec < 1000000000;
+}
+
+static int parse_size (const char* str, long long* size) {
+	char* end;
+	*size = strtoll (str, &end, 10);
+	return *str && *end == '\0' && *size >= 0;
+}
+
+static int same_time (const struct timespec* a, const struct timespec* b) {
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+// split line into n tab separated fields, the last one can't have tabs
+static int split (char* line, char** fields, int n) {
+	int i = 0;
+	char* p = line;
+
+	while (i < n && p) {
+		fields[i++] = p;
+		p = strchr (p, '\t');
+		if (p) {
+			*p++ = '\0';
+		}
+	}
+	return i == n && !p;
+}
+
+static int range_cmp (const void* a, const void* b) {
+	const Range* ra = a;
+	const Range* rb = b;
+	return ra->offset < rb->offset ? -1 : ra->offset > rb->offset;
+}
+
+// sort and coalesce the ranges
+static void ranges_merge (Record* rec) {
+	int i, n = 0;
+
+	qsort (rec->ranges, rec->count, sizeof (Range), range_cmp);
+	for (i=0; i < rec->count; i++) {
+		if (n > 0 && rec->ranges[i].offset <= rec->ranges[n - 1].offset + rec->ranges[n - 1].len) {
+			uint64_t end = rec->ranges[i].offset + rec->ranges[i].len;
+			if (end > rec->ranges[n - 1].offset + rec->ranges[n - 1].len) {
+				rec->ranges[n - 1].len = end - rec->ranges[n - 1].offset;
+			}
+		} else {
+			rec->ranges[n++] = rec->ranges[i];
+		}
+	}
+	rec->count = n;
+}
+
+// drop what's past size
+static void ranges_clip (Record* rec, long long size) {
+	int i;
+
+	for (i=0; i < rec->count && rec->ranges[i].offset < (uint64_t) size; i++) {
+		if (rec->ranges[i].offset + rec->ranges[i].len > (uint64_t) size) {
+			rec->ranges[i].len = size - rec->ranges[i].offset;
+		}
+	}
+	rec->count = i;
+}
+
+static int parse_ranges (Record* rec, char* str) {
+	char* p;
+	int count = 1;
+
+	if (!strcmp (str, "-")) {
+		return 1;
+	}
+	for (p=str; *p; p++) {
+		if (*p == ',') {
+			count++;
+		}
+	}
+	rec->ranges = malloc (count * sizeof (Range));
+	if (!rec->ranges) {
+		return 0;
+	}
+	for (p=str; rec->count < count; p++) {
+		char* end;
+		Range* range = &(rec->ranges[rec->count++]);
+		range->offset = strtoull (p, &end, 10);
+		if (*end != '+') {
+			return 0;
+		}
+		range->len = strtoull (end + 1, &p, 10);
+		if (*p != (rec->count < count ? ',' : '\0')) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int parse_record (Record* rec, char* line) {
+	char* fields[8];
+
+	memset (rec, 0, sizeof (Record));
+	if (!split (line, fields, 8)) {
+		return 0;
+	}
+	rec->ino = strtoull (fields[0], NULL, 10);
+	rec->path = fields[7];
+	return parse_size (fields[1], &(rec->old_size)) && parse_time (fields[2], &(rec->old_mtime)) &&
+		parse_size (fields[3], &(rec->trunc_size)) && parse_size (fields[4], &(rec->new_size)) &&
+		parse_time (fields[5], &(rec->new_mtime)) && path_valid (rec->path) &&
+		parse_ranges (rec, fields[6]) && (rec->path = strdup (rec->path));
+}
+
+static int record_cmp (const void* a, const void* b) {
+	const Record* ra = a;
+	const Record* rb = b;
+	int cmp = strcmp (ra->path, rb->path);
+	return cmp ? cmp : ra->seq - rb->seq;
+}
+
+/* Append the next record of the same file to chain. Returns 0 if it
+ * doesn't start where chain ended. */
+static int chain (Record* chain, Record* rec) {
+	if (chain->ino != rec->ino || chain->new_size != rec->old_size || !same_time (&(chain->new_mtime), &(rec->old_mtime))) {
+		return 0;
+	}
+
+	// what the second handle truncated away is gone
+	ranges_clip (chain, rec->trunc_size);
+	// never of size 0
+	Range* ranges = realloc (chain->ranges, (chain->count + rec->count + 1) * sizeof (Range));
+	if (!ranges) {
+		return 0;
+	}
+	memcpy (ranges + chain->count, rec->ranges, rec->count * sizeof (Range));
+	chain->ranges = ranges;
+	chain->count += rec->count;
+	ranges_merge (chain);
+
+	if (rec->trunc_size < chain->trunc_size) {
+		chain->trunc_size = rec->trunc_size;
+	}
+	chain->new_size = rec->new_size;
+	chain->new_mtime = rec->new_mtime;
+	return 1;
+}
+
+static int read_journal (const char* journal, Record** records, int* count, int* size) {
+	FILE* file = fopen (journal, "r");
+	if (!file) {
+		fprintf (stderr, "sfs-extents: cannot open %s: %s\n", journal, strerror (errno));
+		return 0;
+	}
+
+	char* line = NULL;
+	size_t linesize = 0;
+	ssize_t len;
+	int lineno = 0;
+	int ok = 1;
+	while ((len = getline (&line, &linesize, file)) > 0) {
+		lineno++;
+		if (line[len - 1] != '\n') {
+			// torn by a crash
+			break;
+		}
+		line[len - 1] = '\0';
+
+		if (*count == *size) {
+			*size = *size ? *size * 2 : 64;
+			Record* grown = realloc (*records, *size * sizeof (Record));
+			if (!grown) {
+				fprintf (stderr, "sfs-extents: out of memory\n");
+				ok = 0;
+				break;
+			}
+			*records = grown;
+		}
+		Record* rec = &((*records)[*count]);
+		if (!parse_record (rec, line)) {
+			fprintf (stderr, "sfs-extents: %s:%d: malformed record, skipped\n", journal, lineno);
+			free (rec->ranges);
+			continue;
+		}
+		rec->seq = (*count)++;
+	}
+
+	if (ferror (file)) {
+		fprintf (stderr, "sfs-extents: cannot read %s: %s\n", journal, strerror (errno));
+		ok = 0;
+	}
+	free (line);
+	fclose (file);
+	return ok;
+}
+
+/* Emit the ranges of the file of rec, if it's still as rec left it.
+ * Returns 1 if packed, 0 if skipped, -1 if the stream failed. */
+static int pack_file (const char* root, Record* rec) {
+	char* path = NULL;
+	const char* reason = NULL;
+	struct stat st;
+	long long total = 0;
+	int fd = -1;
+	int i;
+
+	ranges_clip (rec, rec->new_size);
+	for (i=0; i < rec->count; i++) {
+		total += rec->ranges[i].len;
+	}
+
+	char* data = NULL;
+	if (total > max_bytes) {
+		reason = "too many bytes written";
+	} else if (asprintf (&path, "%s%s", root, rec->path) < 0) {
+		path = NULL;
+		reason = "out of memory";
+	} else if ((fd = open (path, O_RDONLY | O_NOFOLLOW)) < 0) {
+		reason = strerror (errno);
+	} else if (fstat (fd, &st) < 0) {
+		reason = strerror (errno);
+	} else if (st.st_ino != rec->ino || st.st_size != rec->new_size || !same_time (&(st.st_mtim), &(rec->new_mtime))) {
+		reason = "modified since";
+	} else if (total && !(data = malloc (total))) {
+		reason = "out of memory";
+	}
+
+	long long pos = 0;
+	for (i=0; !reason && i < rec->count; i++) {
+		uint64_t done = 0;
+		while (done < rec->ranges[i].len) {
+			ssize_t cur = pread (fd, data + pos + done, rec->ranges[i].len - done, rec->ranges[i].offset + done);
+			if (cur <= 0) {
+				reason = cur < 0 ? strerror (errno) : "short read";
+				break;
+			}
+			done += cur;
+		}
+		pos += done;
+	}
+	// a write meanwhile may have been read in part
+	if (!reason && (fstat (fd, &st) < 0 || st.st_size != rec->new_size || !same_time (&(st.st_mtim), &(rec->new_mtime)))) {
+		reason = "modified while reading";
+	}
+
+	int ret = 0;
+	if (reason) {
+		if (verbose) {
+			fprintf (stderr, "skip %s: %s\n", rec->path, reason);
+		}
+		goto cleanup;
+	}
+
+	printf ("F\t%lld\t%lld\t%ld.%09ld\t%lld\t%ld.%09ld\t%d\t%s\n", rec->trunc_size, rec->new_size, (long) rec->new_mtime.tv_sec, rec->new_mtime.tv_nsec,
+			rec->old_size, (long) rec->old_mtime.tv_sec, rec->old_mtime.tv_nsec, rec->count, rec->path);
+	pos = 0;
+	for (i=0; i < rec->count; i++) {
+		printf ("R\t%llu\t%llu\n", (unsigned long long) rec->ranges[i].offset, (unsigned long long) rec->ranges[i].len);
+		if (fwrite (data + pos, 1, rec->ranges[i].len, stdout) != rec->ranges[i].len) {
+			break;
+		}
+		pos += rec->ranges[i].len;
+	}
+	if (ferror (stdout)) {
+		fprintf (stderr, "sfs-extents: cannot write the stream: %s\n", strerror (errno));
+		ret = -1;
+		goto cleanup;
+	}
+	if (verbose) {
+		fprintf (stderr, "packed %s: %d ranges, %lld bytes\n", rec->path, rec->count, total);
+	}
+	ret = 1;
+
+cleanup:
+	if (fd >= 0) {
+		close (fd);
+	}
+	free (data);
+	free (path);
+	return ret;
+}
+
+static int pack (const char* root, char** journals, int count) {
+	Record* records = NULL;
+	int nrecords = 0;
+	int size = 0;
+	int packed = 0;
+	int skipped = 0;
+	int ret = 0;
+	int i, j;
+
+	for (i=0; i < count; i++) {
+		if (!read_journal (journals[i], &records, &nrecords, &size)) {
+			ret = 1;
+		}
+	}
+	qsort (records, nrecords, sizeof (Record), record_cmp);
+
+	for (i=0; i < nrecords; i = j) {
+		Record* cur = &(records[i]);
+		for (j = i + 1; j < nrecords && !strcmp (records[j].path, cur->path); j++) {
+			if (!chain (cur, &(records[j]))) {
+				// the file changed in between, only what follows can match
+				skipped++;
+				cur = &(records[j]);
+			}
+		}
+
+		int packret = pack_file (root, cur);
+		if (packret < 0) {
+			ret = 1;
+			break;
+		} else if (packret) {
+			packed++;
+		} else {
+			skipped++;
+		}
+	}
+
+	for (i=0; i < nrecords; i++) {
+		free (records[i].ranges);
+		free (records[i].path);
+	}
+	free (records);
+	if (verbose) {
+		fprintf (stderr, "%d files packed, %d skipped\n", packed, skipped);
+	}
+	return ret;
+}
+
+/* Read len bytes of the stream and write them at offset of fd, or just
+ * consume them if fd is -1. Returns 0 if the stream failed, -1 if the
+ * file couldn't be written. */
+static int apply_range (int fd, uint64_t offset, uint64_t len, char* buf) {
+	int ret = 1;
+
+	while (len > 0) {
+		size_t chunk = len < EXTENTSYNC_BUF_SIZE ? len : EXTENTSYNC_BUF_SIZE;
+		if (fread (buf, 1, chunk, stdin) != chunk) {
+			return 0;
+		}
+		if (fd >= 0 && ret > 0) {
+			size_t done = 0;
+			while (done < chunk) {
+				ssize_t cur = pwrite (fd, buf + done, chunk - done, offset + done);
+				if (cur < 0) {
+					ret = -1;
+					break;
+				}
+				done += cur;
+			}
+		}
+		offset += chunk;
+		len -= chunk;
+	}
+	return ret;
+}
+
+static int apply (const char* root) {
+	char* buf = malloc (EXTENTSYNC_BUF_SIZE);
+	char* line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int applied = 0;
+	int skipped = 0;
+	int ret = 0;
+
+	if (!buf) {
+		fprintf (stderr, "sfs-extents: out of memory\n");
+		return 1;
+	}
+
+	while ((len = getline (&line, &size, stdin)) > 0) {
+		char* fields[8];
+		long long trunc_size, new_size, old_size;
+		struct timespec new_mtime, old_mtime;
+		char* end;
+
+		if (line[len - 1] == '\n') {
+			line[len - 1] = '\0';
+		}
+		if (!split (line, fields, 8) || strcmp (fields[0], "F") || !parse_size (fields[1], &trunc_size) ||
+			!parse_size (fields[2], &new_size) || !parse_time (fields[3], &new_mtime) ||
+			!parse_size (fields[4], &old_size) || !parse_time (fields[5], &old_mtime) || !path_valid (fields[7])) {
+			fprintf (stderr, "sfs-extents: malformed stream\n");
+			ret = 1;
+			break;
+		}
+		int nranges = strtol (fields[6], &end, 10);
+		if (*end != '\0' || nranges < 0) {
+			fprintf (stderr, "sfs-extents: malformed stream\n");
+			ret = 1;
+			break;
+		}
+		const char* relpath = fields[7];
+		char* path = NULL;
+		const char* reason = NULL;
+		struct stat st;
+		int fd = -1;
+
+		if (asprintf (&path, "%s%s", root, relpath) < 0) {
+			path = NULL;
+			reason = "out of memory";
+		} else if ((fd = open (path, (dryrun ? O_RDONLY : O_WRONLY) | O_NOFOLLOW | O_NONBLOCK)) < 0) {
+			reason = strerror (errno);
+		} else if (fstat (fd, &st) < 0) {
+			reason = strerror (errno);
+		} else if (!S_ISREG (st.st_mode) || st.st_size != old_size || st.st_mtim.tv_sec != old_mtime.tv_sec) {
+			reason = "not as on the source";
+		} else if (!dryrun && ftruncate (fd, trunc_size) < 0) {
+			reason = strerror (errno);
+		}
+		if (reason || dryrun) {
+			if (fd >= 0) {
+				close (fd);
+			}
+			fd = -1;
+		}
+
+		// the data is consumed anyway
+		int i;
+		for (i=0; i < nranges; i++) {
+			unsigned long long offset, rlen;
+			char header[64];
+			if (!fgets (header, sizeof (header), stdin) || sscanf (header, "R\t%llu\t%llu\n", &offset, &rlen) != 2) {
+				fprintf (stderr, "sfs-extents: malformed stream\n");
+				ret = 1;
+				break;
+			}
+			int rangeret = apply_range (fd, offset, rlen, buf);
+			if (!rangeret) {
+				fprintf (stderr, "sfs-extents: truncated stream\n");
+				ret = 1;
+				break;
+			} else if (rangeret < 0 && !reason) {
+				reason = strerror (errno);
+			}
+		}
+
+		if (fd >= 0) {
+			struct timespec ts[2];
+			ts[0].tv_sec = 0;
+			ts[0].tv_nsec = UTIME_OMIT;
+			ts[1] = new_mtime;
+			// on error the mtime is left as is, so that rsync copies the file
+			if (!reason && ret == 0 && (ftruncate (fd, new_size) < 0 || futimens (fd, ts) < 0)) {
+				reason = strerror (errno);
+			}
+			if (close (fd) < 0 && !reason) {
+				reason = strerror (errno);
+			}
+		}
+
+		if (reason) {
+			skipped++;
+			if (verbose) {
+				printf ("skip %s: %s\n", relpath, reason);
+			}
+		} else if (ret == 0) {
+			applied++;
+			if (verbose) {
+				printf ("%s %s: %d ranges\n", dryrun ? "would write" : "wrote", relpath, nranges);
+			}
+		}
+		free (path);
+		if (ret) {
+			break;
+		}
+	}
+	if (ferror (stdin)) {
+		fprintf (stderr, "sfs-extents: cannot read the stream: %s\n", strerror (errno));
+		ret = 1;
+	}
+
+	if (verbose) {
+		printf ("%d files written, %d skipped\n", applied, skipped);
+	}
+	free (line);
+	free (buf);
+	return ret;
+}
+
+int main (int argc, char** argv) {
+	int opt;
+
+	if (argc < 2 || (strcmp (argv[1], "pack") && strcmp (argv[1], "apply"))) {
+		usage ();
+		return 2;
+	}
+	int packing = !strcmp (argv[1], "pack");
+	optind = 2;
+
+	while ((opt = getopt (argc, argv, "m:nvh")) != -1) {
+		switch (opt) {
+		case 'm':
+			max_bytes = atoll (optarg);
+			break;
+		case 'n':
+			dryrun = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage ();
+			return 2;
+		}
+	}
+	if (argc - optind < (packing ? 2 : 1)) {
+		usage ();
+		return 2;
+	}
+
+	// journal paths are absolute within the root
+	char* root = argv[optind++];
+	path_trim_root (root);
+
+	if (packing) {
+		return pack (root, argv + optind, argc - optind);
+	}
+	return apply (root);
+}
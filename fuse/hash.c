@@ -0,0 +1,260 @@
+/*
+ *  hash.c - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Content hash of the files, shared by SFS and sfs-checksum. The value
+ * of the xattr names the algorithm, so a hash written by a build with a
+ * different one is just not valid. It doesn't depend on the rest of SFS,
+ * so the tools link it alone. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+#define HASH_BUF_SIZE (256 * 1024)
+
+#ifdef HAVE_XXHASH
+#include <xxhash.h>
+
+#define HASH_ALGORITHM "xxh3"
+
+// the state is aligned for the SIMD code paths of the library
+struct SfsHash {
+	XXH3_state_t* state;
+};
+
+SfsHash* hash_new (void) {
+	SfsHash* hash = malloc (sizeof (SfsHash));
+	if (!hash) {
+		return NULL;
+	}
+	hash->state = XXH3_createState ();
+	if (!hash->state || XXH3_64bits_reset (hash->state) != XXH_OK) {
+		XXH3_freeState (hash->state);
+		free (hash);
+		return NULL;
+	}
+	return hash;
+}
+
+void hash_update (SfsHash* hash, const void* data, size_t len) {
+	XXH3_64bits_update (hash->state, data, len);
+}
+
+uint64_t hash_digest (SfsHash* hash) {
+	return XXH3_64bits_digest (hash->state);
+}
+
+void hash_free (SfsHash* hash) {
+	if (hash) {
+		XXH3_freeState (hash->state);
+		free (hash);
+	}
+}
+#else
+#define HASH_ALGORITHM "xxh64"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+struct SfsHash {
+	uint64_t total;
+	uint64_t acc[4];
+	unsigned char buf[32];
+	size_t buffered;
+};
+
+static uint64_t rotl (uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64 (const unsigned char* p) {
+	uint64_t v;
+	memcpy (&v, p, sizeof (v));
+	return le64toh (v);
+}
+
+static uint32_t read32 (const unsigned char* p) {
+	uint32_t v;
+	memcpy (&v, p, sizeof (v));
+	return le32toh (v);
+}
+
+static uint64_t xxh64_round (uint64_t acc, uint64_t input) {
+	acc += input * PRIME64_2;
+	return rotl (acc, 31) * PRIME64_1;
+}
+
+static uint64_t xxh64_merge (uint64_t h, uint64_t acc) {
+	h ^= xxh64_round (0, acc);
+	return h * PRIME64_1 + PRIME64_4;
+}
+
+// one 32 bytes stripe
+static void xxh64_stripe (SfsHash* hash, const unsigned char* p) {
+	hash->acc[0] = xxh64_round (hash->acc[0], read64 (p));
+	hash->acc[1] = xxh64_round (hash->acc[1], read64 (p + 8));
+	hash->acc[2] = xxh64_round (hash->acc[2], read64 (p + 16));
+	hash->acc[3] = xxh64_round (hash->acc[3], read64 (p + 24));
+}
+
+SfsHash* hash_new (void) {
+	SfsHash* hash = calloc (1, sizeof (SfsHash));
+	if (!hash) {
+		return NULL;
+	}
+	// seed 0
+	hash->acc[0] = PRIME64_1 + PRIME64_2;
+	hash->acc[1] = PRIME64_2;
+	hash->acc[2] = 0;
+	hash->acc[3] = -PRIME64_1;
+	return hash;
+}
+
+void hash_update (SfsHash* hash, const void* data, size_t len) {
+	const unsigned char* p = data;
+	const unsigned char* end = p + len;
+
+	hash->total += len;
+	if (hash->buffered + len < 32) {
+		memcpy (hash->buf + hash->buffered, p, len);
+		hash->buffered += len;
+		return;
+	}
+	if (hash->buffered) {
+		memcpy (hash->buf + hash->buffered, p, 32 - hash->buffered);
+		p += 32 - hash->buffered;
+		xxh64_stripe (hash, hash->buf);
+		hash->buffered = 0;
+	}
+	for (; p + 32 <= end; p += 32) {
+		xxh64_stripe (hash, p);
+	}
+	memcpy (hash->buf, p, end - p);
+	hash->buffered = end - p;
+}
+
+uint64_t hash_digest (SfsHash* hash) {
+	const unsigned char* p = hash->buf;
+	const unsigned char* end = p + hash->buffered;
+	uint64_t h;
+
+	if (hash->total >= 32) {
+		h = rotl (hash->acc[0], 1) + rotl (hash->acc[1], 7) + rotl (hash->acc[2], 12) + rotl (hash->acc[3], 18);
+		h = xxh64_merge (h, hash->acc[0]);
+		h = xxh64_merge (h, hash->acc[1]);
+		h = xxh64_merge (h, hash->acc[2]);
+		h = xxh64_merge (h, hash->acc[3]);
+	} else {
+		h = PRIME64_5;
+	}
+	h += hash->total;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= xxh64_round (0, read64 (p));
+		h = rotl (h, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t) read32 (p) * PRIME64_1;
+		h = rotl (h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * PRIME64_5;
+		h = rotl (h, 11) * PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+void hash_free (SfsHash* hash) {
+	free (hash);
+}
+#endif
+
+/* Hash the whole file of fd. Returns 0 on error, with errno set. */
+int hash_fd (int fd, uint64_t* digest) {
+	unsigned char* buf = malloc (HASH_BUF_SIZE);
+	SfsHash* hash = hash_new ();
+	off_t offset = 0;
+	ssize_t len;
+	int ret = 0;
+
+	if (!buf || !hash) {
+		goto cleanup;
+	}
+	while ((len = pread (fd, buf, HASH_BUF_SIZE, offset)) > 0) {
+		hash_update (hash, buf, len);
+		offset += len;
+	}
+	if (len == 0) {
+		*digest = hash_digest (hash);
+		ret = 1;
+	}
+
+cleanup:
+	hash_free (hash);
+	free (buf);
+	return ret;
+}
+
+/* The xattr value of digest for the file of st, in a buffer of
+ * HASH_XATTR_MAX bytes. Returns its length. */
+int hash_format (char* value, uint64_t digest, const struct stat* st) {
+	return snprintf (value, HASH_XATTR_MAX, HASH_ALGORITHM " %016llx %lld %ld.%09ld", (unsigned long long) digest,
+					 (long long) st->st_size, (long) st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+}
+
+/* Returns 1 if the xattr value is a hash of this algorithm for the file
+ * of st as it is now, setting digest. */
+int hash_parse (const char* value, size_t len, const struct stat* st, uint64_t* digest) {
+	char str[HASH_XATTR_MAX];
+	char algorithm[16];
+	unsigned long long hex;
+	long long size;
+	long sec, nsec;
+
+	if (len >= sizeof (str)) {
+		return 0;
+	}
+	memcpy (str, value, len);
+	str[len] = '\0';
+	if (sscanf (str, "%15s %llx %lld %ld.%ld", algorithm, &hex, &size, &sec, &nsec) != 5 || strcmp (algorithm, HASH_ALGORITHM)) {
+		return 0;
+	}
+	if (size != st->st_size || sec != st->st_mtim.tv_sec || nsec != st->st_mtim.tv_nsec) {
+		return 0;
+	}
+	*digest = hex;
+	return 1;
+}
@@ -0,0 +1,46 @@
+/*
+ *  hash.h - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SFS_HASH_H
+#define SFS_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// content hash of a file, valid while it keeps the recorded size and mtime
+#define HASH_XATTR "user.sfs.hash"
+// algorithm, hash, size, mtime
+#define HASH_XATTR_MAX 96
+
+// streaming hash, xxh3 with make XXHASH=1 or the built-in xxh64
+typedef struct SfsHash SfsHash;
+
+SfsHash* hash_new (void);
+void hash_update (SfsHash* hash, const void* data, size_t len);
+uint64_t hash_digest (SfsHash* hash);
+void hash_free (SfsHash* hash);
+int hash_fd (int fd, uint64_t* digest);
+
+int hash_format (char* value, uint64_t digest, const struct stat* st);
+int hash_parse (const char* value, size_t len, const struct stat* st, uint64_t* digest);
+
+#endif
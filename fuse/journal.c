@@ -0,0 +1,178 @@
+/*
+ *  journal.c - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Rename journal. Each batch with renames gets a sidecar in the tmp dir,
+ * named after the tmp batch with a .renames suffix, which is published
+ * in rename_journal_dir as <batch name>.renames together with the
+ * batch. sfs-replay-renames applies the journal on a destination, so
+ * that the rsync of the batch finds the files already in place.
+ * Losing a journal only means the renamed files are copied again.
+ * Batches with written files get the same kind of sidecar with a
+ * .extents suffix in extent_journal_dir, for sfs-extents. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "sfs.h"
+#include "journal.h"
+
+static const char* journal_suffixes[JOURNAL_KINDS] = {".renames", ".extents"};
+
+const char* journal_dir (SfsState* state, JournalKind kind) {
+	return kind == JOURNAL_RENAMES ? state->rename_journal_dir : state->extent_journal_dir;
+}
+
+/* Append a record to the journal of the batch at batch_tmp_path. */
+void journal_append (SfsState* state, JournalFile* file, const char* batch_tmp_path, const char* line, int len) {
+	if (file->fd < 0) {
+		if (asprintf (&(file->tmp_path), "%s%s", batch_tmp_path, journal_suffixes[file->kind]) < 0) {
+			file->tmp_path = NULL;
+			syslog(LOG_CRIT, "[journal] path asprintf failed, the file will be copied: %s", strerror (errno));
+			return;
+		}
+		file->fd = open (file->tmp_path, O_CREAT | O_WRONLY | O_APPEND, 0666 & (~(state->fuse_umask)));
+		if (file->fd < 0) {
+			syslog(LOG_CRIT, "[journal] cannot open %s, the file will be copied: %s", file->tmp_path, strerror (errno));
+			free (file->tmp_path);
+			file->tmp_path = NULL;
+			return;
+		}
+	}
+
+	if (write (file->fd, line, len) != len) {
+		// a torn last record is skipped by the replay
+		syslog(LOG_CRIT, "[journal] cannot write to %s, the file will be copied: %s", file->tmp_path, strerror (errno));
+	}
+}
+
+/* Hand the journal of the batch published as name over to the
+ * publisher. */
+void journal_seal (SfsState* state, JournalFile* file, const char* name, PublishJournal* journal) {
+	journal->fd = -1;
+	journal->tmp_path = NULL;
+	journal->path = NULL;
+	journal->kind = file->kind;
+
+	if (file->fd < 0) {
+		return;
+	}
+
+	const char* dir = journal_dir (state, file->kind);
+	if (!dir || asprintf (&(journal->path), "%s/%s%s", dir, name, journal_suffixes[file->kind]) < 0) {
+		// journaling was disabled meanwhile, or out of memory
+		journal->path = NULL;
+		close (file->fd);
+		unlink (file->tmp_path);
+		free (file->tmp_path);
+	} else {
+		journal->fd = file->fd;
+		journal->tmp_path = file->tmp_path;
+	}
+	file->fd = -1;
+	file->tmp_path = NULL;
+}
+
+/* The batch was not published, its journal is left in the tmp dir next
+ * to it. */
+void journal_discard (JournalFile* file) {
+	if (file->fd >= 0) {
+		close (file->fd);
+		file->fd = -1;
+	}
+	free (file->tmp_path);
+	file->tmp_path = NULL;
+}
+
+int journal_is_file (const char* name) {
+	size_t len = strlen (name);
+	int kind;
+
+	for (kind=0; kind < JOURNAL_KINDS; kind++) {
+		size_t suffix = strlen (journal_suffixes[kind]);
+		if (len >= suffix && !strcmp (name + len - suffix, journal_suffixes[kind])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int journal_recover_kind (SfsState* state, JournalKind kind, const char* tmp_path, const char* name) {
+	char* journal_tmp = NULL;
+	char* journal_path = NULL;
+	const char* dir = journal_dir (state, kind);
+	int ret = 0;
+
+	if (asprintf (&journal_tmp, "%s%s", tmp_path, journal_suffixes[kind]) < 0) {
+		journal_tmp = NULL;
+		syslog(LOG_ERR, "[main] journal tmp_path asprintf for %s failed: %s", tmp_path, strerror (errno));
+		goto cleanup;
+	}
+	if (access (journal_tmp, F_OK) < 0) {
+		ret = 1;
+		goto cleanup;
+	}
+
+	if (!name || !dir) {
+		if (unlink (journal_tmp) < 0) {
+			syslog(LOG_ERR, "[main] cannot remove journal %s: %s", journal_tmp, strerror (errno));
+			goto cleanup;
+		}
+		ret = 1;
+		goto cleanup;
+	}
+
+	if (asprintf (&journal_path, "%s/%s%s", dir, name, journal_suffixes[kind]) < 0) {
+		journal_path = NULL;
+		syslog(LOG_ERR, "[main] journal_path asprintf for %s failed: %s", name, strerror (errno));
+		goto cleanup;
+	}
+	if (rename (journal_tmp, journal_path) < 0) {
+		syslog(LOG_ERR, "[main] rename of %s to %s failed: %s", journal_tmp, journal_path, strerror (errno));
+		goto cleanup;
+	}
+	ret = 1;
+
+cleanup:
+	free (journal_tmp);
+	free (journal_path);
+	return ret;
+}
+
+/* On startup, publish the journals of the tmp batch at tmp_path, which
+ * has been published as name. A NULL name means the batch was removed.
+ * Returns 0 on error. */
+int journal_recover (SfsState* state, const char* tmp_path, const char* name) {
+	int ret = 1;
+	int kind;
+
+	for (kind=0; kind < JOURNAL_KINDS; kind++) {
+		if (!journal_recover_kind (state, kind, tmp_path, name)) {
+			ret = 0;
+		}
+	}
+	return ret;
+}
@@ -0,0 +1,54 @@
+/*
+ *  journal.h - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SFS_JOURNAL_H
+#define SFS_JOURNAL_H
+
+#include <sys/stat.h>
+#include "sfs.h"
+#include "publish.h"
+
+typedef enum {
+	// renames of the paths of a batch
+	JOURNAL_RENAMES,
+	// written ranges of the files of a batch, see extents.h
+	JOURNAL_EXTENTS,
+	JOURNAL_KINDS
+} JournalKind;
+
+// journal of an open batch, owned by the batch writer thread
+typedef struct {
+	JournalKind kind;
+	int fd;
+	char* tmp_path;
+} JournalFile;
+
+/* A rename journal record is a line of tab separated fields:
+ * inode, mtime (seconds.nanoseconds), kind (d, f, l or o), old path,
+ * new path. */
+const char* journal_dir (SfsState* state, JournalKind kind);
+void journal_append (SfsState* state, JournalFile* file, const char* batch_tmp_path, const char* line, int len);
+void journal_seal (SfsState* state, JournalFile* file, const char* name, PublishJournal* journal);
+void journal_discard (JournalFile* file);
+int journal_recover (SfsState* state, const char* tmp_path, const char* name);
+int journal_is_file (const char* name);
+
+#endif
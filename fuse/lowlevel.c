@@ -0,0 +1,1766 @@
+/*
+ *  lowlevel.c - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Inode based backend on top of the fuse low-level API.
+ *
+ * Every object known to the kernel is kept in an inode table together
+ * with an O_PATH fd to the underlying object, so that all operations
+ * are done with *at() syscalls relative to the parent fd instead of
+ * building full paths. Each inode also remembers the parent and name
+ * of its last lookup, which is only used to rebuild the path when a
+ * batch event has to be written.
+ *
+ * With sfs_watch every directory in the table is also watched with
+ * inotify, so that changes made beneath fuse (e.g. by the sync daemon)
+ * invalidate the kernel caches of exactly the touched entries, and long
+ * cache timeouts can be used.
+ */
+
+#ifndef SFS_FUSE3
+#define FUSE_USE_VERSION 26
+#endif
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+#include <sys/inotify.h>
+
+#include "sfs.h"
+#include "batch.h"
+#include "util.h"
+#include "lowlevel.h"
+#include "stats.h"
+#include "extents.h"
+
+#ifdef SFS_LOWLEVEL
+
+typedef struct _SfsInode SfsInode;
+
+#define LL_WD_BUCKETS 1024
+// cache timeouts when watching for changes beneath fuse
+#define LL_WATCH_TIMEOUT 3600.0
+#define LL_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_MODIFY | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+struct _SfsInode {
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	mode_t type;
+	// kernel lookups plus one for each child pointing to this inode
+	uint64_t refcount;
+	// parent and name of the last lookup, used to build event paths
+	SfsInode* parent;
+	char* name;
+	SfsInode* next;
+	// inotify watch of directories, -1 if none
+	int wd;
+	SfsInode* wd_next;
+	// handles open for write through fuse
+	volatile int writers;
+	// backing file shared by the handles passed through to the kernel
+	int backing_id;
+	int backing_mode;
+	int backing_refs;
+};
+
+typedef struct {
+	SfsState* state;
+	pthread_mutex_t mutex;
+	SfsInode root;
+	SfsInode** buckets;
+	size_t nbuckets;
+	size_t count;
+	double entry_timeout;
+	double attr_timeout;
+	// where invalidations are sent to
+	#ifdef SFS_FUSE3
+	struct fuse_session* notify;
+	#else
+	struct fuse_chan* notify;
+	#endif
+	int inotify_fd;
+	SfsInode* wd_buckets[LL_WD_BUCKETS];
+} SfsLowlevel;
+
+typedef struct {
+	int fd;
+	// kernel backing file with sfs_passthrough, 0 if none
+	int backing_id;
+	// file size at open, to estimate the bytes written through the kernel
+	off_t open_size;
+	// bytes written through the handle, the size of its event
+	volatile uint64_t written;
+	// NULL unless writable with extent_journal_dir or content_hash
+	SfsExtents* extents;
+} SfsFileHandle;
+
+typedef struct {
+	DIR* dp;
+	struct dirent* entry;
+	off_t offset;
+} SfsDirHandle;
+
+#define LL_INITIAL_BUCKETS 1024
+
+#define LL_BEGIN_PERM(req) if (!ll_begin_access (req)) { \
+	fuse_reply_err (req, EPERM); \
+	return; \
+}
+
+#define LL_END_PERM sfs_end_access ();
+
+static SfsLowlevel* ll_data (fuse_req_t req) {
+	return (SfsLowlevel*) fuse_req_userdata (req);
+}
+
+static fuse_ino_t ll_ino (SfsLowlevel* ll, SfsInode* inode) {
+	return inode == &(ll->root) ? FUSE_ROOT_ID : (uintptr_t) inode;
+}
+
+static SfsInode* ll_inode (fuse_req_t req, fuse_ino_t ino) {
+	if (ino == FUSE_ROOT_ID) {
+		return &(ll_data (req)->root);
+	}
+	return (SfsInode*) (uintptr_t) ino;
+}
+
+static int ll_begin_access (fuse_req_t req) {
+	const struct fuse_ctx* ctx = fuse_req_ctx (req);
+	#ifdef FUSE_28
+	return sfs_begin_access_as (ctx->uid, ctx->gid, ctx->umask);
+	#else
+	return sfs_begin_access_as (ctx->uid, ctx->gid, 0);
+	#endif
+}
+
+// /proc/self/fd/N is the only way to reach an O_PATH fd with some syscalls
+static void ll_procname (char buf[64], int fd) {
+	snprintf (buf, 64, "/proc/self/fd/%d", fd);
+}
+
+/* Inode table */
+
+static size_t ll_hash (dev_t dev, ino_t ino, size_t nbuckets) {
+	uint64_t h = ((uint64_t) ino) ^ (((uint64_t) dev) << 32) ^ ((uint64_t) dev >> 32);
+	h *= 0x9e3779b97f4a7c15ULL;
+	return (size_t) (h >> 32) & (nbuckets - 1);
+}
+
+static SfsInode* ll_find (SfsLowlevel* ll, dev_t dev, ino_t ino) {
+	SfsInode* inode = ll->buckets[ll_hash (dev, ino, ll->nbuckets)];
+	while (inode && (inode->ino != ino || inode->dev != dev)) {
+		inode = inode->next;
+	}
+	return inode;
+}
+
+static void ll_insert (SfsLowlevel* ll, SfsInode* inode) {
+	if (ll->count >= ll->nbuckets) {
+		// grow to keep chains short, keep the old table on failure
+		size_t nbuckets = ll->nbuckets * 2;
+		SfsInode** buckets = calloc (nbuckets, sizeof (SfsInode*));
+		if (buckets) {
+			size_t i;
+			for (i=0; i < ll->nbuckets; i++) {
+				SfsInode* cur = ll->buckets[i];
+				while (cur) {
+					SfsInode* next = cur->next;
+					size_t h = ll_hash (cur->dev, cur->ino, nbuckets);
+					cur->next = buckets[h];
+					buckets[h] = cur;
+					cur = next;
+				}
+			}
+			free (ll->buckets);
+			ll->buckets = buckets;
+			ll->nbuckets = nbuckets;
+		} else {
+			syslog(LOG_WARNING, "[lowlevel] cannot grow inode table of %zu entries", ll->count);
+		}
+	}
+
+	size_t h = ll_hash (inode->dev, inode->ino, ll->nbuckets);
+	inode->next = ll->buckets[h];
+	ll->buckets[h] = inode;
+	ll->count++;
+}
+
+static void ll_remove (SfsLowlevel* ll, SfsInode* inode) {
+	SfsInode** cur = &(ll->buckets[ll_hash (inode->dev, inode->ino, ll->nbuckets)]);
+	while (*cur && *cur != inode) {
+		cur = &((*cur)->next);
+	}
+	if (*cur) {
+		*cur = inode->next;
+		ll->count--;
+	}
+}
+
+/* Directory watches, the wd table is protected by the table mutex too */
+
+static SfsInode* ll_find_wd (SfsLowlevel* ll, int wd) {
+	SfsInode* inode = ll->wd_buckets[wd % LL_WD_BUCKETS];
+	while (inode && inode->wd != wd) {
+		inode = inode->wd_next;
+	}
+	return inode;
+}
+
+static void ll_forget_wd (SfsLowlevel* ll, SfsInode* inode) {
+	SfsInode** cur = &(ll->wd_buckets[inode->wd % LL_WD_BUCKETS]);
+	while (*cur && *cur != inode) {
+		cur = &((*cur)->wd_next);
+	}
+	if (*cur) {
+		*cur = inode->wd_next;
+	}
+	inode->wd = -1;
+}
+
+static void ll_watch (SfsLowlevel* ll, SfsInode* inode) {
+	char procname[64];
+	if (ll->inotify_fd < 0 || !S_ISDIR (inode->type)) {
+		return;
+	}
+
+	ll_procname (procname, inode->fd);
+	inode->wd = inotify_add_watch (ll->inotify_fd, procname, LL_WATCH_MASK);
+	if (inode->wd < 0) {
+		// the kernel cache of this directory may go stale
+		syslog(LOG_WARNING, "[watch] cannot watch directory inode %lu: %s", (unsigned long) inode->ino, strerror (errno));
+		return;
+	}
+
+	size_t h = inode->wd % LL_WD_BUCKETS;
+	inode->wd_next = ll->wd_buckets[h];
+	ll->wd_buckets[h] = inode;
+}
+
+static void ll_unwatch (SfsLowlevel* ll, SfsInode* inode) {
+	if (inode->wd < 0) {
+		return;
+	}
+	inotify_rm_watch (ll->inotify_fd, inode->wd);
+	ll_forget_wd (ll, inode);
+}
+
+// must be called with the table mutex held
+static void ll_unref (SfsLowlevel* ll, SfsInode* inode, uint64_t n) {
+	while (inode && inode != &(ll->root)) {
+		if (inode->refcount > n) {
+			inode->refcount -= n;
+			return;
+		}
+
+		SfsInode* parent = inode->parent;
+		ll_remove (ll, inode);
+		ll_unwatch (ll, inode);
+		close (inode->fd);
+		free (inode->name);
+		free (inode);
+
+		// drop the reference the child had on its parent
+		inode = parent;
+		n = 1;
+	}
+}
+
+// must be called with the table mutex held
+static void ll_set_name (SfsLowlevel* ll, SfsInode* inode, SfsInode* parent, const char* name) {
+	if (inode == &(ll->root)) {
+		return;
+	}
+
+	if (inode->parent != parent) {
+		SfsInode* old = inode->parent;
+		parent->refcount++;
+		inode->parent = parent;
+		ll_unref (ll, old, 1);
+	}
+
+	if (!inode->name || strcmp (inode->name, name)) {
+		char* newname = strdup (name);
+		if (newname) {
+			free (inode->name);
+			inode->name = newname;
+		}
+	}
+}
+
+/* Build the mount relative path of parent/name for batch events, name
+ * may be NULL to get the path of parent itself. */
+static char* ll_path (SfsLowlevel* ll, SfsInode* parent, const char* name) {
+	pthread_mutex_lock (&(ll->mutex));
+
+	size_t len = name ? strlen (name) + 1 : 0;
+	SfsInode* cur;
+	for (cur = parent; cur && cur != &(ll->root); cur = cur->parent) {
+		len += strlen (cur->name) + 1;
+	}
+	if (len == 0) {
+		len = 1;
+	}
+
+	char* path = malloc (len + 1);
+	if (!path) {
+		pthread_mutex_unlock (&(ll->mutex));
+		syslog(LOG_CRIT, "[lowlevel] cannot allocate event path for %s", name ? name : "inode");
+		return NULL;
+	}
+
+	char* p = path + len;
+	*p = '\0';
+	if (name) {
+		size_t n = strlen (name);
+		p -= n;
+		memcpy (p, name, n);
+		*(--p) = '/';
+	}
+	for (cur = parent; cur && cur != &(ll->root); cur = cur->parent) {
+		size_t n = strlen (cur->name);
+		p -= n;
+		memcpy (p, cur->name, n);
+		*(--p) = '/';
+	}
+	path[0] = '/';
+
+	pthread_mutex_unlock (&(ll->mutex));
+	return path;
+}
+
+static void ll_event (SfsLowlevel* ll, SfsInode* parent, const char* name, const char* type) {
+	char* path = ll_path (ll, parent, name);
+	if (path) {
+		batch_file_event (path, type);
+		free (path);
+	}
+}
+
+static void ll_opened (const char* domain) {
+	SfsState* state = SFS_STATE;
+	int opened_fds = __sync_add_and_fetch (&state->opened_fds, 1);
+	if (state->log_debug) {
+		syslog (LOG_DEBUG, "[%s] opened fds %d\n", domain, opened_fds);
+	}
+}
+
+static void ll_closed (const char* domain) {
+	SfsState* state = SFS_STATE;
+	int opened_fds = __sync_sub_and_fetch (&state->opened_fds, 1);
+	if (state->log_debug) {
+		syslog (LOG_DEBUG, "[%s] opened fds %d\n", domain, opened_fds);
+	}
+}
+
+/* Lookup name in parent and take a reference on the resulting inode.
+ * Must be called within LL_BEGIN_PERM. Returns 0 or an errno value. */
+static int ll_do_lookup (SfsLowlevel* ll, SfsInode* parent, const char* name, struct fuse_entry_param* e) {
+	memset (e, 0, sizeof (struct fuse_entry_param));
+	e->attr_timeout = ll->attr_timeout;
+	e->entry_timeout = ll->entry_timeout;
+
+	int fd = openat (parent->fd, name, O_PATH | O_NOFOLLOW);
+	if (fd < 0) {
+		return errno;
+	}
+
+	if (fstatat (fd, "", &(e->attr), AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0) {
+		int err = errno;
+		close (fd);
+		return err;
+	}
+
+	pthread_mutex_lock (&(ll->mutex));
+	SfsInode* inode = ll_find (ll, e->attr.st_dev, e->attr.st_ino);
+	if (inode) {
+		close (fd);
+		inode->refcount++;
+		ll_set_name (ll, inode, parent, name);
+	} else {
+		inode = calloc (1, sizeof (SfsInode));
+		char* dupname = strdup (name);
+		if (!inode || !dupname) {
+			pthread_mutex_unlock (&(ll->mutex));
+			free (inode);
+			free (dupname);
+			close (fd);
+			return ENOMEM;
+		}
+		inode->fd = fd;
+		inode->dev = e->attr.st_dev;
+		inode->ino = e->attr.st_ino;
+		inode->type = e->attr.st_mode & S_IFMT;
+		inode->refcount = 1;
+		inode->parent = parent;
+		inode->name = dupname;
+		inode->wd = -1;
+		parent->refcount++;
+		ll_insert (ll, inode);
+		ll_watch (ll, inode);
+	}
+	pthread_mutex_unlock (&(ll->mutex));
+
+	e->ino = (uintptr_t) inode;
+	return 0;
+}
+
+/* Invalidation of kernel caches on changes beneath fuse */
+
+// nothing is known about what changed, drop the attributes of everything
+static void ll_inval_all (SfsLowlevel* ll) {
+	pthread_mutex_lock (&(ll->mutex));
+	size_t count = 0;
+	fuse_ino_t* inos = malloc (ll->count * sizeof (fuse_ino_t));
+	if (inos) {
+		size_t i;
+		for (i=0; i < ll->nbuckets; i++) {
+			SfsInode* inode;
+			for (inode = ll->buckets[i]; inode; inode = inode->next) {
+				inos[count++] = ll_ino (ll, inode);
+			}
+		}
+	}
+	pthread_mutex_unlock (&(ll->mutex));
+
+	if (!inos) {
+		syslog(LOG_CRIT, "[watch] cannot allocate inodes to invalidate");
+		return;
+	}
+
+	size_t i;
+	for (i=0; i < count; i++) {
+		fuse_lowlevel_notify_inval_inode (ll->notify, inos[i], 0, 0);
+	}
+	free (inos);
+}
+
+static void ll_watch_event (SfsLowlevel* ll, struct inotify_event* ev) {
+	if (ev->mask & IN_Q_OVERFLOW) {
+		syslog(LOG_WARNING, "[watch] inotify queue overflow, invalidating all inodes");
+		ll_inval_all (ll);
+		return;
+	}
+
+	pthread_mutex_lock (&(ll->mutex));
+	SfsInode* dir = ll_find_wd (ll, ev->wd);
+	if (!dir) {
+		pthread_mutex_unlock (&(ll->mutex));
+		return;
+	}
+
+	if (ev->mask & IN_IGNORED) {
+		// directory removed, the watch is gone already
+		ll_forget_wd (ll, dir);
+		pthread_mutex_unlock (&(ll->mutex));
+		return;
+	}
+
+	fuse_ino_t dirino = ll_ino (ll, dir);
+	fuse_ino_t ino = 0;
+	off_t off = 0;
+	if (ev->len && (ev->mask & (IN_ATTRIB | IN_MODIFY))) {
+		struct stat statbuf;
+		if (fstatat (dir->fd, ev->name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0) {
+			SfsInode* inode = ll_find (ll, statbuf.st_dev, statbuf.st_ino);
+			// writes through fuse keep the kernel cache coherent already
+			if (inode && ((ev->mask & IN_ATTRIB) || !inode->writers)) {
+				ino = ll_ino (ll, inode);
+				// only attributes, keep the page cache
+				off = (ev->mask & IN_MODIFY) ? 0 : -1;
+			}
+		}
+	}
+	pthread_mutex_unlock (&(ll->mutex));
+
+	if (!ev->len) {
+		// the directory itself
+		if (ev->mask & IN_ATTRIB) {
+			fuse_lowlevel_notify_inval_inode (ll->notify, dirino, -1, 0);
+		}
+		return;
+	}
+
+	if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+		fuse_lowlevel_notify_inval_entry (ll->notify, dirino, ev->name, strlen (ev->name));
+		fuse_lowlevel_notify_inval_inode (ll->notify, dirino, 0, 0);
+	}
+	if (ino) {
+		fuse_lowlevel_notify_inval_inode (ll->notify, ino, off, 0);
+	}
+}
+
+static void* ll_watch_handler (void* arg) {
+	SfsLowlevel* ll = (SfsLowlevel*) arg;
+	char buf[64 * 1024] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+	while (1) {
+		ssize_t len = read (ll->inotify_fd, buf, sizeof (buf));
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			syslog(LOG_CRIT, "[watch] cannot read inotify events, kernel caches may go stale: %s", strerror (errno));
+			break;
+		}
+
+		char* p = buf;
+		while (p < buf + len) {
+			struct inotify_event* ev = (struct inotify_event*) p;
+			ll_watch_event (ll, ev);
+			p += sizeof (struct inotify_event) + ev->len;
+		}
+	}
+
+	return NULL;
+}
+
+static int ll_start_watcher (SfsLowlevel* ll) {
+	pthread_t watch_thread;
+	if (pthread_create (&watch_thread, NULL, ll_watch_handler, ll) != 0) {
+		syslog(LOG_CRIT, "[init_thread] cannot start watch thread: %s", strerror (errno));
+		return 0;
+	}
+
+	if (pthread_detach (watch_thread) != 0) {
+		syslog(LOG_CRIT, "[init_thread] cannot detach watch thread: %s", strerror (errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+static int ll_fd (struct fuse_file_info* fi) {
+	return ((SfsFileHandle*) (uintptr_t) fi->fh)->fd;
+}
+
+static SfsExtents* ll_extents (struct fuse_file_info* fi) {
+	return ((SfsFileHandle*) (uintptr_t) fi->fh)->extents;
+}
+
+/* bytes of data were written at offset, data is NULL if they never were
+ * in memory. */
+static void ll_written (struct fuse_file_info* fi, const void* data, off_t offset, uint64_t bytes) {
+	SfsFileHandle* h = (SfsFileHandle*) (uintptr_t) fi->fh;
+	__sync_add_and_fetch (&(h->written), bytes);
+	extents_write (h->extents, h->fd, data, offset, bytes);
+}
+
+#ifdef SFS_PASSTHROUGH
+/* Let the kernel do reads and writes of the handle on the backing file.
+ * The kernel allows a single backing file per inode, so it's reopened
+ * read-write to be shared by all the handles: fd itself was opened with
+ * the caller credentials, which already checked the access mode. */
+static void ll_passthrough_open (fuse_req_t req, SfsInode* inode, SfsFileHandle* h, struct fuse_file_info* fi) {
+	SfsLowlevel* ll = ll_data (req);
+	int mode = fi->flags & O_ACCMODE;
+
+	pthread_mutex_lock (&(ll->mutex));
+	if (!inode->backing_id) {
+		char procname[64];
+		ll_procname (procname, inode->fd);
+		int rwfd = open (procname, O_RDWR);
+		// libfuse logs the failure and returns 0
+		int backing_id = fuse_passthrough_open (req, rwfd >= 0 ? rwfd : h->fd);
+		if (backing_id > 0) {
+			inode->backing_id = backing_id;
+			inode->backing_mode = rwfd >= 0 ? O_RDWR : mode;
+		}
+		if (rwfd >= 0) {
+			close (rwfd);
+		}
+	}
+	if (inode->backing_id && (inode->backing_mode == O_RDWR || inode->backing_mode == mode)) {
+		h->backing_id = inode->backing_id;
+		inode->backing_refs++;
+	}
+	pthread_mutex_unlock (&(ll->mutex));
+
+	if (h->backing_id) {
+		struct stat statbuf;
+		if (mode != O_RDONLY && fstat (h->fd, &statbuf) == 0) {
+			h->open_size = statbuf.st_size;
+		}
+		fi->backing_id = h->backing_id;
+	}
+}
+
+/* Writes never reach SFS, so the growth of the file is accounted
+ * instead. The backing file is dropped with its last handle. */
+static void ll_passthrough_release (fuse_req_t req, SfsInode* inode, SfsFileHandle* h) {
+	SfsLowlevel* ll = ll_data (req);
+	struct stat statbuf;
+
+	if (fstat (h->fd, &statbuf) == 0 && statbuf.st_size > h->open_size) {
+		h->written += statbuf.st_size - h->open_size;
+	}
+
+	pthread_mutex_lock (&(ll->mutex));
+	if (--inode->backing_refs == 0) {
+		fuse_passthrough_close (req, inode->backing_id);
+		inode->backing_id = 0;
+	}
+	pthread_mutex_unlock (&(ll->mutex));
+}
+#endif
+
+/* Wrap the backing fd of an opened file into a handle. */
+static int ll_new_handle (fuse_req_t req, SfsInode* inode, int fd, struct fuse_file_info* fi) {
+	SfsFileHandle* h = calloc (1, sizeof (SfsFileHandle));
+	if (!h) {
+		return ENOMEM;
+	}
+	h->fd = fd;
+
+	#ifdef SFS_PASSTHROUGH
+	if (ll_data (req)->state->passthrough) {
+		ll_passthrough_open (req, inode, h, fi);
+	}
+	#endif
+
+	if ((fi->flags & O_WRONLY) || (fi->flags & O_RDWR)) {
+		__sync_add_and_fetch (&(inode->writers), 1);
+		h->extents = extents_open (ll_data (req)->state, fd);
+		if (h->backing_id) {
+			// still registered, so that other handles know of the writes
+			extents_invalidate (h->extents);
+		}
+	}
+	fi->fh = (uintptr_t) h;
+	return 0;
+}
+
+/* Operations */
+
+static void sfs_ll_init (void* userdata, struct fuse_conn_info* conn) {
+	SfsLowlevel* ll = (SfsLowlevel*) userdata;
+	SfsState* state = ll->state;
+	state->pid = getpid ();
+
+	openlog (state->log_ident, LOG_PID, state->log_facility);
+	syslog (LOG_INFO, "[main] started sfs with the low-level backend");
+
+	sfs_init_conn (state, conn);
+
+	sfs_write_pid (state);
+	batch_start_writer (state);
+	stats_start_timer (state);
+	if (ll->inotify_fd >= 0) {
+		ll_start_watcher (ll);
+	}
+}
+
+static void sfs_ll_destroy (void* userdata) {
+	// other threads might still be accessing the state, only make sure
+	// queued events reach the tmp batch
+	batch_drain ();
+}
+
+static void sfs_ll_lookup (fuse_req_t req, fuse_ino_t parent, const char* name) {
+	struct fuse_entry_param e;
+
+	LL_BEGIN_PERM (req);
+	int err = ll_do_lookup (ll_data (req), ll_inode (req, parent), name, &e);
+	LL_END_PERM;
+	if (err) {
+		fuse_reply_err (req, err);
+	} else {
+		fuse_reply_entry (req, &e);
+	}
+}
+
+#ifdef SFS_FUSE3
+static void sfs_ll_forget (fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+#else
+static void sfs_ll_forget (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+#endif
+	SfsLowlevel* ll = ll_data (req);
+	pthread_mutex_lock (&(ll->mutex));
+	ll_unref (ll, ll_inode (req, ino), nlookup);
+	pthread_mutex_unlock (&(ll->mutex));
+	fuse_reply_none (req);
+}
+
+static void sfs_ll_forget_multi (fuse_req_t req, size_t count, struct fuse_forget_data* forgets) {
+	SfsLowlevel* ll = ll_data (req);
+	size_t i;
+	pthread_mutex_lock (&(ll->mutex));
+	for (i=0; i < count; i++) {
+		ll_unref (ll, ll_inode (req, forgets[i].ino), forgets[i].nlookup);
+	}
+	pthread_mutex_unlock (&(ll->mutex));
+	fuse_reply_none (req);
+}
+
+static void sfs_ll_getattr (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	SfsInode* inode = ll_inode (req, ino);
+	struct stat statbuf;
+	int retstat;
+
+	LL_BEGIN_PERM (req);
+	retstat = fstatat (inode->fd, "", &statbuf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+	LL_END_PERM;
+	if (retstat < 0) {
+		fuse_reply_err (req, errno);
+	} else {
+		fuse_reply_attr (req, &statbuf, ll_data (req)->attr_timeout);
+	}
+}
+
+static void sfs_ll_setattr (fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set, struct fuse_file_info* fi) {
+	SfsLowlevel* ll = ll_data (req);
+	SfsInode* inode = ll_inode (req, ino);
+	char procname[64];
+	int retstat = 0;
+	int err = 0;
+
+	ll_procname (procname, inode->fd);
+
+	LL_BEGIN_PERM (req);
+	if (to_set & FUSE_SET_ATTR_MODE) {
+		if (fi) {
+			retstat = fchmod (ll_fd (fi), attr->st_mode);
+		} else {
+			retstat = chmod (procname, attr->st_mode);
+		}
+		if (retstat < 0) {
+			goto error;
+		}
+	}
+
+	if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1;
+		gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1;
+		retstat = fchownat (inode->fd, "", uid, gid, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+		if (retstat < 0) {
+			goto error;
+		}
+	}
+
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		if (fi) {
+			retstat = ftruncate (ll_fd (fi), attr->st_size);
+		} else {
+			retstat = truncate (procname, attr->st_size);
+		}
+		if (retstat < 0) {
+			goto error;
+		}
+		if (fi) {
+			extents_truncate (ll_extents (fi), attr->st_size);
+		} else {
+			// not through a handle, the ranges of open handles are void
+			extents_touch (inode->fd, "", AT_EMPTY_PATH);
+		}
+	}
+
+	if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+		struct timespec ts[2];
+		ts[0].tv_sec = 0;
+		ts[1].tv_sec = 0;
+		ts[0].tv_nsec = UTIME_OMIT;
+		ts[1].tv_nsec = UTIME_OMIT;
+
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+			ts[0].tv_nsec = UTIME_NOW;
+		} else if (to_set & FUSE_SET_ATTR_ATIME) {
+			ts[0] = attr->st_atim;
+		}
+
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+			ts[1].tv_nsec = UTIME_NOW;
+		} else if (to_set & FUSE_SET_ATTR_MTIME) {
+			ts[1] = attr->st_mtim;
+		}
+
+		if (ll->state->forbid_older_mtime && (to_set & FUSE_SET_ATTR_MTIME) && !(to_set & FUSE_SET_ATTR_MTIME_NOW)) {
+			struct stat statbuf;
+			if (fstatat (inode->fd, "", &statbuf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0) {
+				syslog(LOG_CRIT, "[setattr] cannot stat to forbid older mtime of inode %lu: %s", (unsigned long) inode->ino, strerror(errno));
+			} else if (ts[1].tv_sec < statbuf.st_mtim.tv_sec || (ts[1].tv_sec == statbuf.st_mtim.tv_sec && ts[1].tv_nsec < statbuf.st_mtim.tv_nsec)) {
+				errno = EPERM;
+				goto error;
+			}
+		}
+
+		if (fi) {
+			retstat = futimens (ll_fd (fi), ts);
+		} else if (S_ISLNK (inode->type)) {
+			// don't follow symlinks, the kernel never sends this anyway
+			errno = EPERM;
+			retstat = -1;
+		} else {
+			retstat = utimensat (AT_FDCWD, procname, ts, 0);
+		}
+		if (retstat < 0) {
+			goto error;
+		}
+	}
+	LL_END_PERM;
+
+	if (to_set & FUSE_SET_ATTR_MODE) {
+		sfs_update_mtime ("chmod", AT_FDCWD, procname);
+	} else if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		sfs_update_mtime ("chown", AT_FDCWD, procname);
+	}
+	ll_event (ll, inode, NULL, "norec");
+
+	sfs_ll_getattr (req, ino, fi);
+	return;
+
+error:
+	err = errno;
+	LL_END_PERM;
+	fuse_reply_err (req, err);
+}
+
+static void sfs_ll_readlink (fuse_req_t req, fuse_ino_t ino) {
+	SfsInode* inode = ll_inode (req, ino);
+	char buf[PATH_MAX + 1];
+	int retstat;
+
+	LL_BEGIN_PERM (req);
+	retstat = readlinkat (inode->fd, "", buf, sizeof (buf));
+	LL_END_PERM;
+	if (retstat < 0) {
+		fuse_reply_err (req, errno);
+	} else if (retstat == sizeof (buf)) {
+		fuse_reply_err (req, ENAMETOOLONG);
+	} else {
+		buf[retstat] = '\0';
+		fuse_reply_readlink (req, buf);
+	}
+}
+
+/* Common tail of operations creating a new entry. */
+static void ll_reply_new_entry (fuse_req_t req, SfsInode* parent, const char* name, int retstat) {
+	struct fuse_entry_param e;
+	int err;
+
+	if (retstat < 0) {
+		err = errno;
+		LL_END_PERM;
+		fuse_reply_err (req, err);
+		return;
+	}
+
+	err = ll_do_lookup (ll_data (req), parent, name, &e);
+	LL_END_PERM;
+
+	ll_event (ll_data (req), parent, name, "norec");
+	if (err) {
+		fuse_reply_err (req, err);
+	} else {
+		fuse_reply_entry (req, &e);
+	}
+}
+
+static void sfs_ll_mknod (fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, dev_t rdev) {
+	SfsInode* dir = ll_inode (req, parent);
+
+	LL_BEGIN_PERM (req);
+	ll_reply_new_entry (req, dir, name, mknodat (dir->fd, name, mode, rdev));
+}
+
+static void sfs_ll_mkdir (fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode) {
+	SfsInode* dir = ll_inode (req, parent);
+
+	LL_BEGIN_PERM (req);
+	ll_reply_new_entry (req, dir, name, mkdirat (dir->fd, name, mode));
+}
+
+static void sfs_ll_symlink (fuse_req_t req, const char* link, fuse_ino_t parent, const char* name) {
+	SfsInode* dir = ll_inode (req, parent);
+
+	LL_BEGIN_PERM (req);
+	ll_reply_new_entry (req, dir, name, symlinkat (link, dir->fd, name));
+}
+
+static void sfs_ll_link (fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char* newname) {
+	SfsInode* inode = ll_inode (req, ino);
+	SfsInode* dir = ll_inode (req, newparent);
+	char procname[64];
+	int retstat;
+
+	ll_procname (procname, inode->fd);
+
+	LL_BEGIN_PERM (req);
+	// following the /proc link leads to the inode itself, even for symlinks
+	retstat = linkat (AT_FDCWD, procname, dir->fd, newname, AT_SYMLINK_FOLLOW);
+	ll_reply_new_entry (req, dir, newname, retstat);
+}
+
+static void ll_remove_entry (fuse_req_t req, fuse_ino_t parent, const char* name, int flags) {
+	SfsInode* dir = ll_inode (req, parent);
+	int retstat;
+
+	LL_BEGIN_PERM (req);
+	retstat = unlinkat (dir->fd, name, flags);
+	LL_END_PERM;
+	if (retstat < 0) {
+		fuse_reply_err (req, errno);
+	} else {
+		ll_event (ll_data (req), dir, name, "norec");
+		fuse_reply_err (req, 0);
+	}
+}
+
+static void sfs_ll_unlink (fuse_req_t req, fuse_ino_t parent, const char* name) {
+	ll_remove_entry (req, parent, name, 0);
+}
+
+static void sfs_ll_rmdir (fuse_req_t req, fuse_ino_t parent, const char* name) {
+	ll_remove_entry (req, parent, name, AT_REMOVEDIR);
+}
+
+#ifdef SFS_FUSE3
+static void sfs_ll_rename (fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname, unsigned int flags) {
+#else
+static void sfs_ll_rename (fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname) {
+#endif
+	SfsLowlevel* ll = ll_data (req);
+	SfsInode* dir = ll_inode (req, parent);
+	SfsInode* newdir = ll_inode (req, newparent);
+	int retstat;
+
+	#ifdef SFS_FUSE3
+	// exchanging would need events and inode table updates for both sides
+	if (flags & ~RENAME_NOREPLACE) {
+		fuse_reply_err (req, EINVAL);
+		return;
+	}
+	#endif
+
+	const char* mode = "norec";
+	struct stat statbuf;
+	memset (&statbuf, 0, sizeof (statbuf));
+	if (fstatat (dir->fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) >= 0 && S_ISDIR (statbuf.st_mode)) {
+		mode = "rec";
+	}
+
+	LL_BEGIN_PERM (req);
+	// build the old path before the inode table is updated
+	char* path = ll_path (ll, dir, name);
+	#ifdef SFS_FUSE3
+	retstat = renameat2 (dir->fd, name, newdir->fd, newname, flags);
+	#else
+	retstat = renameat (dir->fd, name, newdir->fd, newname);
+	#endif
+	LL_END_PERM;
+	if (retstat < 0) {
+		int err = errno;
+		free (path);
+		fuse_reply_err (req, err);
+		return;
+	}
+
+	// keep the event path of the moved inode up to date
+	if (statbuf.st_ino) {
+		pthread_mutex_lock (&(ll->mutex));
+		SfsInode* inode = ll_find (ll, statbuf.st_dev, statbuf.st_ino);
+		if (inode) {
+			ll_set_name (ll, inode, newdir, newname);
+		}
+		pthread_mutex_unlock (&(ll->mutex));
+	}
+
+	char* newpath = ll_path (ll, newdir, newname);
+	if (path && newpath) {
+		batch_rename_event (path, newpath, &statbuf);
+	}
+	if (path) {
+		batch_file_event (path, mode);
+		free (path);
+	}
+	if (newpath) {
+		batch_file_event (newpath, mode);
+		free (newpath);
+	}
+	fuse_reply_err (req, 0);
+}
+
+static void sfs_ll_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	SfsInode* inode = ll_inode (req, ino);
+	char procname[64];
+	int fd;
+
+	ll_procname (procname, inode->fd);
+
+	LL_BEGIN_PERM (req);
+	fd = open (procname, sfs_open_flags (fi->flags) & ~O_NOFOLLOW);
+	LL_END_PERM;
+	if (fd < 0) {
+		fuse_reply_err (req, errno);
+		return;
+	}
+
+	int err = ll_new_handle (req, inode, fd, fi);
+	if (err) {
+		close (fd);
+		fuse_reply_err (req, err);
+		return;
+	}
+	ll_opened ("open");
+	fuse_reply_open (req, fi);
+}
+
+static void sfs_ll_create (fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, struct fuse_file_info* fi) {
+	SfsInode* dir = ll_inode (req, parent);
+	struct fuse_entry_param e;
+	int err;
+	int fd;
+
+	LL_BEGIN_PERM (req);
+	fd = openat (dir->fd, name, sfs_open_flags (fi->flags | O_CREAT) & ~O_NOFOLLOW, mode);
+	if (fd < 0) {
+		err = errno;
+		LL_END_PERM;
+		fuse_reply_err (req, err);
+		return;
+	}
+	err = ll_do_lookup (ll_data (req), dir, name, &e);
+	LL_END_PERM;
+	if (!err) {
+		err = ll_new_handle (req, ll_inode (req, e.ino), fd, fi);
+		if (err) {
+			// drop the reference taken by the lookup
+			pthread_mutex_lock (&(ll_data (req)->mutex));
+			ll_unref (ll_data (req), ll_inode (req, e.ino), 1);
+			pthread_mutex_unlock (&(ll_data (req)->mutex));
+		}
+	}
+	if (err) {
+		close (fd);
+		fuse_reply_err (req, err);
+		return;
+	}
+
+	ll_opened ("creat");
+	fuse_reply_create (req, &e, fi);
+}
+
+static void sfs_ll_read (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi) {
+	#ifdef FUSE_29
+	// reply with the backing file itself, fuse will splice() it if possible
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT (size);
+	src.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	if (!fi->direct_io) {
+		// short reads only at EOF
+		src.buf[0].flags |= FUSE_BUF_FD_RETRY;
+	}
+	src.buf[0].fd = ll_fd (fi);
+	src.buf[0].pos = offset;
+	fuse_reply_data (req, &src, FUSE_BUF_SPLICE_MOVE);
+	#else
+	char* buf = malloc (size);
+	if (!buf) {
+		fuse_reply_err (req, ENOMEM);
+		return;
+	}
+
+	ssize_t retstat = pread (ll_fd (fi), buf, size, offset);
+	if (retstat < 0) {
+		fuse_reply_err (req, errno);
+	} else {
+		fuse_reply_buf (req, buf, retstat);
+	}
+	free (buf);
+	#endif
+}
+
+static void sfs_ll_write (fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+	ssize_t retstat = pwrite (ll_fd (fi), buf, size, offset);
+	if (retstat < 0) {
+		fuse_reply_err (req, errno);
+		return;
+	}
+
+	if (retstat > 0) {
+		ll_written (fi, buf, offset, retstat);
+	}
+	fuse_reply_write (req, retstat);
+}
+
+#ifdef FUSE_29
+static void sfs_ll_write_buf (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* bufv, off_t offset, struct fuse_file_info* fi) {
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT (fuse_buf_size (bufv));
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	if (!fi->direct_io) {
+		// write everything or fail
+		dst.buf[0].flags |= FUSE_BUF_FD_RETRY;
+	}
+	dst.buf[0].fd = ll_fd (fi);
+	dst.buf[0].pos = offset;
+
+	// the copy consumes bufv
+	const void* data = sfs_buf_mem (bufv);
+	ssize_t retstat = fuse_buf_copy (&dst, bufv, FUSE_BUF_SPLICE_NONBLOCK);
+	if (retstat < 0) {
+		fuse_reply_err (req, -retstat);
+		return;
+	}
+
+	if (retstat > 0) {
+		ll_written (fi, data, offset, retstat);
+	}
+	fuse_reply_write (req, retstat);
+}
+#endif
+
+static void sfs_ll_flush (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	fuse_reply_err (req, 0);
+}
+
+static void sfs_ll_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	SfsFileHandle* h = (SfsFileHandle*) (uintptr_t) fi->fh;
+	SfsInode* inode = ll_inode (req, ino);
+
+	#ifdef SFS_PASSTHROUGH
+	if (h->backing_id) {
+		ll_passthrough_release (req, inode, h);
+	}
+	#endif
+
+	uint64_t written = h->written;
+	char* path = NULL;
+	char* record = NULL;
+	int record_len = 0;
+	if ((fi->flags & O_WRONLY) || (fi->flags & O_RDWR)) {
+		path = ll_path (ll_data (req), inode, NULL);
+		record = extents_release (h->extents, h->fd, path, &record_len);
+	}
+	int retstat = close (h->fd);
+	int err = errno;
+	free (h);
+	// the fd is gone even if close failed
+	if ((fi->flags & O_WRONLY) || (fi->flags & O_RDWR)) {
+		__sync_sub_and_fetch (&(inode->writers), 1);
+	}
+	ll_closed ("close");
+	if (retstat < 0) {
+		free (path);
+		free (record);
+		fuse_reply_err (req, err);
+		return;
+	}
+
+	if (path) {
+		batch_written_event (path, written, record, record_len);
+		free (path);
+	}
+	fuse_reply_err (req, 0);
+}
+
+static void sfs_ll_fsync (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi) {
+	int retstat;
+	if (datasync) {
+		retstat = fdatasync (ll_fd (fi));
+	} else {
+		retstat = fsync (ll_fd (fi));
+	}
+	fuse_reply_err (req, retstat < 0 ? errno : 0);
+}
+
+#if defined(FUSE_291) && defined(HAVE_FALLOCATE)
+static void sfs_ll_fallocate (fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info* fi) {
+	int retstat = fallocate (ll_fd (fi), mode, offset, length);
+	if (retstat == 0 && (mode & ~FALLOC_FL_KEEP_SIZE)) {
+		// holes and shifted data are not ranges
+		extents_invalidate (ll_extents (fi));
+	}
+	fuse_reply_err (req, retstat < 0 ? errno : 0);
+}
+#endif
+
+#ifdef SFS_FUSE3
+/* Reflinks and in-kernel copies are up to the original filesystem, the
+ * destination event is emitted on release like for writes. */
+static void sfs_ll_copy_file_range (fuse_req_t req, fuse_ino_t ino_in, off_t off_in, struct fuse_file_info* fi_in, fuse_ino_t ino_out, off_t off_out, struct fuse_file_info* fi_out, size_t len, int flags) {
+	off_t offset = off_out;
+	ssize_t retstat = copy_file_range (ll_fd (fi_in), &off_in, ll_fd (fi_out), &off_out, len, flags);
+	if (retstat < 0) {
+		fuse_reply_err (req, errno);
+		return;
+	}
+
+	if (retstat > 0) {
+		ll_written (fi_out, NULL, offset, retstat);
+	}
+	fuse_reply_write (req, retstat);
+}
+
+static void sfs_ll_lseek (fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info* fi) {
+	off_t retstat = lseek (ll_fd (fi), off, whence);
+	if (retstat < 0) {
+		fuse_reply_err (req, errno);
+	} else {
+		fuse_reply_lseek (req, retstat);
+	}
+}
+#endif
+
+static void sfs_ll_opendir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	SfsInode* inode = ll_inode (req, ino);
+	SfsDirHandle* d = calloc (1, sizeof (SfsDirHandle));
+	int err;
+	int fd;
+
+	if (!d) {
+		fuse_reply_err (req, ENOMEM);
+		return;
+	}
+
+	LL_BEGIN_PERM (req);
+	fd = openat (inode->fd, ".", O_RDONLY | O_DIRECTORY);
+	if (fd >= 0) {
+		d->dp = fdopendir (fd);
+	}
+	err = errno;
+	LL_END_PERM;
+	if (!d->dp) {
+		if (fd >= 0) {
+			close (fd);
+		}
+		free (d);
+		fuse_reply_err (req, err);
+		return;
+	}
+
+	ll_opened ("opendir");
+	fi->fh = (uintptr_t) d;
+	fuse_reply_open (req, fi);
+}
+
+/* With plus, every entry but . and .. is looked up like with lookup()
+ * and its attributes sent along, taking a reference on the inode. */
+static void ll_readdir (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi, int plus) {
+	SfsDirHandle* d = (SfsDirHandle*) (uintptr_t) fi->fh;
+	size_t used = 0;
+	int err = 0;
+
+	if (plus) {
+		LL_BEGIN_PERM (req);
+	}
+
+	char* buf = malloc (size);
+	if (!buf) {
+		if (plus) {
+			LL_END_PERM;
+		}
+		fuse_reply_err (req, ENOMEM);
+		return;
+	}
+
+	if (offset != d->offset) {
+		seekdir (d->dp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
+
+	while (1) {
+		if (!d->entry) {
+			errno = 0;
+			d->entry = readdir (d->dp);
+			if (!d->entry) {
+				err = errno;
+				break;
+			}
+		}
+
+		const char* name = d->entry->d_name;
+		off_t nextoff = telldir (d->dp);
+		size_t entsize;
+		#ifdef SFS_FUSE3
+		if (plus) {
+			SfsLowlevel* ll = ll_data (req);
+			struct fuse_entry_param e;
+			int dots = !strcmp (name, ".") || !strcmp (name, "..");
+			if (dots || ll_do_lookup (ll, ll_inode (req, ino), name, &e) != 0) {
+				// no lookup, the kernel only gets the dirent
+				memset (&e, 0, sizeof (e));
+				e.attr.st_ino = d->entry->d_ino;
+				e.attr.st_mode = d->entry->d_type << 12;
+			}
+			entsize = fuse_add_direntry_plus (req, buf + used, size - used, name, &e, nextoff);
+			if (entsize > size - used) {
+				if (e.ino) {
+					pthread_mutex_lock (&(ll->mutex));
+					ll_unref (ll, (SfsInode*) (uintptr_t) e.ino, 1);
+					pthread_mutex_unlock (&(ll->mutex));
+				}
+				break;
+			}
+		} else
+		#endif
+		{
+			struct stat st;
+			memset (&st, 0, sizeof (st));
+			st.st_ino = d->entry->d_ino;
+			st.st_mode = d->entry->d_type << 12;
+			entsize = fuse_add_direntry (req, buf + used, size - used, name, &st, nextoff);
+			if (entsize > size - used) {
+				// buffer full, the entry is kept for the next call
+				break;
+			}
+		}
+
+		used += entsize;
+		d->entry = NULL;
+		d->offset = nextoff;
+	}
+
+	if (plus) {
+		LL_END_PERM;
+	}
+
+	if (err && used == 0) {
+		fuse_reply_err (req, err);
+	} else {
+		fuse_reply_buf (req, buf, used);
+	}
+	free (buf);
+}
+
+static void sfs_ll_readdir (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi) {
+	ll_readdir (req, ino, size, offset, fi, 0);
+}
+
+#ifdef SFS_FUSE3
+static void sfs_ll_readdirplus (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi) {
+	ll_readdir (req, ino, size, offset, fi, 1);
+}
+#endif
+
+static void sfs_ll_releasedir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	SfsDirHandle* d = (SfsDirHandle*) (uintptr_t) fi->fh;
+	int retstat = closedir (d->dp);
+	free (d);
+	if (retstat < 0) {
+		fuse_reply_err (req, errno);
+		return;
+	}
+
+	ll_closed ("closedir");
+	fuse_reply_err (req, 0);
+}
+
+static void sfs_ll_fsyncdir (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi) {
+	SfsDirHandle* d = (SfsDirHandle*) (uintptr_t) fi->fh;
+	int fd = dirfd (d->dp);
+	int retstat;
+	if (datasync) {
+		retstat = fdatasync (fd);
+	} else {
+		retstat = fsync (fd);
+	}
+	fuse_reply_err (req, retstat < 0 ? errno : 0);
+}
+
+static void sfs_ll_statfs (fuse_req_t req, fuse_ino_t ino) {
+	SfsInode* inode = ll_inode (req, ino);
+	struct statvfs statv;
+	char procname[64];
+	int retstat;
+
+	ll_procname (procname, inode->fd);
+
+	LL_BEGIN_PERM (req);
+	retstat = statvfs (procname, &statv);
+	LL_END_PERM;
+	if (retstat < 0) {
+		fuse_reply_err (req, errno);
+	} else {
+		fuse_reply_statfs (req, &statv);
+	}
+}
+
+static void sfs_ll_access (fuse_req_t req, fuse_ino_t ino, int mask) {
+	SfsInode* inode = ll_inode (req, ino);
+	char procname[64];
+	int retstat;
+
+	ll_procname (procname, inode->fd);
+
+	LL_BEGIN_PERM (req);
+	retstat = euidaccess (procname, mask);
+	LL_END_PERM;
+	fuse_reply_err (req, retstat < 0 ? errno : 0);
+}
+
+/* Extended attributes cannot be reached from an O_PATH fd of a symlink
+ * through /proc, use the last known parent and name for those. */
+static void ll_xattr_path (SfsLowlevel* ll, SfsInode* inode, char* buf, size_t size) {
+	if (S_ISLNK (inode->type)) {
+		pthread_mutex_lock (&(ll->mutex));
+		snprintf (buf, size, "/proc/self/fd/%d/%s", inode->parent->fd, inode->name);
+		pthread_mutex_unlock (&(ll->mutex));
+	} else {
+		snprintf (buf, size, "/proc/self/fd/%d", inode->fd);
+	}
+}
+
+static void sfs_ll_setxattr (fuse_req_t req, fuse_ino_t ino, const char* name, const char* value, size_t size, int flags) {
+	SfsLowlevel* ll = ll_data (req);
+	SfsInode* inode = ll_inode (req, ino);
+	char path[64 + NAME_MAX];
+	int retstat;
+
+	if (sfs_xattr_reserved (name)) {
+		fuse_reply_err (req, EPERM);
+		return;
+	}
+	ll_xattr_path (ll, inode, path, sizeof (path));
+
+	LL_BEGIN_PERM (req);
+	retstat = lsetxattr (path, name, value, size, flags);
+	LL_END_PERM;
+	if (retstat < 0) {
+		fuse_reply_err (req, errno);
+	} else {
+		ll_event (ll, inode, NULL, "norec");
+		fuse_reply_err (req, 0);
+	}
+}
+
+static void sfs_ll_getxattr (fuse_req_t req, fuse_ino_t ino, const char* name, size_t size) {
+	SfsInode* inode = ll_inode (req, ino);
+	char path[64 + NAME_MAX];
+	char* value = NULL;
+	ssize_t retstat;
+
+	ll_xattr_path (ll_data (req), inode, path, sizeof (path));
+
+	LL_BEGIN_PERM (req);
+	if (size) {
+		value = malloc (size);
+		if (!value) {
+			LL_END_PERM;
+			fuse_reply_err (req, ENOMEM);
+			return;
+		}
+	}
+	retstat = lgetxattr (path, name, value, size);
+	LL_END_PERM;
+	if (retstat < 0) {
+		fuse_reply_err (req, errno);
+	} else if (size) {
+		fuse_reply_buf (req, value, retstat);
+	} else {
+		fuse_reply_xattr (req, retstat);
+	}
+	free (value);
+}
+
+static void sfs_ll_listxattr (fuse_req_t req, fuse_ino_t ino, size_t size) {
+	SfsInode* inode = ll_inode (req, ino);
+	char path[64 + NAME_MAX];
+	char* list = NULL;
+	ssize_t retstat;
+
+	ll_xattr_path (ll_data (req), inode, path, sizeof (path));
+
+	LL_BEGIN_PERM (req);
+	if (size) {
+		list = malloc (size);
+		if (!list) {
+			LL_END_PERM;
+			fuse_reply_err (req, ENOMEM);
+			return;
+		}
+	}
+	retstat = sfs_list_xattrs (path, list, size);
+	LL_END_PERM;
+	if (retstat < 0) {
+		fuse_reply_err (req, errno);
+	} else if (size) {
+		fuse_reply_buf (req, list, retstat);
+	} else {
+		fuse_reply_xattr (req, retstat);
+	}
+	free (list);
+}
+
+static void sfs_ll_removexattr (fuse_req_t req, fuse_ino_t ino, const char* name) {
+	SfsLowlevel* ll = ll_data (req);
+	SfsInode* inode = ll_inode (req, ino);
+	char path[64 + NAME_MAX];
+	int retstat;
+
+	if (sfs_xattr_reserved (name)) {
+		fuse_reply_err (req, EPERM);
+		return;
+	}
+	ll_xattr_path (ll, inode, path, sizeof (path));
+
+	LL_BEGIN_PERM (req);
+	retstat = lremovexattr (path, name);
+	LL_END_PERM;
+	if (retstat < 0) {
+		fuse_reply_err (req, errno);
+	} else {
+		ll_event (ll, inode, NULL, "norec");
+		fuse_reply_err (req, 0);
+	}
+}
+
+static struct fuse_lowlevel_ops sfs_ll_oper = {
+	.init = sfs_ll_init,
+	.destroy = sfs_ll_destroy,
+	.lookup = sfs_ll_lookup,
+	.forget = sfs_ll_forget,
+	.forget_multi = sfs_ll_forget_multi,
+	.getattr = sfs_ll_getattr,
+	.setattr = sfs_ll_setattr,
+	.readlink = sfs_ll_readlink,
+	.mknod = sfs_ll_mknod,
+	.mkdir = sfs_ll_mkdir,
+	.unlink = sfs_ll_unlink,
+	.rmdir = sfs_ll_rmdir,
+	.symlink = sfs_ll_symlink,
+	.rename = sfs_ll_rename,
+	.link = sfs_ll_link,
+	.open = sfs_ll_open,
+	.read = sfs_ll_read,
+	.write = sfs_ll_write,
+	#ifdef FUSE_29
+	.write_buf = sfs_ll_write_buf,
+	#endif
+	.flush = sfs_ll_flush,
+	.release = sfs_ll_release,
+	.fsync = sfs_ll_fsync,
+	#if defined(FUSE_291) && defined(HAVE_FALLOCATE)
+	.fallocate = sfs_ll_fallocate,
+	#endif
+	#ifdef SFS_FUSE3
+	.copy_file_range = sfs_ll_copy_file_range,
+	.lseek = sfs_ll_lseek,
+	#endif
+	.opendir = sfs_ll_opendir,
+	.readdir = sfs_ll_readdir,
+	#ifdef SFS_FUSE3
+	.readdirplus = sfs_ll_readdirplus,
+	#endif
+	.releasedir = sfs_ll_releasedir,
+	.fsyncdir = sfs_ll_fsyncdir,
+	.statfs = sfs_ll_statfs,
+	.setxattr = sfs_ll_setxattr,
+	.getxattr = sfs_ll_getxattr,
+	.listxattr = sfs_ll_listxattr,
+	.removexattr = sfs_ll_removexattr,
+	.access = sfs_ll_access,
+	.create = sfs_ll_create,
+};
+
+#define LL_OPT(t, p, v) { t, offsetof(SfsLowlevel, p), v }
+
+// high-level options that have a meaning for this backend too
+static struct fuse_opt sfs_ll_opts[] = {
+	LL_OPT("entry_timeout=%lf", entry_timeout, 0),
+	LL_OPT("attr_timeout=%lf", attr_timeout, 0),
+	FUSE_OPT_KEY("use_ino", FUSE_OPT_KEY_DISCARD),
+	FUSE_OPT_KEY("readdir_ino", FUSE_OPT_KEY_DISCARD),
+	FUSE_OPT_END
+};
+
+#ifdef SFS_FUSE3
+static int ll_run (struct fuse_args* args, SfsLowlevel* ll) {
+	struct fuse_cmdline_opts opts;
+	struct fuse_session* se = NULL;
+	int ret = 1;
+
+	if (fuse_parse_cmdline (args, &opts) != 0) {
+		return 1;
+	}
+	if (!opts.mountpoint) {
+		syslog(LOG_ERR, "[lowlevel] missing mountpoint");
+		return 1;
+	}
+
+	se = fuse_session_new (args, &sfs_ll_oper, sizeof (sfs_ll_oper), ll);
+	if (!se) {
+		goto out;
+	}
+	ll->notify = se;
+
+	if (fuse_set_signal_handlers (se) < 0) {
+		goto out_destroy;
+	}
+
+	if (fuse_session_mount (se, opts.mountpoint) != 0) {
+		goto out_signals;
+	}
+
+	if (fuse_daemonize (opts.foreground) == 0) {
+		if (opts.singlethread) {
+			ret = fuse_session_loop (se);
+		} else {
+			struct fuse_loop_config* config = fuse_loop_cfg_create ();
+			if (config) {
+				fuse_loop_cfg_set_clone_fd (config, opts.clone_fd);
+				fuse_loop_cfg_set_max_threads (config, opts.max_threads);
+				fuse_loop_cfg_set_idle_threads (config, opts.max_idle_threads);
+				ret = fuse_session_loop_mt (se, config);
+				fuse_loop_cfg_destroy (config);
+			}
+		}
+	}
+
+	fuse_session_unmount (se);
+out_signals:
+	fuse_remove_signal_handlers (se);
+out_destroy:
+	fuse_session_destroy (se);
+out:
+	free (opts.mountpoint);
+	return ret ? 1 : 0;
+}
+#else
+static int ll_run (struct fuse_args* args, SfsLowlevel* ll) {
+	struct fuse_session* se = NULL;
+	struct fuse_chan* ch = NULL;
+	char* mountpoint = NULL;
+	int multithreaded = 0;
+	int foreground = 0;
+	int ret = 1;
+
+	if (fuse_parse_cmdline (args, &mountpoint, &multithreaded, &foreground) < 0) {
+		return 1;
+	}
+	if (!mountpoint) {
+		syslog(LOG_ERR, "[lowlevel] missing mountpoint");
+		return 1;
+	}
+
+	ch = fuse_mount (mountpoint, args);
+	if (!ch) {
+		goto out;
+	}
+
+	se = fuse_lowlevel_new (args, &sfs_ll_oper, sizeof (sfs_ll_oper), ll);
+	if (!se) {
+		goto out_unmount;
+	}
+
+	if (fuse_set_signal_handlers (se) < 0) {
+		goto out_destroy;
+	}
+	fuse_session_add_chan (se, ch);
+	ll->notify = ch;
+
+	if (fuse_daemonize (foreground) == 0) {
+		if (multithreaded) {
+			ret = fuse_session_loop_mt (se);
+		} else {
+			ret = fuse_session_loop (se);
+		}
+	}
+
+	fuse_remove_signal_handlers (se);
+	fuse_session_remove_chan (ch);
+out_destroy:
+	fuse_session_destroy (se);
+out_unmount:
+	fuse_unmount (mountpoint, ch);
+out:
+	free (mountpoint);
+	return ret ? 1 : 0;
+}
+#endif
+
+int sfs_lowlevel_main (struct fuse_args* args, SfsState* state) {
+	SfsLowlevel* ll = calloc (1, sizeof (SfsLowlevel));
+
+	if (!ll) {
+		syslog(LOG_ERR, "[lowlevel] cannot allocate backend state");
+		return 1;
+	}
+
+	ll->state = state;
+	// defaults depend on sfs_watch
+	ll->entry_timeout = -1;
+	ll->attr_timeout = -1;
+	ll->inotify_fd = -1;
+	if (pthread_mutex_init (&(ll->mutex), NULL) != 0) {
+		syslog(LOG_ERR, "[lowlevel] cannot init inode table mutex: %s", strerror (errno));
+		return 1;
+	}
+
+	ll->nbuckets = LL_INITIAL_BUCKETS;
+	ll->buckets = calloc (ll->nbuckets, sizeof (SfsInode*));
+	if (!ll->buckets) {
+		syslog(LOG_ERR, "[lowlevel] cannot allocate inode table");
+		return 1;
+	}
+
+	if (fuse_opt_parse (args, ll, sfs_ll_opts, NULL) < 0) {
+		return 1;
+	}
+
+	if (state->watch) {
+		ll->inotify_fd = inotify_init1 (IN_CLOEXEC);
+		if (ll->inotify_fd < 0) {
+			syslog(LOG_ERR, "[lowlevel] cannot init inotify: %s", strerror (errno));
+			return 1;
+		}
+	}
+
+	double timeout = state->watch ? LL_WATCH_TIMEOUT : 1.0;
+	if (ll->entry_timeout < 0) {
+		ll->entry_timeout = timeout;
+	}
+	if (ll->attr_timeout < 0) {
+		ll->attr_timeout = timeout;
+	}
+
+	// the root inode is never forgotten
+	struct stat statbuf;
+	ll->root.fd = state->rootdir_fd;
+	if (fstat (ll->root.fd, &statbuf) < 0) {
+		syslog(LOG_ERR, "[lowlevel] cannot open root %s: %s", state->rootdir, strerror (errno));
+		return 1;
+	}
+	ll->root.dev = statbuf.st_dev;
+	ll->root.ino = statbuf.st_ino;
+	ll->root.type = S_IFDIR;
+	ll->root.refcount = 2;
+	ll->root.wd = -1;
+	ll_insert (ll, &(ll->root));
+	ll_watch (ll, &(ll->root));
+
+	return ll_run (args, ll);
+}
+
+#endif
@@ -0,0 +1,66 @@
+/*
+ *  path.c - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+
+#include "path.h"
+
+// kind of a journal record, d, f, l or o
+char path_kind (mode_t mode) {
+	if (S_ISDIR (mode)) {
+		return 'd';
+	} else if (S_ISREG (mode)) {
+		return 'f';
+	} else if (S_ISLNK (mode)) {
+		return 'l';
+	}
+	return 'o';
+}
+
+// absolute, without . or .. components, so it can't leave the root
+int path_valid (const char* path) {
+	const char* p = path;
+	if (*p != '/') {
+		return 0;
+	}
+	while (*p) {
+		const char* end = strchrnul (p + 1, '/');
+		size_t len = end - p - 1;
+		if (len == 0 || (len == 1 && p[1] == '.') || (len == 2 && p[1] == '.' && p[2] == '.')) {
+			return 0;
+		}
+		p = end;
+	}
+	return 1;
+}
+
+/* Strip the trailing slashes of root, so that the absolute paths of
+ * batches and journals can be appended to it. / becomes empty. */
+void path_trim_root (char* root) {
+	size_t len = strlen (root);
+	while (len > 1 && root[len - 1] == '/') {
+		root[--len] = '\0';
+	}
+	if (len == 1 && root[0] == '/') {
+		root[0] = '\0';
+	}
+}
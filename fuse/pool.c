@@ -0,0 +1,248 @@
+/*
+ *  pool.c - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Pool of tmp batch files created ahead of time, so that opening a new
+ * batch costs neither a create nor a directory fsync. Pool files are
+ * named .pool_<host>_<pid>_<n> in the tmp dir, which the startup flush
+ * doesn't take as batches, and get their batch name when published. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "sfs.h"
+#include "util.h"
+#include "pool.h"
+#include "batchfmt.h"
+#include "journal.h"
+#include "batch.h"
+
+typedef struct {
+	int fd;
+	char* path;
+} PoolFile;
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	PoolFile files[POOL_MAX_FILES];
+	int count;
+	unsigned long seq;
+} pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+
+static int pool_create (SfsState* state, PoolFile* file) {
+	int flags = O_CREAT | O_EXCL | O_WRONLY;
+	if (state->use_osync && !state->batch_group_commit) {
+		flags |= O_SYNC;
+	}
+
+	if (asprintf (&(file->path), "%s/.pool_%s_%d_%lu", state->batch_tmp_dir, state->hostname, state->pid, pool.seq++) < 0) {
+		syslog(LOG_CRIT, "[pool] path asprintf failed: %s", strerror (errno));
+		return 0;
+	}
+
+	file->fd = open (file->path, flags, 0666 & (~(state->fuse_umask)));
+	if (file->fd < 0) {
+		syslog(LOG_CRIT, "[pool] cannot create tmp batch %s: %s", file->path, strerror (errno));
+		free (file->path);
+		return 0;
+	}
+
+	#ifdef HAVE_FALLOCATE
+	// reserve the blocks without changing the size, empty files are unused
+	if (state->batch_pool_prealloc > 0 &&
+		fallocate (file->fd, FALLOC_FL_KEEP_SIZE, 0, state->batch_pool_prealloc) < 0 && state->log_debug) {
+		syslog(LOG_DEBUG, "[pool] cannot preallocate %s: %s", file->path, strerror (errno));
+	}
+	#endif
+
+	return 1;
+}
+
+static void* pool_filler (void* arg) {
+	SfsState* state = (SfsState*) arg;
+	PoolFile files[POOL_MAX_FILES];
+
+	while (1) {
+		pthread_mutex_lock (&(pool.mutex));
+		while (pool.count >= state->batch_pool_size) {
+			// also wake up from time to time to pick up config changes
+			struct timespec ts;
+			clock_gettime (CLOCK_REALTIME, &ts);
+			ts.tv_sec++;
+			pthread_cond_timedwait (&(pool.cond), &(pool.mutex), &ts);
+		}
+		int missing = state->batch_pool_size - pool.count;
+		pthread_mutex_unlock (&(pool.mutex));
+
+		int created = 0;
+		while (created < missing && pool_create (state, &(files[created]))) {
+			created++;
+		}
+
+		if (created) {
+			// a single fsync makes all the new entries durable
+			sfs_sync_path (state->batch_tmp_dir, 0);
+
+			pthread_mutex_lock (&(pool.mutex));
+			memcpy (&(pool.files[pool.count]), files, created * sizeof (PoolFile));
+			pool.count += created;
+			pthread_mutex_unlock (&(pool.mutex));
+		}
+
+		if (created < missing) {
+			// already logged, don't spin on a full disk
+			sleep (1);
+		}
+	}
+
+	return NULL;
+}
+
+int pool_start (SfsState* state) {
+	pthread_t filler_thread;
+	if (pthread_create (&filler_thread, NULL, pool_filler, state) != 0) {
+		syslog(LOG_CRIT, "[init_thread] cannot start batch pool thread: %s", strerror (errno));
+		return 0;
+	}
+
+	if (pthread_detach (filler_thread) != 0) {
+		syslog(LOG_CRIT, "[init_thread] cannot detach batch pool thread: %s", strerror (errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Take a ready tmp batch, without waiting. The caller owns fd and path. */
+int pool_claim (SfsState* state, int* fd, char** path) {
+	int ret = 0;
+
+	pthread_mutex_lock (&(pool.mutex));
+	if (pool.count > 0) {
+		pool.count--;
+		*fd = pool.files[pool.count].fd;
+		*path = pool.files[pool.count].path;
+		pthread_cond_signal (&(pool.cond));
+		ret = 1;
+	}
+	pthread_mutex_unlock (&(pool.mutex));
+	return ret;
+}
+
+// the format of a pool file is only known from its content
+static int pool_is_binary (const char* path) {
+	char magic[4];
+	int fd = open (path, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	int binary = read (fd, magic, sizeof (magic)) == sizeof (magic) && batchfmt_is_binary (magic, sizeof (magic));
+	close (fd);
+	return binary;
+}
+
+int pool_is_file (SfsState* state, const char* name) {
+	char prefix[sizeof (state->hostname) + 8];
+	snprintf (prefix, sizeof (prefix), ".pool_%s_", state->hostname);
+	return !strncmp (name, prefix, strlen (prefix));
+}
+
+/* Pool file left by a previous run: empty ones were never used and are
+ * removed, the others were being written when SFS stopped. Their type is
+ * not known, so they're published as rec, which is a superset of norec.
+ * Returns the number of published batches, -1 on error. */
+int pool_recover (SfsState* state, const char* name) {
+	char* tmp_path = NULL;
+	char* batch_path = NULL;
+	struct stat statbuf;
+	int ret = -1;
+
+	if (asprintf (&tmp_path, "%s/%s", state->batch_tmp_dir, name) < 0) {
+		syslog(LOG_ERR, "[main] tmp_path asprintf for %s/%s failed: %s", state->batch_tmp_dir, name, strerror (errno));
+		goto cleanup;
+	}
+
+	if (stat (tmp_path, &statbuf) < 0) {
+		syslog(LOG_ERR, "[main] cannot stat %s: %s", tmp_path, strerror (errno));
+		goto cleanup;
+	}
+
+	if (!statbuf.st_size) {
+		if (unlink (tmp_path) < 0) {
+			syslog(LOG_ERR, "[main] cannot remove unused tmp batch %s: %s", tmp_path, strerror (errno));
+			goto cleanup;
+		}
+		if (journal_recover (state, tmp_path, NULL)) {
+			ret = 0;
+		}
+		goto cleanup;
+	}
+
+	// continue the subids of the batches written by this process
+	struct timespec curtime;
+	sfs_get_monotonic_time (state, &curtime);
+	if (curtime.tv_sec == state->batch_time.tv_sec) {
+		state->batch_subid++;
+	} else {
+		state->batch_subid = 0;
+	}
+	state->batch_time = curtime;
+
+	int binary = pool_is_binary (tmp_path);
+	if (binary && batchfmt_seal_file (tmp_path) < 0) {
+		syslog(LOG_WARNING, "[main] cannot seal binary batch %s, moving it anyway: %s", tmp_path, strerror (errno));
+	}
+
+	char* shard_dir = batch_shard_dir (state, batch_file_shard (state, tmp_path));
+	if (!shard_dir || asprintf (&batch_path, "%s/%ld_%s_%s_%d_%05d_rec.%s", shard_dir, curtime.tv_sec, state->node_name, state->hostname, getpid (), state->batch_subid, binary ? "batch2" : "batch") < 0) {
+		batch_path = NULL;
+		free (shard_dir);
+		syslog(LOG_ERR, "[main] batch_path asprintf for %s failed: %s", name, strerror (errno));
+		goto cleanup;
+	}
+	free (shard_dir);
+
+	if (rename (tmp_path, batch_path) < 0) {
+		syslog(LOG_ERR, "[main] rename of %s to %s failed: %s", tmp_path, batch_path, strerror (errno));
+		goto cleanup;
+	}
+	if (journal_recover (state, tmp_path, strrchr (batch_path, '/') + 1)) {
+		ret = 1;
+	}
+
+cleanup:
+	free (tmp_path);
+	free (batch_path);
+	return ret;
+}
@@ -0,0 +1,35 @@
+/*
+ *  pool.h - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SFS_POOL_H
+#define SFS_POOL_H
+
+#include "sfs.h"
+
+// upper bound of batch_pool_size
+#define POOL_MAX_FILES 64
+
+int pool_start (SfsState* state);
+int pool_claim (SfsState* state, int* fd, char** path);
+int pool_is_file (SfsState* state, const char* name);
+int pool_recover (SfsState* state, const char* name);
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ *  publish.c - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Publication of sealed batches. The writer hands over the sealed batch
+ * and opens a new one at once, while a single publisher thread renames
+ * the sealed batches into batch_dir, or the directory of their shard and
+ * type, in the order they were sealed. All the batches queued meanwhile are made
+ * durable with one fsync of each directory, which are kept open. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sfs.h"
+#include "stats.h"
+#include "publish.h"
+#include "batch.h"
+#include "journal.h"
+
+typedef struct PublishEntry {
+	int shard;
+	int large;
+	int fd;
+	char* tmp_path;
+	char* name;
+	PublishJournal journals[JOURNAL_KINDS];
+	struct PublishEntry* next;
+} PublishEntry;
+
+typedef struct {
+	int fd;
+	char* path;
+} PublishDir;
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	PublishEntry* first;
+	PublishEntry* last;
+	int pending;
+} publish = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+
+// batch_dir itself without sharding, large batches go to a subdirectory
+static PublishDir shard_dirs[BATCH_MAX_SHARDS];
+static PublishDir large_dirs[BATCH_MAX_SHARDS];
+static PublishDir tmp_dir = { .fd = -1 };
+static PublishDir journal_dirs[JOURNAL_KINDS] = { { .fd = -1 }, { .fd = -1 } };
+
+// open the directory once, and again only if the config changed
+static int publish_dir (PublishDir* dir, const char* path) {
+	if (dir->fd >= 0 && !strcmp (dir->path, path)) {
+		return 1;
+	}
+
+	int fd = open (path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		syslog(LOG_CRIT, "[publish] cannot open directory %s: %s", path, strerror (errno));
+		return 0;
+	}
+
+	if (dir->fd >= 0) {
+		close (dir->fd);
+		free (dir->path);
+	}
+	dir->fd = fd;
+	dir->path = strdup (path);
+	return 1;
+}
+
+// the directory of shard, created if batch_dir changed
+static PublishDir* publish_shard (SfsState* state, int shard, int large) {
+	PublishDir* dir = large ? &(large_dirs[shard]) : &(shard_dirs[shard]);
+	char* path = batch_stream_dir (state, shard, large ? BATCH_TYPE_LARGE : BATCH_TYPE_NOREC);
+	if (!path) {
+		syslog(LOG_CRIT, "[publish] cannot allocate the directory of shard %d", shard);
+		return NULL;
+	}
+	// the shard directory must be there first
+	if (large && state->batch_shards > 1 && !publish_shard (state, shard, 0)) {
+		free (path);
+		return NULL;
+	}
+
+	if ((state->batch_shards > 1 || large) && (dir->fd < 0 || strcmp (dir->path, path)) &&
+		mkdir (path, 0777 & (~(state->fuse_umask))) < 0 && errno != EEXIST) {
+		syslog(LOG_CRIT, "[publish] cannot create directory %s: %s", path, strerror (errno));
+	}
+	int ready = publish_dir (dir, path);
+	free (path);
+	return ready ? dir : NULL;
+}
+
+static void publish_sync (PublishDir* dir) {
+	if (fsync (dir->fd) < 0) {
+		syslog(LOG_CRIT, "[sync_path] cannot fsync() path %s, this may lead to batch loss: %s", dir->path, strerror (errno));
+	}
+}
+
+static void* publish_thread (void* arg) {
+	SfsState* state = (SfsState*) arg;
+
+	while (1) {
+		pthread_mutex_lock (&(publish.mutex));
+		while (!publish.first) {
+			pthread_cond_wait (&(publish.cond), &(publish.mutex));
+		}
+		PublishEntry* entry = publish.first;
+		publish.first = publish.last = NULL;
+		publish.pending = 0;
+		// wake up the writer if it was waiting for room
+		pthread_cond_broadcast (&(publish.cond));
+		pthread_mutex_unlock (&(publish.mutex));
+
+		int ready = publish_dir (&tmp_dir, state->batch_tmp_dir);
+		int shard_published[BATCH_MAX_SHARDS] = { 0 };
+		int large_published[BATCH_MAX_SHARDS] = { 0 };
+		int published = 0;
+		int journals[JOURNAL_KINDS] = { 0 };
+		int i;
+
+		while (entry) {
+			PublishEntry* next = entry->next;
+
+			// the journals go first, so that they're there when the batch is read
+			for (i=0; i < JOURNAL_KINDS; i++) {
+				PublishJournal* journal = &(entry->journals[i]);
+				if (journal->fd < 0) {
+					continue;
+				}
+				close (journal->fd);
+				if (rename (journal->tmp_path, journal->path) < 0) {
+					syslog(LOG_CRIT, "[journal] rename of %s to %s failed, the files will be copied: %s", journal->tmp_path, journal->path, strerror (errno));
+				} else {
+					journals[journal->kind]++;
+				}
+				free (journal->tmp_path);
+				free (journal->path);
+			}
+
+			if (close (entry->fd) < 0) {
+				syslog(LOG_WARNING, "[batch_flush] error while closing fd %d of tmp batch %s: %s", entry->fd, entry->tmp_path, strerror (errno));
+			}
+
+			// failed batches stay in the tmp dir and are published at the next startup
+			PublishDir* dir = ready ? publish_shard (state, entry->shard, entry->large) : NULL;
+			if (!dir) {
+				syslog(LOG_CRIT, "[batch_flush] cannot publish %s as %s", entry->tmp_path, entry->name);
+			} else if (renameat (AT_FDCWD, entry->tmp_path, dir->fd, entry->name) < 0) {
+				syslog(LOG_CRIT, "[batch_flush] rename of %s to %s/%s failed: %s", entry->tmp_path, dir->path, entry->name, strerror (errno));
+			} else if (entry->large) {
+				large_published[entry->shard]++;
+				published++;
+			} else {
+				shard_published[entry->shard]++;
+				published++;
+			}
+
+			free (entry->tmp_path);
+			free (entry->name);
+			free (entry);
+			entry = next;
+		}
+
+		for (i=0; i < JOURNAL_KINDS; i++) {
+			const char* journal_path = journal_dir (state, i);
+			if (journals[i] && journal_path && publish_dir (&(journal_dirs[i]), journal_path)) {
+				publish_sync (&(journal_dirs[i]));
+			}
+		}
+		if (published) {
+			for (i=0; i < state->batch_shards; i++) {
+				if (shard_published[i]) {
+					publish_sync (&(shard_dirs[i]));
+				}
+				if (large_published[i]) {
+					publish_sync (&(large_dirs[i]));
+				}
+			}
+			publish_sync (&tmp_dir);
+			stats_add (STAT_BATCH_PUBLISHED, published);
+			stats_inc (STAT_BATCH_PUBLISH_SYNCS);
+		}
+	}
+
+	return NULL;
+}
+
+int publish_start (SfsState* state) {
+	int i;
+	for (i=0; i < BATCH_MAX_SHARDS; i++) {
+		shard_dirs[i].fd = -1;
+		large_dirs[i].fd = -1;
+	}
+
+	pthread_t publisher_thread;
+	if (pthread_create (&publisher_thread, NULL, publish_thread, state) != 0) {
+		syslog(LOG_CRIT, "[init_thread] cannot start batch publisher thread: %s", strerror (errno));
+		return 0;
+	}
+
+	if (pthread_detach (publisher_thread) != 0) {
+		syslog(LOG_CRIT, "[init_thread] cannot detach batch publisher thread: %s", strerror (errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Queue a sealed batch of shard and type for publication, taking
+ * ownership of fd, tmp_path, name and the journals, one per
+ * JournalKind. */
+void publish_batch (SfsState* state, int shard, BatchType type, int fd, char* tmp_path, char* name, PublishJournal* journals) {
+	PublishEntry* entry = malloc (sizeof (PublishEntry));
+	int i;
+
+	if (!entry) {
+		syslog(LOG_CRIT, "[batch_flush] cannot allocate publication of %s, it will be published at the next startup", tmp_path);
+		close (fd);
+		free (tmp_path);
+		free (name);
+		for (i=0; i < JOURNAL_KINDS; i++) {
+			if (journals[i].fd >= 0) {
+				close (journals[i].fd);
+				free (journals[i].tmp_path);
+				free (journals[i].path);
+			}
+		}
+		return;
+	}
+	entry->shard = shard;
+	entry->large = type == BATCH_TYPE_LARGE;
+	entry->fd = fd;
+	entry->tmp_path = tmp_path;
+	entry->name = name;
+	memcpy (entry->journals, journals, sizeof (entry->journals));
+	entry->next = NULL;
+
+	pthread_mutex_lock (&(publish.mutex));
+	while (publish.pending >= PUBLISH_MAX_PENDING) {
+		// the directory fsyncs can't keep up
+		pthread_cond_wait (&(publish.cond), &(publish.mutex));
+	}
+	if (publish.last) {
+		publish.last->next = entry;
+	} else {
+		publish.first = entry;
+	}
+	publish.last = entry;
+	publish.pending++;
+	pthread_cond_broadcast (&(publish.cond));
+	pthread_mutex_unlock (&(publish.mutex));
+}
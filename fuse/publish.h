@@ -0,0 +1,42 @@
+/*
+ *  publish.h - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SFS_PUBLISH_H
+#define SFS_PUBLISH_H
+
+#include "sfs.h"
+
+// sealed batches waiting to be published before the writer blocks
+#define PUBLISH_MAX_PENDING 1024
+
+// journal of a batch, fd is -1 if there's none
+typedef struct {
+	// JournalKind
+	int kind;
+	int fd;
+	char* tmp_path;
+	char* path;
+} PublishJournal;
+
+int publish_start (SfsState* state);
+void publish_batch (SfsState* state, int shard, BatchType type, int fd, char* tmp_path, char* name, PublishJournal* journals);
+
+#endif
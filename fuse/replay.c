@@ -0,0 +1,182 @@
+/*
+ *  replay.c - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* sfs-replay-renames: apply rename journals on a destination before
+ * their batches are synchronized. A rename is replayed only if the
+ * destination still looks like the source did before the rename: the
+ * old path exists with the same kind and, except for directories whose
+ * times are not synchronized, the same mtime, while the new path does
+ * not exist. Otherwise it's skipped and rsync copies the files as
+ * usual. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "path.h"
+
+static int dryrun = 0;
+static int verbose = 0;
+
+static void usage (void) {
+	fprintf (stderr, "Usage: sfs-replay-renames [-n] [-v] ROOT JOURNAL...\n\n");
+	fprintf (stderr, "  -n  only check the renames, don't apply them\n");
+	fprintf (stderr, "  -v  report each rename\n");
+}
+
+/* Returns 1 if replayed, 0 if skipped. */
+static int replay (const char* root, char* line, const char* journal, int lineno) {
+	char* fields[5];
+	int n = 0;
+	char* p = line;
+
+	while (n < 5 && p) {
+		fields[n++] = p;
+		p = strchr (p, '\t');
+		if (p) {
+			*p++ = '\0';
+		}
+	}
+	// paths with tabs are ambiguous
+	if (n != 5 || p) {
+		fprintf (stderr, "sfs-replay-renames: %s:%d: malformed record, skipped\n", journal, lineno);
+		return 0;
+	}
+
+	const char* kind = fields[2];
+	const char* oldpath = fields[3];
+	const char* newpath = fields[4];
+	char* end;
+	long sec = strtol (fields[1], &end, 10);
+	if (*end != '.' || strlen (kind) != 1 || !path_valid (oldpath) || !path_valid (newpath)) {
+		fprintf (stderr, "sfs-replay-renames: %s:%d: malformed record, skipped\n", journal, lineno);
+		return 0;
+	}
+
+	char* src = NULL;
+	char* dst = NULL;
+	const char* reason = NULL;
+	struct stat st;
+	if (asprintf (&src, "%s%s", root, oldpath) < 0 || asprintf (&dst, "%s%s", root, newpath) < 0) {
+		src = dst = NULL;
+		reason = "out of memory";
+	} else if (lstat (src, &st) < 0) {
+		reason = "old path missing";
+	} else if (path_kind (st.st_mode) != kind[0]) {
+		reason = "old path changed kind";
+	} else if (kind[0] != 'd' && st.st_mtim.tv_sec != sec) {
+		reason = "old path modified";
+	} else if (lstat (dst, &st) == 0 || errno != ENOENT) {
+		reason = "new path exists";
+	} else if (!dryrun && rename (src, dst) < 0) {
+		reason = strerror (errno);
+	}
+
+	if (reason) {
+		if (verbose) {
+			printf ("skip %s -> %s: %s\n", oldpath, newpath, reason);
+		}
+	} else if (verbose) {
+		printf ("%s %s -> %s\n", dryrun ? "would rename" : "renamed", oldpath, newpath);
+	}
+	free (src);
+	free (dst);
+	return !reason;
+}
+
+static int replay_journal (const char* root, const char* journal, int* replayed, int* skipped) {
+	FILE* file = fopen (journal, "r");
+	if (!file) {
+		fprintf (stderr, "sfs-replay-renames: cannot open %s: %s\n", journal, strerror (errno));
+		return 0;
+	}
+
+	char* line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int lineno = 0;
+	while ((len = getline (&line, &size, file)) > 0) {
+		lineno++;
+		if (line[len - 1] != '\n') {
+			// torn by a crash
+			(*skipped)++;
+			break;
+		}
+		line[len - 1] = '\0';
+		if (replay (root, line, journal, lineno)) {
+			(*replayed)++;
+		} else {
+			(*skipped)++;
+		}
+	}
+
+	int ok = !ferror (file);
+	if (!ok) {
+		fprintf (stderr, "sfs-replay-renames: cannot read %s: %s\n", journal, strerror (errno));
+	}
+	free (line);
+	fclose (file);
+	return ok;
+}
+
+int main (int argc, char** argv) {
+	int replayed = 0;
+	int skipped = 0;
+	int ret = 0;
+	int opt;
+
+	while ((opt = getopt (argc, argv, "nvh")) != -1) {
+		switch (opt) {
+		case 'n':
+			dryrun = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage ();
+			return 2;
+		}
+	}
+	if (argc - optind < 2) {
+		usage ();
+		return 2;
+	}
+
+	// journal paths are absolute within the root
+	char* root = argv[optind++];
+	path_trim_root (root);
+
+	for (; optind < argc; optind++) {
+		if (!replay_journal (root, argv[optind], &replayed, &skipped)) {
+			ret = 1;
+		}
+	}
+
+	if (verbose) {
+		printf ("%d renames replayed, %d skipped\n", replayed, skipped);
+	}
+	return ret;
+}
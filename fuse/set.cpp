@@ -19,39 +19,224 @@
  *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <string>
-#include <unordered_set>
+/* Set of the paths written to the current batch. Paths are copied into
+ * a bump arena and indexed by a flat open-addressing table storing part
+ * of their hash, both reused across batches: clearing the set bumps a
+ * generation number instead of freeing or zeroing anything. Table and
+ * arena grow up to max_bytes, then new paths are not deduplicated
+ * anymore until the next clear. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <pthread.h>
 
 #include "set.h"
 
+#define SET_MIN_SLOTS 1024
+#define SET_MIN_ARENA (64 * 1024)
+
+struct SetSlot {
+	uint32_t gen;
+	uint32_t hash;
+	uint32_t offset;
+	uint32_t len;
+};
+
 struct _SfsSet {
 	pthread_mutex_t mutex;
-	std::unordered_set<std::string> set;
+	size_t max_bytes;
+	uint32_t gen;
+
+	SetSlot* slots;
+	uint32_t mask;
+	uint32_t count;
+
+	char* arena;
+	size_t arena_size;
+	size_t arena_used;
 };
 
-SfsSet* sfs_set_new (void) {
-	SfsSet* set = new SfsSet();
+/* Hash 8 bytes at a time, loads and multiplies that compilers keep in
+ * registers and vectorize well. */
+static uint64_t set_hash (const char* elem, size_t len) {
+	const uint64_t mul = 0xff51afd7ed558ccdULL;
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+	uint64_t word;
+
+	while (len >= 8) {
+		memcpy (&word, elem, 8);
+		h = (h ^ word) * mul;
+		h ^= h >> 32;
+		elem += 8;
+		len -= 8;
+	}
+	word = 0;
+	memcpy (&word, elem, len);
+	h = (h ^ word) * mul;
+
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static size_t set_table_bytes (uint32_t slots) {
+	return (size_t) slots * sizeof (SetSlot);
+}
+
+// double the table, rehashing the current generation
+static int set_grow_table (SfsSet* set) {
+	uint32_t slots = (set->mask + 1) * 2;
+	if (set_table_bytes (slots) + set->arena_size > set->max_bytes) {
+		return 0;
+	}
+
+	SetSlot* table = (SetSlot*) calloc (slots, sizeof (SetSlot));
+	if (!table) {
+		return 0;
+	}
+
+	for (uint32_t i=0; i <= set->mask; i++) {
+		SetSlot* slot = &(set->slots[i]);
+		if (slot->gen != set->gen) {
+			continue;
+		}
+		uint32_t pos = slot->hash & (slots - 1);
+		while (table[pos].gen == set->gen) {
+			pos = (pos + 1) & (slots - 1);
+		}
+		table[pos] = *slot;
+	}
+
+	free (set->slots);
+	set->slots = table;
+	set->mask = slots - 1;
+	return 1;
+}
+
+static int set_grow_arena (SfsSet* set, size_t len) {
+	size_t size = set->arena_size;
+	while (size - set->arena_used < len) {
+		size *= 2;
+	}
+	if (size > UINT32_MAX || set_table_bytes (set->mask + 1) + size > set->max_bytes) {
+		return 0;
+	}
+
+	char* arena = (char*) realloc (set->arena, size);
+	if (!arena) {
+		return 0;
+	}
+	set->arena = arena;
+	set->arena_size = size;
+	return 1;
+}
+
+SfsSet* sfs_set_new (size_t max_bytes) {
+	if (max_bytes < set_table_bytes (SET_MIN_SLOTS) + SET_MIN_ARENA) {
+		max_bytes = set_table_bytes (SET_MIN_SLOTS) + SET_MIN_ARENA;
+	}
+
+	SfsSet* set = (SfsSet*) calloc (1, sizeof (SfsSet));
+	if (!set) {
+		return NULL;
+	}
+	set->slots = (SetSlot*) calloc (SET_MIN_SLOTS, sizeof (SetSlot));
+	set->arena = (char*) malloc (SET_MIN_ARENA);
+	if (!set->slots || !set->arena) {
+		free (set->slots);
+		free (set->arena);
+		free (set);
+		return NULL;
+	}
+
 	pthread_mutex_init (&(set->mutex), NULL);
+	set->max_bytes = max_bytes;
+	set->gen = 1;
+	set->mask = SET_MIN_SLOTS - 1;
+	set->arena_size = SET_MIN_ARENA;
 	return set;
 }
-	
+
+// slot of elem, or the free slot where it would go
+static uint32_t set_find (SfsSet* set, const char* elem, size_t len, uint32_t hash) {
+	uint32_t pos = hash & set->mask;
+	while (set->slots[pos].gen == set->gen) {
+		SetSlot* slot = &(set->slots[pos]);
+		if (slot->hash == hash && slot->len == len && !memcmp (set->arena + slot->offset, elem, len)) {
+			break;
+		}
+		pos = (pos + 1) & set->mask;
+	}
+	return pos;
+}
+
 // returns 1 if the element already exists in the set
 int sfs_set_add (SfsSet* set, const char* elem) {
+	return sfs_set_add_len (set, elem, strlen (elem));
+}
+
+int sfs_set_add_len (SfsSet* set, const char* elem, size_t len) {
+	uint32_t hash = (uint32_t) set_hash (elem, len);
+	int ret = 0;
+
 	pthread_mutex_lock (&(set->mutex));
-	std::unordered_set<std::string>::iterator it = set->set.find (elem);
-	if (it != set->set.end()) {
-		pthread_mutex_unlock (&(set->mutex));
-		return 1;
+	uint32_t pos = set_find (set, elem, len, hash);
+	if (set->slots[pos].gen == set->gen) {
+		ret = 1;
+		goto cleanup;
 	}
-	
-	set->set.insert (elem);
+
+	// keep the load under 1/2, past the budget the path is just not deduplicated
+	if ((set->count + 1) * 2 > set->mask + 1) {
+		if (!set_grow_table (set)) {
+			goto cleanup;
+		}
+		pos = hash & set->mask;
+		while (set->slots[pos].gen == set->gen) {
+			pos = (pos + 1) & set->mask;
+		}
+	}
+	if (set->arena_size - set->arena_used < len && !set_grow_arena (set, len)) {
+		goto cleanup;
+	}
+
+	memcpy (set->arena + set->arena_used, elem, len);
+	set->slots[pos].gen = set->gen;
+	set->slots[pos].hash = hash;
+	set->slots[pos].offset = set->arena_used;
+	set->slots[pos].len = len;
+	set->arena_used += len;
+	set->count++;
+
+cleanup:
 	pthread_mutex_unlock (&(set->mutex));
-	return 0;
+	return ret;
+}
+
+int sfs_set_contains (SfsSet* set, const char* elem) {
+	return sfs_set_contains_len (set, elem, strlen (elem));
+}
+
+int sfs_set_contains_len (SfsSet* set, const char* elem, size_t len) {
+	uint32_t hash = (uint32_t) set_hash (elem, len);
+
+	pthread_mutex_lock (&(set->mutex));
+	uint32_t pos = set_find (set, elem, len, hash);
+	int ret = set->slots[pos].gen == set->gen;
+	pthread_mutex_unlock (&(set->mutex));
+	return ret;
 }
 
 void sfs_set_clear (SfsSet* set) {
 	pthread_mutex_lock (&(set->mutex));
-	set->set.clear ();
+	if (++set->gen == 0) {
+		// generations wrapped, slots of old batches could match again
+		memset (set->slots, 0, set_table_bytes (set->mask + 1));
+		set->gen = 1;
+	}
+	set->count = 0;
+	set->arena_used = 0;
 	pthread_mutex_unlock (&(set->mutex));
 }
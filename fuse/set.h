@@ -22,15 +22,20 @@
 #ifndef SFS_SET_H
 #define SFS_SET_H
 
+#include <stddef.h>
+
 typedef struct _SfsSet SfsSet;
 
 #ifdef __cplusplus 
 extern "C" {
 #endif
 
-SfsSet* sfs_set_new (void);
+SfsSet* sfs_set_new (size_t max_bytes);
 // returns 1 if the element already exists in the set
 int sfs_set_add (SfsSet* set, const char* elem);
+int sfs_set_add_len (SfsSet* set, const char* elem, size_t len);
+int sfs_set_contains (SfsSet* set, const char* elem);
+int sfs_set_contains_len (SfsSet* set, const char* elem, size_t len);
 void sfs_set_clear (SfsSet* set);
 
 #ifdef __cplusplus
@@ -19,7 +19,9 @@
  *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef SFS_FUSE3
 #define FUSE_USE_VERSION 26
+#endif
 
 #define _XOPEN_SOURCE 700
 #define _GNU_SOURCE
@@ -48,6 +50,61 @@
 #include "util.h"
 #include "set.h"
 #include "setproctitle.h"
+#include "lowlevel.h"
+#include "stats.h"
+#include "pool.h"
+#include "batchfmt.h"
+#include "journal.h"
+#include "extents.h"
+
+SfsState* sfs_state = NULL;
+
+// open directory, entry is the one that didn't fit the last readdir
+typedef struct {
+	DIR* dp;
+	struct dirent* entry;
+	off_t offset;
+} SfsDirHandle;
+
+// open file, written is the size of the event for batch_large_bytes
+typedef struct {
+	int fd;
+	volatile uint64_t written;
+	// NULL unless writable with extent_journal_dir or content_hash
+	SfsExtents* extents;
+} SfsFileHandle;
+
+static int sfs_fd (struct fuse_file_info* fi) {
+	return ((SfsFileHandle*) (uintptr_t) fi->fh)->fd;
+}
+
+static SfsExtents* sfs_extents (struct fuse_file_info* fi) {
+	return ((SfsFileHandle*) (uintptr_t) fi->fh)->extents;
+}
+
+/* bytes of data were written at offset, data is NULL if they never were
+ * in memory. */
+static void sfs_written (struct fuse_file_info* fi, const void* data, off_t offset, uint64_t bytes) {
+	SfsFileHandle* h = (SfsFileHandle*) (uintptr_t) fi->fh;
+	__sync_add_and_fetch (&(h->written), bytes);
+	extents_write (h->extents, h->fd, data, offset, bytes);
+}
+
+/* Wrap the fd of an opened file into a handle, closing it if out of
+ * memory. */
+static int sfs_new_handle (int fd, struct fuse_file_info* fi) {
+	SfsFileHandle* h = calloc (1, sizeof (SfsFileHandle));
+	if (!h) {
+		close (fd);
+		return -ENOMEM;
+	}
+	h->fd = fd;
+	if ((fi->flags & O_WRONLY) || (fi->flags & O_RDWR)) {
+		h->extents = extents_open (SFS_STATE, fd);
+	}
+	fi->fh = (uintptr_t) h;
+	return 0;
+}
 
 #define BEGIN_PERM if (!sfs_begin_access ()) { \
 	return -EPERM; \
@@ -55,6 +112,18 @@
 
 #define END_PERM sfs_end_access ();
 
+#define BEGIN_AT_PERM(dirfd) if (!sfs_begin_access ()) { \
+	sfs_at_release (dirfd); \
+	return -EPERM; \
+}
+
+// also turns a failed retstat into -errno before it gets clobbered
+#define END_AT_PERM(dirfd) if (retstat < 0) { \
+	retstat = -errno; \
+} \
+sfs_end_access (); \
+sfs_at_release (dirfd);
+
 ///////////////////////////////////////////////////////////
 //
 // Prototypes for all these functions, and the C-style comments,
@@ -68,15 +137,15 @@
 */
 int sfs_getattr(const char *path, struct stat *statbuf) {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
-
-	BEGIN_PERM;
-    retstat = lstat(fpath, statbuf);
-	END_PERM;
-    if (retstat < 0) {
-		retstat = -errno;
+	const char* name;
+	int dirfd = sfs_at(path, &name);
+	if (dirfd < 0) {
+		return -errno;
 	}
+
+	BEGIN_AT_PERM(dirfd);
+    retstat = fstatat(dirfd, name, statbuf, AT_SYMLINK_NOFOLLOW);
+	END_AT_PERM(dirfd);
     
     return retstat;
 }
@@ -95,15 +164,16 @@ int sfs_getattr(const char *path, struct stat *statbuf) {
 // sfs_readlink() code by Bernardo F Costa (thanks!)
 int sfs_readlink(const char *path, char *link, size_t size) {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
+	const char* name;
+	int dirfd = sfs_at(path, &name);
+	if (dirfd < 0) {
+		return -errno;
+	}
 
-	BEGIN_PERM;
-    retstat = readlink(fpath, link, size - 1);
-	END_PERM;
-    if (retstat < 0) {
-		retstat = -errno;
-	} else  {
+	BEGIN_AT_PERM(dirfd);
+    retstat = readlinkat(dirfd, name, link, size - 1);
+	END_AT_PERM(dirfd);
+	if (retstat >= 0) {
 		link[retstat] = '\0';
 		retstat = 0;
     }
@@ -119,15 +189,16 @@ int sfs_readlink(const char *path, char *link, size_t size) {
 // shouldn't that comment be "if" there is no.... ?
 int sfs_mknod(const char *path, mode_t mode, dev_t dev) {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
+	const char* name;
+	int dirfd = sfs_at(path, &name);
+	if (dirfd < 0) {
+		return -errno;
+	}
 
-	BEGIN_PERM;
-	retstat = mknod(fpath, mode, dev);
-	END_PERM;
-	if (retstat < 0) {
-		retstat = -errno;
-	} else {
+	BEGIN_AT_PERM(dirfd);
+	retstat = mknodat(dirfd, name, mode, dev);
+	END_AT_PERM(dirfd);
+	if (retstat >= 0) {
 		batch_file_event (path, "norec");
 	}
     
@@ -137,15 +208,16 @@ int sfs_mknod(const char *path, mode_t mode, dev_t dev) {
 /** Create a directory */
 int sfs_mkdir(const char *path, mode_t mode) {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
+	const char* name;
+	int dirfd = sfs_at(path, &name);
+	if (dirfd < 0) {
+		return -errno;
+	}
 
-	BEGIN_PERM;
-	retstat = mkdir(fpath, mode);
-	END_PERM;
-    if (retstat < 0) {
-		retstat = -errno;
-	} else {
+	BEGIN_AT_PERM(dirfd);
+	retstat = mkdirat(dirfd, name, mode);
+	END_AT_PERM(dirfd);
+	if (retstat >= 0) {
 		batch_file_event (path, "norec");
 	}
     
@@ -155,15 +227,16 @@ int sfs_mkdir(const char *path, mode_t mode) {
 /** Remove a file */
 int sfs_unlink(const char *path) {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
+	const char* name;
+	int dirfd = sfs_at(path, &name);
+	if (dirfd < 0) {
+		return -errno;
+	}
 
-	BEGIN_PERM;
-    retstat = unlink(fpath);
-	END_PERM;
-    if (retstat < 0) {
-		retstat = -errno;
-	} else {
+	BEGIN_AT_PERM(dirfd);
+    retstat = unlinkat(dirfd, name, 0);
+	END_AT_PERM(dirfd);
+	if (retstat >= 0) {
 		batch_file_event (path, "norec");
 	}
     
@@ -173,15 +246,16 @@ int sfs_unlink(const char *path) {
 /** Remove a directory */
 int sfs_rmdir(const char *path) {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
+	const char* name;
+	int dirfd = sfs_at(path, &name);
+	if (dirfd < 0) {
+		return -errno;
+	}
 
-	BEGIN_PERM;
-    retstat = rmdir(fpath);
-	END_PERM;
-    if (retstat < 0) {
-		retstat = -errno;
-	} else {
+	BEGIN_AT_PERM(dirfd);
+    retstat = unlinkat(dirfd, name, AT_REMOVEDIR);
+	END_AT_PERM(dirfd);
+	if (retstat >= 0) {
 		batch_file_event (path, "norec");
 	}
     
@@ -195,15 +269,16 @@ int sfs_rmdir(const char *path) {
 // unaltered, but insert the link into the mounted directory.
 int sfs_symlink(const char *path, const char *link) {
     int retstat = 0;
-    char flink[PATH_MAX];
-    sfs_fullpath(flink, link);
+	const char* name;
+	int dirfd = sfs_at(link, &name);
+	if (dirfd < 0) {
+		return -errno;
+	}
 
-	BEGIN_PERM;
-    retstat = symlink(path, flink);
-	END_PERM;
-    if (retstat < 0) {
-		retstat = -errno;
-	} else {
+	BEGIN_AT_PERM(dirfd);
+    retstat = symlinkat(path, dirfd, name);
+	END_AT_PERM(dirfd);
+	if (retstat >= 0) {
 		batch_file_event (link, "norec");
 	}
     
@@ -214,24 +289,39 @@ int sfs_symlink(const char *path, const char *link) {
 // both path and newpath are fs-relative
 int sfs_rename(const char *path, const char *newpath) {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    char fnewpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
-    sfs_fullpath(fnewpath, newpath);
+	const char *name, *newname;
+	int dirfd = sfs_at(path, &name);
+	if (dirfd < 0) {
+		return -errno;
+	}
+	int newdirfd = sfs_at(newpath, &newname);
+	if (newdirfd < 0) {
+		retstat = -errno;
+		sfs_at_release(dirfd);
+		return retstat;
+	}
 
 	const char* mode = "norec";
 	
 	struct stat statbuf;
-	if (lstat(fpath, &statbuf) >= 0 && S_ISDIR (statbuf.st_mode)) {
+	memset (&statbuf, 0, sizeof (statbuf));
+	if (fstatat(dirfd, name, &statbuf, AT_SYMLINK_NOFOLLOW) >= 0 && S_ISDIR (statbuf.st_mode)) {
 		mode = "rec";
 	}
 	
-	BEGIN_PERM;
-	retstat = rename(fpath, fnewpath);
-	END_PERM;
-    if (retstat < 0) {
-		retstat = -errno;
+	if (!sfs_begin_access ()) {
+		retstat = -EPERM;
 	} else {
+		retstat = renameat(dirfd, name, newdirfd, newname);
+		if (retstat < 0) {
+			retstat = -errno;
+		}
+		END_PERM;
+	}
+	sfs_at_release(dirfd);
+	sfs_at_release(newdirfd);
+	if (retstat >= 0) {
+		batch_rename_event (path, newpath, &statbuf);
 		batch_file_event (path, mode);
 		batch_file_event (newpath, mode);
 	}
@@ -242,16 +332,30 @@ int sfs_rename(const char *path, const char *newpath) {
 /** Create a hard link to a file */
 int sfs_link(const char *path, const char *newpath) {
     int retstat = 0;
-    char fpath[PATH_MAX], fnewpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
-    sfs_fullpath(fnewpath, newpath);
-
-	BEGIN_PERM;
-    retstat = link(fpath, fnewpath);
-	END_PERM;
-    if (retstat < 0) {
+	const char *name, *newname;
+	int dirfd = sfs_at(path, &name);
+	if (dirfd < 0) {
+		return -errno;
+	}
+	int newdirfd = sfs_at(newpath, &newname);
+	if (newdirfd < 0) {
 		retstat = -errno;
+		sfs_at_release(dirfd);
+		return retstat;
+	}
+
+	if (!sfs_begin_access ()) {
+		retstat = -EPERM;
 	} else {
+		retstat = linkat(dirfd, name, newdirfd, newname, 0);
+		if (retstat < 0) {
+			retstat = -errno;
+		}
+		END_PERM;
+	}
+	sfs_at_release(dirfd);
+	sfs_at_release(newdirfd);
+	if (retstat >= 0) {
 		batch_file_event (newpath, "norec");
 	}
     
@@ -261,16 +365,19 @@ int sfs_link(const char *path, const char *newpath) {
 /** Change the permission bits of a file */
 int sfs_chmod(const char *path, mode_t mode) {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
+	const char* name;
+	int dirfd = sfs_at(path, &name);
+	if (dirfd < 0) {
+		return -errno;
+	}
 
-	BEGIN_PERM;
-    retstat = chmod(fpath, mode);
-	END_PERM;
-    if (retstat < 0) {
-		retstat = -errno;
-	} else {
-		sfs_update_mtime ("chmod", fpath);
+	BEGIN_AT_PERM(dirfd);
+    retstat = fchmodat(dirfd, name, mode, sfs_follow_flags ());
+	if (retstat >= 0) {
+		sfs_update_mtime ("chmod", dirfd, name);
+	}
+	END_AT_PERM(dirfd);
+	if (retstat >= 0) {
 		batch_file_event (path, "norec");
 	}
     
@@ -280,16 +387,19 @@ int sfs_chmod(const char *path, mode_t mode) {
 /** Change the owner and group of a file */
 int sfs_chown(const char *path, uid_t uid, gid_t gid) {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
+	const char* name;
+	int dirfd = sfs_at(path, &name);
+	if (dirfd < 0) {
+		return -errno;
+	}
 
-	BEGIN_PERM;
-    retstat = chown(fpath, uid, gid);
-	END_PERM;
-    if (retstat < 0) {
-		retstat = -errno;
-	} else {
-		sfs_update_mtime ("chown", fpath);
+	BEGIN_AT_PERM(dirfd);
+    retstat = fchownat(dirfd, name, uid, gid, sfs_follow_flags ());
+	if (retstat >= 0) {
+		sfs_update_mtime ("chown", dirfd, name);
+	}
+	END_AT_PERM(dirfd);
+	if (retstat >= 0) {
 		batch_file_event (path, "norec");
 	}
     
@@ -299,72 +409,93 @@ int sfs_chown(const char *path, uid_t uid, gid_t gid) {
 /** Change the size of a file */
 int sfs_truncate(const char *path, off_t newsize) {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
 
 	BEGIN_PERM;
-    retstat = truncate(fpath, newsize);
-	END_PERM;
-    if (retstat < 0) {
+	// there is no truncateat()
+	int fd = sfs_openat(path, O_WRONLY | O_NONBLOCK | (sfs_follow_flags () ? O_NOFOLLOW : 0), 0);
+	if (fd < 0) {
 		retstat = -errno;
 	} else {
+		retstat = ftruncate(fd, newsize);
+		if (retstat < 0) {
+			retstat = -errno;
+		} else {
+			// not through a handle, the ranges of open handles are void
+			extents_touch (fd, "", AT_EMPTY_PATH);
+		}
+		close(fd);
+	}
+	END_PERM;
+	if (retstat >= 0) {
 		batch_file_event (path, "norec");
 	}
     
     return retstat;
 }
 
+#ifndef SFS_FUSE3
 /** Change the access and/or modification times of a file */
 /* note -- I'll want to change this as soon as 2.6 is in debian testing */
 int sfs_utime(const char *path, struct utimbuf *ubuf) {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
+	const char* name;
+	int dirfd = sfs_at(path, &name);
+	if (dirfd < 0) {
+		return -errno;
+	}
 
-	BEGIN_PERM;
+	BEGIN_AT_PERM(dirfd);
 	if (SFS_STATE->forbid_older_mtime) {
 		struct stat statbuf;
-		if (stat(fpath, &statbuf) < 0) {
-			syslog(LOG_CRIT, "[utime] cannot stat to forbid older mtime %s: %s", fpath, strerror(errno));
+		if (fstatat(dirfd, name, &statbuf, sfs_follow_flags ()) < 0) {
+			syslog(LOG_CRIT, "[utime] cannot stat to forbid older mtime %s: %s", path, strerror(errno));
 		} else if (ubuf->modtime < statbuf.st_mtime) {
 			END_PERM;
+			sfs_at_release(dirfd);
 			return -EPERM;
 		}
 	}
-    retstat = utime(fpath, ubuf);
-	END_PERM;
-    if (retstat < 0) {
-		retstat = -errno;
-	} else {
+	struct timespec ts[2];
+	ts[0].tv_sec = ubuf->actime;
+	ts[0].tv_nsec = 0;
+	ts[1].tv_sec = ubuf->modtime;
+	ts[1].tv_nsec = 0;
+    retstat = utimensat(dirfd, name, ts, sfs_follow_flags ());
+	END_AT_PERM(dirfd);
+	if (retstat >= 0) {
 		batch_file_event (path, "norec");
 	}
     
     return retstat;
 }
 
+#endif
+
 #ifdef HAVE_UTIMENSAT
 // Copied fom http://fuse.sourceforge.net/doxygen/fusexmp__fh_8c.html
 static int sfs_utimens(const char *path, const struct timespec ts[2]) {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
+	const char* name;
+	int dirfd = sfs_at(path, &name);
+	if (dirfd < 0) {
+		return -errno;
+	}
 
-	BEGIN_PERM;
+	BEGIN_AT_PERM(dirfd);
 	if (SFS_STATE->forbid_older_mtime) {
 		struct stat statbuf;
-		if (stat(fpath, &statbuf) < 0) {
-			syslog(LOG_CRIT, "[utimens] cannot stat to forbid older mtime %s: %s", fpath, strerror(errno));
+		if (fstatat(dirfd, name, &statbuf, 0) < 0) {
+			syslog(LOG_CRIT, "[utimens] cannot stat to forbid older mtime %s: %s", path, strerror(errno));
 		} else if (ts[1].tv_sec < statbuf.st_mtim.tv_sec || (ts[1].tv_sec == statbuf.st_mtim.tv_sec && ts[1].tv_nsec < statbuf.st_mtim.tv_nsec)) {
 			END_PERM;
+			sfs_at_release(dirfd);
 			return -EPERM;
 		}
 	}
 	/* don't use utime/utimes since they follow symlinks */
-	retstat = utimensat(0, fpath, ts, AT_SYMLINK_NOFOLLOW);
-	END_PERM;
-	if (retstat < 0) {
-		retstat = -errno;
-	} else {
+	retstat = utimensat(dirfd, name, ts, AT_SYMLINK_NOFOLLOW);
+	END_AT_PERM(dirfd);
+	if (retstat >= 0) {
 		batch_file_event (path, "norec");
 	}
 	
@@ -385,15 +516,16 @@ static int sfs_utimens(const char *path, const struct timespec ts[2]) {
 int sfs_open(const char *path, struct fuse_file_info *fi) {
     int retstat = 0;
     int fd;
-    char fpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
 
 	BEGIN_PERM;
-    fd = open(fpath, fi->flags);
+    fd = sfs_openat(path, sfs_open_flags (fi->flags), 0);
 	END_PERM;
     if (fd < 0) {
 		retstat = -errno;
 	} else {
+		retstat = sfs_new_handle (fd, fi);
+	}
+	if (!retstat) {
 		SfsState* state = SFS_STATE;
 		int opened_fds = __sync_add_and_fetch (&state->opened_fds, 1);
 		if (state->log_debug) {
@@ -401,8 +533,6 @@ int sfs_open(const char *path, struct fuse_file_info *fi) {
 		}
 	}
     
-    fi->fh = fd;
-    
     return retstat;
 }
 
@@ -421,13 +551,13 @@ int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
     int retstat = 0;
 	
 	if (fi->direct_io) {
-		retstat = pread(fi->fh, buf, size, offset);
+		retstat = pread(sfs_fd (fi), buf, size, offset);
 		if (retstat < 0) {
 			retstat = -errno;
 		}
 	} else {
 		while (retstat < size) {
-			int cur = pread(fi->fh, buf, size-retstat, offset+retstat);
+			int cur = pread(sfs_fd (fi), buf, size-retstat, offset+retstat);
 			if (cur <= 0) {
 				if (cur < 0) {
 					retstat = -errno;
@@ -454,13 +584,13 @@ int sfs_write(const char *path, const char *buf, size_t size, off_t offset,
     int retstat = 0;
 	
 	if (fi->direct_io) {
-		retstat = pwrite (fi->fh, buf, size, offset);
+		retstat = pwrite (sfs_fd (fi), buf, size, offset);
 		if (retstat < 0) {
 			retstat = -errno;
 		}
 	} else {
 		while (retstat < size) {
-			int cur = pwrite (fi->fh, buf, size-retstat, offset+retstat);
+			int cur = pwrite (sfs_fd (fi), buf, size-retstat, offset+retstat);
 			if (cur <= 0) {
 				if (cur < 0) {
 					retstat = -errno;
@@ -472,12 +602,69 @@ int sfs_write(const char *path, const char *buf, size_t size, off_t offset,
 	}
 	
 	if (retstat > 0) {
-		batch_bytes_written (retstat);
+		sfs_written (fi, buf, offset, retstat);
 	}
     
     return retstat;
 }
 
+#ifdef FUSE_29
+/** Read data from an open file into a buffer chain
+*
+* Instead of reading into memory, return a buffer referring to the
+* backing file, so that fuse can splice() it straight to /dev/fuse.
+*
+* Introduced in version 2.9
+*/
+int sfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct fuse_bufvec *src = malloc(sizeof(struct fuse_bufvec));
+	if (src == NULL) {
+		return -ENOMEM;
+	}
+
+	*src = FUSE_BUFVEC_INIT(size);
+	src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	if (!fi->direct_io) {
+		// same as sfs_read, only stop at EOF
+		src->buf[0].flags |= FUSE_BUF_FD_RETRY;
+	}
+	src->buf[0].fd = sfs_fd (fi);
+	src->buf[0].pos = offset;
+	*bufp = src;
+
+	return 0;
+}
+
+/** Write contents of a buffer chain to an open file
+*
+* The buffer usually refers to a pipe filled by splice() from
+* /dev/fuse, which is spliced again into the backing file.
+*
+* Introduced in version 2.9
+*/
+int sfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+	int retstat = 0;
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	if (!fi->direct_io) {
+		// same as sfs_write, write everything or fail
+		dst.buf[0].flags |= FUSE_BUF_FD_RETRY;
+	}
+	dst.buf[0].fd = sfs_fd (fi);
+	dst.buf[0].pos = offset;
+
+	// the copy consumes buf
+	const void* data = sfs_buf_mem (buf);
+	retstat = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+	if (retstat > 0) {
+		sfs_written (fi, data, offset, retstat);
+	}
+
+	return retstat;
+}
+#endif
+
 /** Get filesystem statistics
 *
 * The 'f_frsize', 'f_favail', 'f_fsid' and 'f_flag' fields are ignored
@@ -487,16 +674,17 @@ int sfs_write(const char *path, const char *buf, size_t size, off_t offset,
 */
 int sfs_statfs(const char *path, struct statvfs *statv) {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
+	char xpath[SFS_XATTR_PATH_MAX];
+	const char* atname;
+	int dirfd = sfs_at(path, &atname);
+	if (dirfd < 0) {
+		return -errno;
+	}
 
-	BEGIN_PERM;
+	BEGIN_AT_PERM(dirfd);
     // get stats for underlying filesystem
-    retstat = statvfs(fpath, statv);
-	END_PERM;
-    if (retstat < 0) {
-		retstat = -errno;
-	}
+    retstat = statvfs(sfs_xattr_path(xpath, dirfd, atname), statv);
+	END_AT_PERM(dirfd);
     
     return retstat;
 }
@@ -545,12 +733,20 @@ int sfs_flush(const char *path, struct fuse_file_info *fi) {
 */
 int sfs_release(const char *path, struct fuse_file_info *fi) {
     int retstat = 0;
-    retstat = close(fi->fh);
+	SfsFileHandle* h = (SfsFileHandle*) (uintptr_t) fi->fh;
+	uint64_t written = h->written;
+	int record_len = 0;
+	char* record = extents_release (h->extents, h->fd, path, &record_len);
+    retstat = close(h->fd);
+	free (h);
 	if (retstat < 0) {
 		retstat = -errno;
+		free (record);
 	} else {
 		if ((fi->flags & O_WRONLY) || (fi->flags & O_RDWR)) {
-			batch_file_event (path, "norec");
+			batch_written_event (path, written, record, record_len);
+		} else {
+			free (record);
 		}
 	
 		SfsState* state = SFS_STATE;
@@ -574,9 +770,9 @@ int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
     int retstat = 0;
     
     if (datasync) {
-		retstat = fdatasync(fi->fh);
+		retstat = fdatasync(sfs_fd (fi));
 	} else {
-		retstat = fsync(fi->fh);
+		retstat = fsync(sfs_fd (fi));
 	}
     
     if (retstat < 0) {
@@ -586,15 +782,19 @@ int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
     return retstat;
 }
 
+#ifdef FUSE_291
 #ifdef HAVE_FALLOCATE
 static int sfs_fallocate(const char *path, int mode,
 						 off_t offset, off_t length, struct fuse_file_info *fi) {
 	int retstat = 0;
 	
 	(void) path;
-	retstat = fallocate (fi->fh, mode, offset, length);
+	retstat = fallocate (sfs_fd (fi), mode, offset, length);
 	if (retstat < 0) {
 		retstat = -errno;
+	} else if (mode & ~FALLOC_FL_KEEP_SIZE) {
+		// holes and shifted data are not ranges
+		extents_invalidate (sfs_extents (fi));
 	}
 	
 	return retstat;
@@ -606,22 +806,65 @@ static int sfs_fallocate(const char *path, int mode,
 	if (mode) {
 		return -EOPNOTSUPP;
 	}
-	return -posix_fallocate(fi->fh, offset, length);
+	return -posix_fallocate(sfs_fd (fi), offset, length);
+}
+#endif
+#endif
+
+#ifdef SFS_FUSE3
+/** Copy a range of data from one file to another
+*
+* Delegated to the original filesystem, which may share the extents
+* (reflink) or copy in the kernel. Like write(), the event for the
+* destination is emitted on release.
+*
+* Introduced in version 3.4
+*/
+static ssize_t sfs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t off_in,
+								   const char *path_out, struct fuse_file_info *fi_out, off_t off_out,
+								   size_t len, int flags) {
+	off_t offset = off_out;
+	ssize_t retstat = copy_file_range(sfs_fd (fi_in), &off_in, sfs_fd (fi_out), &off_out, len, flags);
+	if (retstat < 0) {
+		return -errno;
+	}
+
+	if (retstat > 0) {
+		sfs_written (fi_out, NULL, offset, retstat);
+	}
+	return retstat;
+}
+
+/** Find the next data or hole after the specified offset
+*
+* Introduced in version 3.8
+*/
+static off_t sfs_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi) {
+	off_t retstat = lseek(sfs_fd (fi), off, whence);
+	if (retstat < 0) {
+		return -errno;
+	}
+	return retstat;
 }
 #endif
 
 /** Set extended attributes */
 int sfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
+	char xpath[SFS_XATTR_PATH_MAX];
+	const char* atname;
+	if (sfs_xattr_reserved (name)) {
+		return -EPERM;
+	}
+	int dirfd = sfs_at(path, &atname);
+	if (dirfd < 0) {
+		return -errno;
+	}
 
-	BEGIN_PERM;
-    retstat = lsetxattr(fpath, name, value, size, flags);
-	END_PERM;
-    if (retstat < 0) {
-		retstat = -errno;
-	} else {
+	BEGIN_AT_PERM(dirfd);
+    retstat = lsetxattr(sfs_xattr_path(xpath, dirfd, atname), name, value, size, flags);
+	END_AT_PERM(dirfd);
+	if (retstat >= 0) {
 		batch_file_event (path, "norec");
 	}
     
@@ -631,31 +874,33 @@ int sfs_setxattr(const char *path, const char *name, const char *value, size_t s
 /** Get extended attributes */
 int sfs_getxattr(const char *path, const char *name, char *value, size_t size) {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
+	char xpath[SFS_XATTR_PATH_MAX];
+	const char* atname;
+	int dirfd = sfs_at(path, &atname);
+	if (dirfd < 0) {
+		return -errno;
+	}
 
-	BEGIN_PERM;
-    retstat = lgetxattr(fpath, name, value, size);
-	END_PERM;
-    if (retstat < 0) {
-		retstat = -errno;
-    }
-	
+	BEGIN_AT_PERM(dirfd);
+    retstat = lgetxattr(sfs_xattr_path(xpath, dirfd, atname), name, value, size);
+	END_AT_PERM(dirfd);
+    
     return retstat;
 }
 
 /** List extended attributes */
 int sfs_listxattr(const char *path, char *list, size_t size) {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
-
-	BEGIN_PERM;
-    retstat = llistxattr(fpath, list, size);
-	END_PERM;
-    if (retstat < 0) {
-		retstat = -errno;
+	char xpath[SFS_XATTR_PATH_MAX];
+	const char* atname;
+	int dirfd = sfs_at(path, &atname);
+	if (dirfd < 0) {
+		return -errno;
 	}
+
+	BEGIN_AT_PERM(dirfd);
+    retstat = sfs_list_xattrs(sfs_xattr_path(xpath, dirfd, atname), list, size);
+	END_AT_PERM(dirfd);
     
     return retstat;
 }
@@ -663,15 +908,20 @@ int sfs_listxattr(const char *path, char *list, size_t size) {
 /** Remove extended attributes */
 int sfs_removexattr(const char *path, const char *name) {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
+	char xpath[SFS_XATTR_PATH_MAX];
+	const char* atname;
+	if (sfs_xattr_reserved (name)) {
+		return -EPERM;
+	}
+	int dirfd = sfs_at(path, &atname);
+	if (dirfd < 0) {
+		return -errno;
+	}
 
-	BEGIN_PERM;
-    retstat = lremovexattr(fpath, name);
-	END_PERM;
-    if (retstat < 0) {
-		retstat = -errno;
-	} else {
+	BEGIN_AT_PERM(dirfd);
+    retstat = lremovexattr(sfs_xattr_path(xpath, dirfd, atname), name);
+	END_AT_PERM(dirfd);
+	if (retstat >= 0) {
 		batch_file_event (path, "norec");
 	}
     
@@ -686,25 +936,41 @@ int sfs_removexattr(const char *path, const char *name) {
 * Introduced in version 2.3
 */
 int sfs_opendir(const char *path, struct fuse_file_info *fi) {
-    DIR *dp;
+    DIR *dp = NULL;
     int retstat = 0;
-    char fpath[PATH_MAX];
-    sfs_fullpath(fpath, path);
+	SfsDirHandle* d = calloc (1, sizeof (SfsDirHandle));
+	if (!d) {
+		return -ENOMEM;
+	}
 
-	BEGIN_PERM;
-    dp = opendir(fpath);
+	if (!sfs_begin_access ()) {
+		free (d);
+		return -EPERM;
+	}
+	int fd = sfs_openat(path, O_RDONLY | O_DIRECTORY, 0);
+	if (fd >= 0) {
+		dp = fdopendir(fd);
+		if (dp == NULL) {
+			retstat = -errno;
+			close(fd);
+		}
+	} else {
+		retstat = -errno;
+	}
 	END_PERM;
     if (dp == NULL) {
-		retstat = -errno;
-	} else {
-		SfsState* state = SFS_STATE;
-		int opened_fds = __sync_add_and_fetch (&state->opened_fds, 1);
-		if (state->log_debug) {
-			syslog (LOG_DEBUG, "[opendir] opened fds %d\n", opened_fds);
-		}
+		free (d);
+		return retstat;
 	}
-    
-    fi->fh = (intptr_t) dp;
+
+	SfsState* state = SFS_STATE;
+	int opened_fds = __sync_add_and_fetch (&state->opened_fds, 1);
+	if (state->log_debug) {
+		syslog (LOG_DEBUG, "[opendir] opened fds %d\n", opened_fds);
+	}
+
+	d->dp = dp;
+    fi->fh = (intptr_t) d;
     
     return retstat;
 }
@@ -730,34 +996,66 @@ int sfs_opendir(const char *path, struct fuse_file_info *fi) {
 *
 * Introduced in version 2.3
 */
+#ifdef SFS_FUSE3
+int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+				struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+	int plus = SFS_STATE->readdirplus && (flags & FUSE_READDIR_PLUS);
+#else
 int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
 				struct fuse_file_info *fi) {
+	int plus = SFS_STATE->readdirplus;
+#endif
 	int retstat = 0;
-	DIR *dp;
-	struct dirent *de;
-	// once again, no need for fullpath -- but note that I need to cast fi->fh
-	dp = (DIR *) (uintptr_t) fi->fh;
-	
-	// reset before doing anything
-	errno = 0;
-	
-	// This will copy the entire directory into the buffer.  The loop exits
-	// when either the system readdir() returns NULL, or filler()
-	// returns something non-zero.  The first case just means I've
-	// read the whole directory; the second means the buffer is full.
-	while ((de = readdir(dp)) != NULL) {
+	SfsDirHandle* d = (SfsDirHandle*) (uintptr_t) fi->fh;
+
+	if (offset != d->offset) {
+		seekdir (d->dp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
+
+	// stat entries with the credentials of the caller
+	if (plus) {
+		BEGIN_PERM;
+	}
+
+	// Stream the directory using telldir() offsets, stop as soon as the
+	// buffer is full and keep the entry for the next call.
+	while (1) {
+		if (!d->entry) {
+			errno = 0;
+			d->entry = readdir (d->dp);
+			if (!d->entry) {
+				if (errno) {
+					retstat = -errno;
+				}
+				break;
+			}
+		}
+
+		struct dirent* de = d->entry;
+		off_t nextoff = telldir (d->dp);
 		struct stat st;
-		memset(&st, 0, sizeof(st));
-		st.st_ino = de->d_ino;
-		st.st_mode = de->d_type << 12;
-		if (filler(buf, de->d_name, &st, 0) != 0) {
-			syslog(LOG_CRIT, "sfs_readdir filler: buffer full while reading dir %s", path);
-			return -ENOMEM;
+		int fill_plus = plus && fstatat (dirfd (d->dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+		if (!fill_plus) {
+			memset (&st, 0, sizeof (st));
+			st.st_ino = de->d_ino;
+			st.st_mode = de->d_type << 12;
 		}
+
+		#ifdef SFS_FUSE3
+		if (filler (buf, de->d_name, &st, nextoff, fill_plus ? FUSE_FILL_DIR_PLUS : 0) != 0) {
+		#else
+		if (filler (buf, de->d_name, &st, nextoff) != 0) {
+		#endif
+			break;
+		}
+		d->entry = NULL;
+		d->offset = nextoff;
 	}
-	
-	if (de == NULL && errno == EBADF) {
-		retstat = -errno;
+
+	if (plus) {
+		END_PERM;
 	}
 	
 	return retstat;
@@ -769,7 +1067,9 @@ int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 */
 int sfs_releasedir (const char *path, struct fuse_file_info *fi) {
 	int retstat = 0;
-	retstat = closedir((DIR *) (uintptr_t) fi->fh);
+	SfsDirHandle* d = (SfsDirHandle*) (uintptr_t) fi->fh;
+	retstat = closedir(d->dp);
+	free (d);
 	if (retstat < 0) {
 		retstat = -errno;
 	} else {
@@ -794,11 +1094,9 @@ int sfs_releasedir (const char *path, struct fuse_file_info *fi) {
 
 int sfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
 	int retstat = 0;
-	DIR *dp;
 	int fd;
 	
-	dp = (DIR *) (uintptr_t) fi->fh;
-	fd = dirfd (dp);
+	fd = dirfd (((SfsDirHandle*) (uintptr_t) fi->fh)->dp);
 	
 	if (datasync) {
 		retstat = fdatasync(fd);
@@ -830,30 +1128,27 @@ int sfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
 // parameter coming in here, or else the fact should be documented
 // (and this might as well return void, as it did in older versions of
 // FUSE).
+#ifdef SFS_FUSE3
+void *sfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+#else
 void *sfs_init(struct fuse_conn_info *conn) {
+#endif
 	SfsState* state = SFS_STATE;
 	state->pid = getpid ();
 
 	openlog (state->log_ident, LOG_PID, state->log_facility);
 	syslog (LOG_INFO, "[main] started sfs");
 
-	// write pid file
-	const char* pidpath = state->pid_path;
-	if (state->pid_path) {
-		FILE *pidfile = fopen (pidpath, "w");
-		if (!pidfile) {
-			syslog(LOG_ERR, "[main] cannot open %s for write: %s", pidpath, strerror (errno));
-		} else {
-			if (!fprintf(pidfile, "%d\n", state->pid)) {
-				syslog(LOG_ERR, "[main] can't write pid %d to %s: %s.\n",
-					   state->pid, pidpath, strerror (errno));
-			}
-			fflush (pidfile);
-			fclose (pidfile);
-		}
+	sfs_init_conn (state, conn);
+
+	// paths relative to rootdir are used where there is no *at() syscall
+	if (fchdir (state->rootdir_fd) < 0) {
+		syslog (LOG_ERR, "[main] cannot change directory to %s: %s", state->rootdir, strerror (errno));
 	}
 
-	batch_start_timer (state);
+	sfs_write_pid (state);
+	batch_start_writer (state);
+	stats_start_timer (state);
 	return state;
 }
 
@@ -866,7 +1161,9 @@ void *sfs_init(struct fuse_conn_info *conn) {
 */
 void sfs_destroy (void *userdata) {
 	/* SfsState* state = (SfsState*) userdata; */
-	// nop, other threads might still be accessing this struct
+	// other threads might still be accessing this struct, only make
+	// sure queued events reach the tmp batch
+	batch_drain ();
 }
 
 /**
@@ -881,18 +1178,18 @@ void sfs_destroy (void *userdata) {
 * Introduced in version 2.5
 */
 int sfs_access(const char *path, int mask) {
-	int retval;
-	char fpath[PATH_MAX];
-	sfs_fullpath(fpath, path);
-
-	BEGIN_PERM;
-	retval = euidaccess (fpath, mask);
-	END_PERM;
-	if (retval < 0) {
-		retval = -errno;
+	int retstat;
+	const char* name;
+	int dirfd = sfs_at(path, &name);
+	if (dirfd < 0) {
+		return -errno;
 	}
 
-	return retval;
+	BEGIN_AT_PERM(dirfd);
+	retstat = faccessat (dirfd, name, mask, AT_EACCESS | sfs_follow_flags ());
+	END_AT_PERM(dirfd);
+
+	return retstat;
 }
 
 /**
@@ -909,16 +1206,17 @@ int sfs_access(const char *path, int mask) {
 */
 int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
 	int retstat = 0;
-	char fpath[PATH_MAX];
 	int fd;
-	sfs_fullpath(fpath, path);
 
 	BEGIN_PERM;
-	fd = creat(fpath, mode);
+	fd = sfs_openat(path, sfs_open_flags (O_CREAT | O_WRONLY | O_TRUNC), mode);
 	END_PERM;
 	if (fd < 0) {
 		retstat = -errno;
 	} else {
+		retstat = sfs_new_handle (fd, fi);
+	}
+	if (!retstat) {
 		SfsState* state = SFS_STATE;
 		int opened_fds = __sync_add_and_fetch (&state->opened_fds, 1);
 		if (state->log_debug) {
@@ -926,8 +1224,6 @@ int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
 		}
 	}
 	
-	fi->fh = fd;
-	
 	return retstat;
 }
 
@@ -947,9 +1243,11 @@ int sfs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi) {
 	int retstat = 0;
 	
 	(void) path;
-	retstat = ftruncate(fi->fh, offset);
+	retstat = ftruncate(sfs_fd (fi), offset);
 	if (retstat < 0) {
 		retstat = -errno;
+	} else {
+		extents_truncate (sfs_extents (fi), offset);
 	}
 	
 	return retstat;
@@ -974,7 +1272,7 @@ int sfs_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *
 	int retstat = 0;
 	
 	(void) path;
-	retstat = fstat(fi->fh, statbuf);
+	retstat = fstat(sfs_fd (fi), statbuf);
 	if (retstat < 0) {
 		retstat = -errno;
 	}
@@ -982,22 +1280,72 @@ int sfs_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *
 	return retstat;
 }
 
+#ifdef SFS_FUSE3
+/* libfuse 3 merged the f* variants into the path operations, passing fi
+ * when the file is open, and dropped utime() in favor of utimens(). */
+static int sfs3_getattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi) {
+	return fi ? sfs_fgetattr(path, statbuf, fi) : sfs_getattr(path, statbuf);
+}
+
+static int sfs3_truncate(const char *path, off_t newsize, struct fuse_file_info *fi) {
+	if (fi) {
+		// the high-level ftruncate() didn't generate events either
+		return sfs_ftruncate(path, newsize, fi);
+	}
+	return sfs_truncate(path, newsize);
+}
+
+static int sfs3_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	return sfs_chmod(path, mode);
+}
+
+static int sfs3_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
+	return sfs_chown(path, uid, gid);
+}
+
+static int sfs3_utimens(const char *path, const struct timespec ts[2], struct fuse_file_info *fi) {
+	return sfs_utimens(path, ts);
+}
+
+static int sfs3_rename(const char *path, const char *newpath, unsigned int flags) {
+	// RENAME_EXCHANGE and RENAME_NOREPLACE are not supported
+	if (flags) {
+		return -EINVAL;
+	}
+	return sfs_rename(path, newpath);
+}
+#endif
+
 struct fuse_operations sfs_oper = {
+	#ifdef SFS_FUSE3
+	.getattr = sfs3_getattr,
+	.rename = sfs3_rename,
+	.chmod = sfs3_chmod,
+	.chown = sfs3_chown,
+	.truncate = sfs3_truncate,
+	.utimens = sfs3_utimens,
+	#else
 	.getattr = sfs_getattr,
-	.readlink = sfs_readlink,
 	// no .getdir -- that's deprecated
 	.getdir = NULL,
+	.rename = sfs_rename,
+	.chmod = sfs_chmod,
+	.chown = sfs_chown,
+	.truncate = sfs_truncate,
+	.utime = sfs_utime,
+	.ftruncate = sfs_ftruncate,
+	.fgetattr = sfs_fgetattr,
+	#ifdef HAVE_UTIMENSAT
+	.utimens = sfs_utimens,
+	#endif
+	#endif
+	.readlink = sfs_readlink,
 	.mknod = sfs_mknod,
 	.mkdir = sfs_mkdir,
 	.unlink = sfs_unlink,
 	.rmdir = sfs_rmdir,
 	.symlink = sfs_symlink,
-	.rename = sfs_rename,
 	.link = sfs_link,
-	.chmod = sfs_chmod,
-	.chown = sfs_chown,
-	.truncate = sfs_truncate,
-	.utime = sfs_utime,
 	.open = sfs_open,
 	.read = sfs_read,
 	.write = sfs_write,
@@ -1017,20 +1365,23 @@ struct fuse_operations sfs_oper = {
 	.destroy = sfs_destroy,
 	.access = sfs_access,
 	.create = sfs_create,
-	.ftruncate = sfs_ftruncate,
-	.fgetattr = sfs_fgetattr,
-	#ifdef HAVE_UTIMENSAT
-	.utimens = sfs_utimens,
+	#ifdef FUSE_29
+	.write_buf = sfs_write_buf,
+	.read_buf = sfs_read_buf,
+	#endif
+	#if defined(FUSE_291) && (defined(HAVE_FALLOCATE) || HAVE_POSIX_FALLOCATE)
+	.fallocate = sfs_fallocate,
+	#endif
+	#ifdef SFS_FUSE3
+	.copy_file_range = sfs_copy_file_range,
+	.lseek = sfs_lseek,
 	#endif
 	/* Others
 	.lock - for networking, local by default
 	.flock - for networking, local by default
-	.write_buf - version 2.8
-	.read_buf - version 2.8
 	.poll - version 2.8
 	.ioctl - version 2.8
 	.bmap - for block device
-	.fallocate = sfs_fallocate, version 2.9.1
 	*/
 };
 
@@ -1044,6 +1395,13 @@ enum {
 
 static struct fuse_opt sfs_opts[] = {
 	SFS_OPT("sfs_perms", perm_checks, 1),
+	SFS_OPT("sfs_lowlevel", lowlevel, 1),
+	SFS_OPT("sfs_beneath", resolve_beneath, 1),
+	SFS_OPT("sfs_thread_creds", thread_creds, 1),
+	SFS_OPT("sfs_readdirplus", readdirplus, 1),
+	SFS_OPT("sfs_watch", watch, 1),
+	SFS_OPT("sfs_writeback", writeback, 1),
+	SFS_OPT("sfs_passthrough", passthrough, 1),
 	SFS_OPT("sfs_uid=%i", uid, 0),
 	SFS_OPT("sfs_gid=%i", gid, 0),
 	FUSE_OPT_KEY("-V", KEY_VERSION),
@@ -1069,6 +1427,13 @@ void sfs_usage() {
 		"    -o sfs_uid=N           drop privileges to user\n"
 		"    -o sfs_gid=N           drop privileges to group\n"
 		"    -o sfs_perms           allow startup as root (not recommended)\n"
+		"    -o sfs_lowlevel        use the inode based low-level backend (FUSE >= 2.9)\n"
+		"    -o sfs_beneath         never resolve paths outside of rootdir\n"
+		"    -o sfs_thread_creds    switch credentials per thread, without locking\n"
+		"    -o sfs_readdirplus     return full attributes when listing directories\n"
+		"    -o sfs_watch           invalidate kernel caches on changes beneath fuse (low-level only)\n"
+		"    -o sfs_writeback       enable the kernel writeback cache (FUSE 3 only)\n"
+		"    -o sfs_passthrough     let the kernel read and write files directly (low-level, FUSE >= 3.16)\n"
 		"\n"
 	);
 	abort();
@@ -1093,7 +1458,6 @@ static int sfs_opt_handler (void *data, const char *arg, int key, struct fuse_ar
 					syslog(LOG_ERR, "[main] directory '%s' does not exist", arg);
 					return -1;
 				}
-				state->rootdir_len = state->rootdir ? strlen(state->rootdir) : -1;
 				return 0;
 			}
 			break;
@@ -1113,6 +1477,7 @@ int main(int argc, char **argv) {
 		perror("[main] state calloc failed");
 		abort();
 	}
+	sfs_state = state;
 	
 	openlog ("sfs-startup", LOG_PID|LOG_CONS|LOG_PERROR, LOG_DAEMON);
 	
@@ -1128,6 +1493,10 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
+	if (!sfs_open_root (state)) {
+		return 1;
+	}
+
 	if (state->uid || state->gid) {
 		if (!(state->uid && state->gid)) {
 			syslog(LOG_ERR, "uid and gid must be set");
@@ -1156,6 +1525,57 @@ int main(int argc, char **argv) {
 		abort ();
 	}
 
+	#ifndef SFS_FUSE3
+	if (state->readdirplus) {
+		// only FUSE 3 passes the attributes on to the kernel
+		syslog(LOG_WARNING, "[main] sfs_readdirplus has no effect with FUSE 2");
+		state->readdirplus = 0;
+	}
+	if (state->writeback) {
+		syslog(LOG_WARNING, "[main] sfs_writeback has no effect with FUSE 2");
+		state->writeback = 0;
+	}
+	#endif
+
+	#ifndef SFS_LOWLEVEL
+	if (state->lowlevel) {
+		syslog(LOG_ERR, "[main] sfs_lowlevel requires FUSE >= 2.9");
+		return 1;
+	}
+	#endif
+
+	if (state->watch && !state->lowlevel) {
+		syslog(LOG_ERR, "[main] sfs_watch requires sfs_lowlevel");
+		return 1;
+	}
+
+	if (state->writeback && !state->watch) {
+		// the kernel keeps its own size and mtime of cached files
+		syslog(LOG_WARNING, "[main] without sfs_watch, files changed beneath fuse may be served stale with sfs_writeback");
+	}
+
+	#ifndef SFS_PASSTHROUGH
+	if (state->passthrough) {
+		syslog(LOG_WARNING, "[main] sfs_passthrough requires FUSE >= 3.16");
+		state->passthrough = 0;
+	}
+	#endif
+
+	if (state->passthrough) {
+		if (!state->lowlevel || !state->perm_checks) {
+			// registering backing files needs CAP_SYS_ADMIN
+			syslog(LOG_ERR, "[main] sfs_passthrough requires sfs_lowlevel and --perms");
+			return 1;
+		}
+		// the kernel does not allow both
+		state->writeback = 0;
+	}
+
+	if (state->thread_creds && !state->perm_checks) {
+		syslog(LOG_ERR, "[main] sfs_thread_creds requires --perms");
+		return 1;
+	}
+
 	if (state->perm_checks && pthread_mutex_init (&(state->access_mutex), NULL) != 0) {
 		syslog(LOG_ERR, "[main] cannot init access mutex: %s", strerror (errno));
 		return 2;
@@ -1180,13 +1600,38 @@ int main(int argc, char **argv) {
 	// startup values
 	sfs_get_monotonic_time (state, &(state->last_time));
 	
-	if (pthread_mutex_init (&(state->batch_mutex), NULL) != 0) {
-		syslog(LOG_CRIT, "[main] cannot init batch mutex: %s", strerror (errno));
+	int count = state->batch_shards * BATCH_TYPES;
+	state->batch_file_set = calloc (count, sizeof (SfsSet*));
+	if (!state->batch_file_set) {
+		syslog (LOG_ERR, "[main] cannot allocate the batch dedup set");
 		return 7;
 	}
+	int i;
+	for (i=0; i < count; i++) {
+		state->batch_file_set[i] = sfs_set_new (state->batch_dedup_max_bytes);
+		if (!state->batch_file_set[i]) {
+			syslog (LOG_ERR, "[main] cannot allocate the batch dedup set");
+			return 7;
+		}
+	}
 
-	state->batch_tmp_file = -1;
-	state->batch_file_set = sfs_set_new ();
+	// the shard directories receive the pending batches too
+	for (i=0; state->batch_shards > 1 && i < state->batch_shards; i++) {
+		char* shard_dir = batch_shard_dir (state, i);
+		if (!shard_dir || (mkdir (shard_dir, 0777) < 0 && errno != EEXIST)) {
+			syslog (LOG_ERR, "[main] cannot create shard directory %s: %s", shard_dir ? shard_dir : state->batch_dir, strerror(errno));
+			return 14;
+		}
+		free (shard_dir);
+	}
+	for (i=0; state->batch_large_bytes && i < state->batch_shards; i++) {
+		char* large_dir = batch_stream_dir (state, i, BATCH_TYPE_LARGE);
+		if (!large_dir || (mkdir (large_dir, 0777) < 0 && errno != EEXIST)) {
+			syslog (LOG_ERR, "[main] cannot create large batches directory %s: %s", large_dir ? large_dir : state->batch_dir, strerror(errno));
+			return 14;
+		}
+		free (large_dir);
+	}
 	
 	// flush pending batches
 	DIR* dir = opendir (state->batch_tmp_dir);
@@ -1196,8 +1641,12 @@ int main(int argc, char **argv) {
 	}
 	struct dirent* ent;
 	int flushed = 0;
+	int large_flushed[BATCH_MAX_SHARDS] = { 0 };
 	while ((ent = readdir (dir))) {
-		if (strstr (ent->d_name, ".batch")) {
+		if (journal_is_file (ent->d_name)) {
+			// moved along with its batch
+			continue;
+		} else if (strstr (ent->d_name, ".batch")) {
 			// move pending tmp batch to the batch dir
 			char* tmp_path = NULL;
 			if (asprintf(&tmp_path, "%s/%s", state->batch_tmp_dir, ent->d_name) < 0) {
@@ -1205,25 +1654,65 @@ int main(int argc, char **argv) {
 				return 9;
 			}
 			
+			// binary batches get the trailer they missed
+			if (strstr (ent->d_name, ".batch2") && batchfmt_seal_file (tmp_path) < 0) {
+				syslog(LOG_WARNING, "[main] cannot seal binary batch %s, moving it anyway: %s", tmp_path, strerror (errno));
+			}
+
 			char* batch_path = NULL;
-			if (asprintf(&batch_path, "%s/%s", state->batch_dir, ent->d_name) < 0) {
+			BatchType type = batch_name_type (ent->d_name);
+			int shard = batch_file_shard (state, tmp_path);
+			char* stream_dir = batch_stream_dir (state, shard, type);
+			if (!stream_dir || asprintf(&batch_path, "%s/%s", stream_dir, ent->d_name) < 0) {
 				syslog(LOG_ERR, "[main] batch_path asprintf for %s/%s failed: %s", state->batch_dir, ent->d_name, strerror (errno));
 				return 10;
 			}
+			// batch_large_bytes may have been turned off since
+			if (type == BATCH_TYPE_LARGE && mkdir (stream_dir, 0777) < 0 && errno != EEXIST) {
+				syslog (LOG_ERR, "[main] cannot create large batches directory %s: %s", stream_dir, strerror(errno));
+				return 14;
+			}
+			free (stream_dir);
 
 			if (rename (tmp_path, batch_path) < 0) {
 				syslog(LOG_ERR, "[main] rename of %s to %s failed: %s", tmp_path, batch_path, strerror (errno));
 				return 11;
 			}
+			if (!journal_recover (state, tmp_path, ent->d_name)) {
+				return 13;
+			}
 
 			free (tmp_path);
 			free (batch_path);
 
 			flushed++;
+			if (type == BATCH_TYPE_LARGE) {
+				large_flushed[shard]++;
+			}
+		} else if (pool_is_file (state, ent->d_name)) {
+			int recovered = pool_recover (state, ent->d_name);
+			if (recovered < 0) {
+				return 12;
+			}
+			flushed += recovered;
 		}
 	}
 	closedir(dir);
-	sfs_sync_path (state->batch_dir, 0);
+	if (state->rename_journal_dir) {
+		sfs_sync_path (state->rename_journal_dir, 0);
+	}
+	for (i=0; i < state->batch_shards; i++) {
+		char* shard_dir = batch_shard_dir (state, i);
+		if (shard_dir) {
+			sfs_sync_path (shard_dir, 0);
+			free (shard_dir);
+		}
+		char* large_dir = batch_stream_dir (state, i, BATCH_TYPE_LARGE);
+		if (large_dir && (state->batch_large_bytes || large_flushed[i])) {
+			sfs_sync_path (large_dir, 0);
+		}
+		free (large_dir);
+	}
 	sfs_sync_path (state->batch_tmp_dir, 0);
 	syslog(LOG_NOTICE, "[main] flushed %d pending batches from tmp dir %s to %s", flushed, state->batch_tmp_dir, state->batch_dir);
 
@@ -1239,9 +1728,21 @@ int main(int argc, char **argv) {
 	snprintf(buf, sizeof buf, "-ofsname=%s", state->rootdir);
 	fuse_opt_add_arg(&args, buf);
 	fuse_opt_add_arg(&args, "-osubtype=sfs");
+	#ifdef SFS_FUSE3
+	// one /dev/fuse fd per worker thread
+	fuse_opt_add_arg(&args, "-oclone_fd");
+	#endif
 
 	// turn over control to fuse
+	#ifdef SFS_LOWLEVEL
+	if (state->lowlevel) {
+		fuse_stat = sfs_lowlevel_main (&args, state);
+	} else {
+		fuse_stat = fuse_main(args.argc, args.argv, &sfs_oper, state);
+	}
+	#else
 	fuse_stat = fuse_main(args.argc, args.argv, &sfs_oper, state);
+	#endif
 	syslog (LOG_INFO, "[main] fuse_main returned %d\n", fuse_stat);
 	
 	closelog();
@@ -31,6 +31,19 @@
 
 #include "set.h"
 
+// largest write request asked to the kernel with FUSE 3
+#define SFS_MAX_WRITE (1024 * 1024)
+
+// the low-level backend needs forget_multi and fuse_reply_data, libfuse >= 2.9
+#if defined(SFS_FUSE3) || defined(FUSE_29)
+#define SFS_LOWLEVEL
+#endif
+
+// passing backing files through to the kernel needs libfuse >= 3.16
+#if defined(SFS_FUSE3) && defined(FUSE_CAP_PASSTHROUGH)
+#define SFS_PASSTHROUGH
+#endif
+
 #ifndef CLOCK_MONOTONIC_RAW
 // Added in kernel 2.6.28 but not in glibc
 #define CLOCK_MONOTONIC_RAW 4
@@ -42,30 +55,54 @@ typedef enum {
 	UPDATE_MTIME_INCREMENT
 } UpdateMTime;
 
+typedef enum {
+	BATCH_OVERFLOW_BLOCK,
+	BATCH_OVERFLOW_DROP
+} BatchOverflow;
+
+typedef enum {
+	BATCH_FORMAT_TEXT,
+	BATCH_FORMAT_BINARY
+} BatchFormat;
+
+// each type has its own open batch
+typedef enum {
+	BATCH_TYPE_NOREC,
+	BATCH_TYPE_REC,
+	// norec events of files written past batch_large_bytes
+	BATCH_TYPE_LARGE,
+	BATCH_TYPES
+} BatchType;
+
+typedef enum {
+	BATCH_SHARD_PATH,
+	BATCH_SHARD_TOP
+} BatchShardKey;
+
 typedef struct {
 	// general
     char* rootdir;
-	int rootdir_len;
+	int rootdir_fd;
+	int resolve_beneath;
 	char* configpath;
 	struct timespec last_time;
 	pid_t pid;
 	pthread_mutex_t access_mutex;
 	int perm_checks;
+	int thread_creds;
+	int lowlevel;
+	int readdirplus;
+	int watch;
+	int writeback;
+	int passthrough;
 	int uid;
 	int gid;
 	int fuse_umask;
 	volatile int opened_fds;
 	char hostname[1024];
 
-	// current batch
-	pthread_mutex_t batch_mutex;
-	int batch_tmp_file;
-	char* batch_tmp_path;
-	char* batch_name;
-	const char* batch_type;
-	volatile int batch_events;
-	volatile uint64_t batch_bytes;
-	SfsSet* batch_file_set;
+	// paths of the open batch of each shard and type, see BATCH_INDEX
+	SfsSet** batch_file_set;
 	
 	// preserve accross multiple batch creations
 	struct timespec batch_time;
@@ -78,18 +115,42 @@ typedef struct {
 	char* batch_tmp_dir;
 	char* node_name;
 	char* ignore_path_prefix;
+	char* rename_journal_dir;
+	char* extent_journal_dir;
 	struct timespec batch_flush_ts;
 	int batch_max_events;
 	uint64_t batch_max_bytes;
+	uint64_t batch_large_bytes;
+	int batch_adaptive;
+	int batch_adaptive_max_events;
+	BatchFormat batch_format;
+	uint64_t batch_dedup_max_bytes;
+	int batch_dedup_window;
+	int batch_shards;
+	BatchShardKey batch_shard_key;
 	int use_osync;
+	int batch_queue_size;
+	BatchOverflow batch_queue_overflow;
+	int batch_group_commit;
+	int batch_commit_window_usec;
+	int batch_commit_max_events;
+	int batch_io_uring;
+	int batch_pool_size;
+	long long batch_pool_prealloc;
 	UpdateMTime update_mtime;
 	int forbid_older_mtime;
+	int cred_cache_ttl_msec;
+	int content_hash;
+	char* stats_path;
+	struct timespec stats_interval_ts;
 	
 	char* log_ident;
 	int log_facility;
 	int log_debug;
 } SfsState;
 
-#define SFS_STATE ((SfsState *) fuse_get_context()->private_data)
+// set once in main(), also valid outside of fuse high-level contexts
+extern SfsState* sfs_state;
+#define SFS_STATE (sfs_state)
 
 #endif
\ No newline at end of file
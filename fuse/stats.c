@@ -0,0 +1,145 @@
+/*
+ *  stats.c - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sfs.h"
+#include "stats.h"
+
+static volatile uint64_t stats_counters[STAT_MAX];
+
+// same order as SfsStat
+static const char* stats_names[STAT_MAX] = {
+	"cred_cache_hits",
+	"cred_cache_misses",
+	"cred_cache_flushes",
+	"batch_queue_full",
+	"batch_events_dropped",
+	"batch_commits",
+	"batch_commit_events",
+	"batch_commit_size_1",
+	"batch_commit_size_2_15",
+	"batch_commit_size_16_127",
+	"batch_commit_size_128_plus",
+	"batch_published",
+	"batch_publish_syncs",
+	"batch_dedup_window_hits",
+	"batch_order_seals",
+	"batch_flush_full",
+	"batch_flush_age",
+	"batch_flush_idle"
+};
+
+void stats_add (SfsStat stat, uint64_t value) {
+	__sync_fetch_and_add (&stats_counters[stat], value);
+}
+
+uint64_t stats_get (SfsStat stat) {
+	return __sync_fetch_and_add (&stats_counters[stat], 0);
+}
+
+/* Write all the counters to stats_path, replacing the old file atomically
+ * so that readers never see a partial dump. */
+static void stats_dump (SfsState* state) {
+	char tmp_path[PATH_MAX];
+	char* stats_path = NULL;
+	int i;
+
+	pthread_mutex_lock (&(state->config_mutex));
+	if (state->stats_path) {
+		stats_path = strdup (state->stats_path);
+	}
+	pthread_mutex_unlock (&(state->config_mutex));
+
+	if (!stats_path) {
+		return;
+	}
+
+	if (snprintf (tmp_path, sizeof (tmp_path), "%s.tmp", stats_path) >= sizeof (tmp_path)) {
+		syslog(LOG_ERR, "[stats] path too long: %s", stats_path);
+		goto cleanup;
+	}
+
+	FILE* file = fopen (tmp_path, "w");
+	if (!file) {
+		syslog(LOG_ERR, "[stats] cannot open %s for write: %s", tmp_path, strerror (errno));
+		goto cleanup;
+	}
+
+	for (i=0; i < STAT_MAX; i++) {
+		fprintf (file, "%s %llu\n", stats_names[i], (unsigned long long) stats_get (i));
+	}
+
+	if (fclose (file) != 0) {
+		syslog(LOG_ERR, "[stats] cannot write %s: %s", tmp_path, strerror (errno));
+		goto cleanup;
+	}
+
+	if (rename (tmp_path, stats_path) < 0) {
+		syslog(LOG_ERR, "[stats] cannot rename %s to %s: %s", tmp_path, stats_path, strerror (errno));
+	}
+
+cleanup:
+	free (stats_path);
+}
+
+static void* stats_timer_handler (void* arg) {
+	SfsState* state = (SfsState*) arg;
+
+	while (1) {
+		struct timespec sleep_ts = state->stats_interval_ts;
+		while (sleep_ts.tv_sec > 0 || sleep_ts.tv_nsec > 0) {
+			struct timespec rem_ts;
+			if (nanosleep (&sleep_ts, &rem_ts) < 0 && errno == EINTR) {
+				sleep_ts = rem_ts;
+			} else {
+				break;
+			}
+		}
+
+		stats_dump (state);
+	}
+
+	return NULL;
+}
+
+int stats_start_timer (SfsState* state) {
+	pthread_t timer_thread;
+	if (pthread_create (&timer_thread, NULL, stats_timer_handler, state) != 0) {
+		syslog(LOG_CRIT, "[init_thread] cannot start stats thread: %s", strerror (errno));
+		return 0;
+	}
+
+	if (pthread_detach (timer_thread) != 0) {
+		syslog(LOG_CRIT, "[init_thread] cannot detach stats thread: %s", strerror (errno));
+		return 0;
+	}
+
+	return 1;
+}
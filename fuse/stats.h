@@ -0,0 +1,55 @@
+/*
+ *  stats.h - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SFS_STATS_H
+#define SFS_STATS_H
+
+#include <stdint.h>
+#include "sfs.h"
+
+typedef enum {
+	STAT_CRED_CACHE_HITS,
+	STAT_CRED_CACHE_MISSES,
+	STAT_CRED_CACHE_FLUSHES,
+	STAT_BATCH_QUEUE_FULL,
+	STAT_BATCH_EVENTS_DROPPED,
+	STAT_BATCH_COMMITS,
+	STAT_BATCH_COMMIT_EVENTS,
+	STAT_BATCH_COMMIT_SIZE_1,
+	STAT_BATCH_COMMIT_SIZE_2_15,
+	STAT_BATCH_COMMIT_SIZE_16_127,
+	STAT_BATCH_COMMIT_SIZE_128,
+	STAT_BATCH_PUBLISHED,
+	STAT_BATCH_PUBLISH_SYNCS,
+	STAT_BATCH_WINDOW_HITS,
+	STAT_BATCH_ORDER_SEALS,
+	STAT_BATCH_FLUSH_FULL,
+	STAT_BATCH_FLUSH_AGE,
+	STAT_BATCH_FLUSH_IDLE,
+	STAT_MAX
+} SfsStat;
+
+void stats_add (SfsStat stat, uint64_t value);
+#define stats_inc(stat) stats_add (stat, 1)
+uint64_t stats_get (SfsStat stat);
+int stats_start_timer (SfsState* state);
+
+#endif
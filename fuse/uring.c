@@ -0,0 +1,183 @@
+/*
+ *  uring.c - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int uring_enter (int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_init (SfsUring* ring, unsigned entries) {
+	struct io_uring_params p;
+	memset (&p, 0, sizeof (p));
+	memset (ring, 0, sizeof (SfsUring));
+
+	ring->fd = syscall (__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0) {
+		return 0;
+	}
+
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_size > sq_size) {
+			sq_size = cq_size;
+		}
+	}
+
+	char* sq_ptr = mmap (NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED) {
+		goto error;
+	}
+
+	char* cq_ptr = sq_ptr;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq_ptr = mmap (NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED) {
+			goto error;
+		}
+	}
+
+	ring->sqes = mmap (NULL, p.sq_entries * sizeof (struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		goto error;
+	}
+
+	ring->entries = p.sq_entries;
+	ring->sq_head = (unsigned*) (sq_ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned*) (sq_ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned*) (sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned*) (sq_ptr + p.sq_off.array);
+	ring->cq_head = (unsigned*) (cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned*) (cq_ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned*) (cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*) (cq_ptr + p.cq_off.cqes);
+	return 1;
+
+error:
+	// mappings go away with the process, the ring is never used again
+	close (ring->fd);
+	ring->fd = -1;
+	return 0;
+}
+
+/* Whether the kernel implements all the given IORING_OP_* */
+int uring_supports (SfsUring* ring, const int* ops, int count) {
+	size_t size = sizeof (struct io_uring_probe) + 256 * sizeof (struct io_uring_probe_op);
+	struct io_uring_probe* probe = calloc (1, size);
+	int ret = 0;
+	int i;
+
+	if (!probe) {
+		return 0;
+	}
+
+	if (syscall (__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+		goto cleanup;
+	}
+
+	for (i=0; i < count; i++) {
+		if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			goto cleanup;
+		}
+	}
+	ret = 1;
+
+cleanup:
+	free (probe);
+	return ret;
+}
+
+int uring_register_files (SfsUring* ring, int* fds, unsigned count) {
+	return syscall (__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, count) >= 0;
+}
+
+int uring_update_file (SfsUring* ring, unsigned index, int fd) {
+	struct io_uring_files_update update;
+	memset (&update, 0, sizeof (update));
+	update.offset = index;
+	update.fds = (uintptr_t) &fd;
+	return syscall (__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) >= 0;
+}
+
+/* Next free sqe, zeroed. Its user_data is the position in the chain
+ * submitted by uring_submit_wait(). */
+struct io_uring_sqe* uring_get_sqe (SfsUring* ring) {
+	unsigned head = __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *(ring->sq_tail) + ring->pending;
+	if (tail - head >= ring->entries) {
+		return NULL;
+	}
+
+	unsigned index = tail & *(ring->sq_mask);
+	struct io_uring_sqe* sqe = &(ring->sqes[index]);
+	memset (sqe, 0, sizeof (struct io_uring_sqe));
+	sqe->user_data = ring->pending;
+	ring->sq_array[index] = index;
+	ring->pending++;
+	return sqe;
+}
+
+/* Submit the prepared sqes with a single syscall and wait for all of them.
+ * res[i] receives the result of the i-th sqe. Returns 0 with errno set if
+ * the ring itself failed. */
+int uring_submit_wait (SfsUring* ring, int* res) {
+	unsigned count = ring->pending;
+	unsigned done = 0;
+	unsigned to_submit = count;
+
+	__atomic_store_n (ring->sq_tail, *(ring->sq_tail) + count, __ATOMIC_RELEASE);
+	ring->pending = 0;
+
+	while (done < count) {
+		int ret = uring_enter (ring->fd, to_submit, count - done, IORING_ENTER_GETEVENTS);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 0;
+		}
+		to_submit -= ret < (int) to_submit ? ret : to_submit;
+
+		unsigned head = *(ring->cq_head);
+		unsigned tail = __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			struct io_uring_cqe* cqe = &(ring->cqes[head & *(ring->cq_mask)]);
+			if (cqe->user_data < count) {
+				res[cqe->user_data] = cqe->res;
+				done++;
+			}
+			head++;
+		}
+		__atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 1;
+}
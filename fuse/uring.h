@@ -0,0 +1,52 @@
+/*
+ *  uring.h - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SFS_URING_H
+#define SFS_URING_H
+
+#include <linux/io_uring.h>
+
+/* Minimal io_uring on top of the raw syscalls, for a single thread
+ * submitting short chains of requests and waiting for all of them. */
+typedef struct {
+	int fd;
+	unsigned entries;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	struct io_uring_sqe* sqes;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+	// sqes prepared but not yet submitted
+	unsigned pending;
+} SfsUring;
+
+int uring_init (SfsUring* ring, unsigned entries);
+int uring_supports (SfsUring* ring, const int* ops, int count);
+int uring_register_files (SfsUring* ring, int* fds, unsigned count);
+int uring_update_file (SfsUring* ring, unsigned index, int fd);
+struct io_uring_sqe* uring_get_sqe (SfsUring* ring);
+int uring_submit_wait (SfsUring* ring, int* res);
+
+#endif
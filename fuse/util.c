@@ -30,22 +30,187 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
-#include <pwd.h>
 #include <grp.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <sys/xattr.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
 
 #include "sfs.h"
 #include "util.h"
+#include "creds.h"
+#include "hash.h"
 
-/*  All the paths I see are relative to the root of the mounted
- *  filesystem.  In order to get to the underlying filesystem, I need to
- *  have the mountpoint.  I'll save it away early on in main(), and then
- *  whenever I need a path for something I'll call this to construct
- *  it. */
-void sfs_fullpath (char fpath[PATH_MAX], const char *path) {
-	SfsState* data = SFS_STATE;	
-    memcpy(fpath, data->rootdir, data->rootdir_len);
-    strncpy(&fpath[data->rootdir_len], path, PATH_MAX-data->rootdir_len);
-	fpath[PATH_MAX-1] = '\0';
+/* Paths from fuse are absolute to the mountpoint. All operations are done
+ * with *at() syscalls relative to the rootdir fd opened at startup, so that
+ * no absolute path is ever built. */
+static const char* sfs_relpath (const char* path) {
+	while (*path == '/') {
+		path++;
+	}
+	return *path ? path : ".";
+}
+
+#ifdef SYS_openat2
+static int sfs_openat2 (int dirfd, const char* path, int flags, mode_t mode) {
+	struct open_how how;
+	memset (&how, 0, sizeof (how));
+	how.flags = flags;
+	if (flags & O_CREAT) {
+		how.mode = mode;
+	}
+	how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+	return syscall (SYS_openat2, dirfd, path, &how, sizeof (how));
+}
+#endif
+
+int sfs_open_root (SfsState* state) {
+	// not O_PATH, which needs Linux >= 2.6.39 and gains nothing for *at()
+	state->rootdir_fd = open (state->rootdir, O_RDONLY | O_DIRECTORY);
+	if (state->rootdir_fd < 0) {
+		syslog(LOG_ERR, "[main] cannot open root %s: %s", state->rootdir, strerror (errno));
+		return 0;
+	}
+
+	if (state->resolve_beneath) {
+		#ifdef SYS_openat2
+		int fd = sfs_openat2 (state->rootdir_fd, ".", O_PATH | O_DIRECTORY, 0);
+		if (fd < 0) {
+			syslog(LOG_ERR, "[main] openat2 with RESOLVE_BENEATH not supported: %s", strerror (errno));
+			return 0;
+		}
+		close (fd);
+		#else
+		syslog(LOG_ERR, "[main] sfs_beneath requires openat2, not available at build time");
+		return 0;
+		#endif
+	}
+
+	return 1;
+}
+
+/* Returns the directory fd and sets the name to be used with *at()
+ * syscalls for path. Without confinement it's the rootdir fd with the
+ * path relative to it. With resolve_beneath the parent directory is
+ * opened with RESOLVE_BENEATH, so that no component can escape rootdir
+ * through symlinks or "..". The fd must be released with sfs_at_release().
+ * Returns -1 and sets errno on error. */
+int sfs_at (const char* path, const char** name) {
+	SfsState* state = SFS_STATE;
+	const char* rel = sfs_relpath (path);
+
+	*name = rel;
+	if (!state->resolve_beneath) {
+		return state->rootdir_fd;
+	}
+
+	#ifdef SYS_openat2
+	const char* slash = strrchr (rel, '/');
+	if (!slash) {
+		return state->rootdir_fd;
+	}
+
+	size_t len = slash - rel;
+	char dir[len + 1];
+	memcpy (dir, rel, len);
+	dir[len] = '\0';
+	*name = slash + 1;
+	return sfs_openat2 (state->rootdir_fd, dir, O_PATH | O_DIRECTORY, 0);
+	#else
+	errno = ENOSYS;
+	return -1;
+	#endif
+}
+
+void sfs_at_release (int dirfd) {
+	if (dirfd >= 0 && dirfd != SFS_STATE->rootdir_fd) {
+		close (dirfd);
+	}
+}
+
+/* Flags for syscalls following symlinks in the last component. With
+ * resolve_beneath they are not followed, a symlink there can only be
+ * the result of changes made beneath fuse. */
+int sfs_follow_flags (void) {
+	return SFS_STATE->resolve_beneath ? AT_SYMLINK_NOFOLLOW : 0;
+}
+
+int sfs_openat (const char* path, int flags, mode_t mode) {
+	SfsState* state = SFS_STATE;
+	const char* rel = sfs_relpath (path);
+
+	#ifdef SYS_openat2
+	if (state->resolve_beneath) {
+		return sfs_openat2 (state->rootdir_fd, rel, flags, mode);
+	}
+	#endif
+	return openat (state->rootdir_fd, rel, flags, mode);
+}
+
+/* There are no *at() syscalls for extended attributes and statvfs().
+ * Paths relative to rootdir can be used as is, since the working
+ * directory is rootdir, otherwise dirfd is reached through /proc. */
+const char* sfs_xattr_path (char buf[SFS_XATTR_PATH_MAX], int dirfd, const char* name) {
+	if (dirfd == SFS_STATE->rootdir_fd) {
+		return name;
+	}
+	snprintf (buf, SFS_XATTR_PATH_MAX, "/proc/self/fd/%d/%s", dirfd, name);
+	return buf;
+}
+
+// xattrs stored by SFS itself, which clients can't change
+int sfs_xattr_reserved (const char* name) {
+	return !strcmp (name, HASH_XATTR);
+}
+
+/* Like llistxattr(), without the reserved xattrs. The whole list is read
+ * to know its size without them. */
+ssize_t sfs_list_xattrs (const char* path, char* list, size_t size) {
+	char* buf = NULL;
+	ssize_t len, visible = 0;
+	char* name;
+
+	do {
+		len = llistxattr (path, NULL, 0);
+		if (len <= 0) {
+			goto cleanup;
+		}
+		free (buf);
+		buf = malloc (len);
+		if (!buf) {
+			errno = ENOMEM;
+			len = -1;
+			goto cleanup;
+		}
+		// grown meanwhile
+		len = llistxattr (path, buf, len);
+	} while (len < 0 && errno == ERANGE);
+	if (len < 0) {
+		goto cleanup;
+	}
+
+	for (name=buf; name < buf + len; name += strlen (name) + 1) {
+		if (sfs_xattr_reserved (name)) {
+			continue;
+		}
+		size_t namelen = strlen (name) + 1;
+		if (size && visible + namelen > size) {
+			errno = ERANGE;
+			visible = -1;
+			break;
+		}
+		if (size) {
+			memcpy (list + visible, name, namelen);
+		}
+		visible += namelen;
+	}
+	len = visible;
+
+cleanup:
+	free (buf);
+	return len;
 }
 
 int sfs_sync_path (const char *path, int data_only) {
@@ -91,14 +256,123 @@ void sfs_get_monotonic_time (SfsState* state, struct timespec *ret) {
 	return;
 }
 
+/* In thread_creds mode each fuse worker switches its own credentials.
+ * The kernel keeps fsuid, fsgid and supplementary groups per thread, it's
+ * only the glibc wrappers of setgroups() and friends that broadcast the
+ * change to the whole process, so the raw syscalls are used here.
+ * The umask lives in the fs struct shared by all threads, which is
+ * unshared once per thread. */
+static __thread int sfs_thread_fs_private = 0;
+
+#ifdef SYS_setfsuid32
+#define SFS_SYS_SETFSUID SYS_setfsuid32
+#define SFS_SYS_SETFSGID SYS_setfsgid32
+#define SFS_SYS_SETGROUPS SYS_setgroups32
+#else
+#define SFS_SYS_SETFSUID SYS_setfsuid
+#define SFS_SYS_SETFSGID SYS_setfsgid
+#define SFS_SYS_SETGROUPS SYS_setgroups
+#endif
+
+static int sfs_thread_private_fs (void) {
+	if (sfs_thread_fs_private) {
+		return 1;
+	}
+
+	if (unshare (CLONE_FS) < 0) {
+		syslog(LOG_CRIT, "[access] cannot unshare fs struct: %s", strerror(errno));
+		return 0;
+	}
+	// the copy may predate the chdir to rootdir done in init
+	if (fchdir (SFS_STATE->rootdir_fd) < 0) {
+		syslog(LOG_CRIT, "[access] cannot chdir to rootdir: %s", strerror(errno));
+		return 0;
+	}
+
+	sfs_thread_fs_private = 1;
+	return 1;
+}
+
+static int sfs_thread_setfsid (long sysno, unsigned int id) {
+	syscall (sysno, id);
+	// setfs[ug]id never fail, they return the previous id
+	if ((unsigned int) syscall (sysno, -1) != id) {
+		errno = EPERM;
+		return -1;
+	}
+	return 0;
+}
+
+static int sfs_thread_begin_access (uid_t uid, gid_t gid) {
+	gid_t* groups;
+	int ngroups = creds_get_groups (uid, gid, &groups);
+	if (ngroups < 0) {
+		return 0;
+	}
+
+	if (syscall (SFS_SYS_SETGROUPS, ngroups, groups) < 0) {
+		syslog(LOG_CRIT, "[access] cannot set groups for uid %d: %s", uid, strerror(errno));
+		free (groups);
+		return 0;
+	}
+	free (groups);
+
+	if (sfs_thread_setfsid (SFS_SYS_SETFSGID, gid) < 0) {
+		syslog(LOG_CRIT, "[access] cannot setfsgid to %d: %s", gid, strerror(errno));
+		return 0;
+	}
+
+	if (sfs_thread_setfsid (SFS_SYS_SETFSUID, uid) < 0) {
+		syslog(LOG_CRIT, "[access] cannot setfsuid to %d: %s", uid, strerror(errno));
+		sfs_thread_setfsid (SFS_SYS_SETFSGID, 0);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void sfs_thread_end_access (void) {
+	if (sfs_thread_setfsid (SFS_SYS_SETFSUID, 0) < 0) {
+		syslog(LOG_CRIT, "[access] cannot setfsuid back to 0: %s", strerror(errno));
+	}
+
+	if (sfs_thread_setfsid (SFS_SYS_SETFSGID, 0) < 0) {
+		syslog(LOG_CRIT, "[access] cannot setfsgid back to 0: %s", strerror(errno));
+	}
+
+	if (syscall (SFS_SYS_SETGROUPS, 0, NULL) < 0) {
+		syslog(LOG_CRIT, "[access] cannot drop groups: %s", strerror(errno));
+	}
+}
+
 int sfs_begin_access (void) {
+	struct fuse_context* ctx = fuse_get_context();
+	#ifdef FUSE_28
+	return sfs_begin_access_as (ctx->uid, ctx->gid, ctx->umask);
+	#else
+	return sfs_begin_access_as (ctx->uid, ctx->gid, 0);
+	#endif
+}
+
+/* Same as sfs_begin_access(), for callers that do not run in a
+ * fuse high-level context, like the low-level backend. */
+int sfs_begin_access_as (uid_t uid, gid_t gid, mode_t mask) {
 	SfsState* state = SFS_STATE;
 	
-	struct fuse_context* ctx = fuse_get_context();
 	if (!state->perm_checks) {
 		// only honor umask
 		#ifdef FUSE_28
-		umask (ctx->umask);
+		umask (mask);
+		#endif
+		return 1;
+	}
+
+	if (state->thread_creds) {
+		if (!sfs_thread_private_fs () || !sfs_thread_begin_access (uid, gid)) {
+			return 0;
+		}
+		#ifdef FUSE_28
+		umask (mask);
 		#endif
 		return 1;
 	}
@@ -106,31 +380,32 @@ int sfs_begin_access (void) {
 	pthread_mutex_lock (&(state->access_mutex));
 
 	// get pw groups
-	errno = 0;
-	struct passwd *pwd = getpwuid(ctx->uid);
-	if (!pwd && errno != 0) {
-		syslog(LOG_CRIT, "[access] cannot read /etc/passwd: %s", strerror(errno));
+	gid_t* groups;
+	int ngroups = creds_get_groups (uid, gid, &groups);
+	if (ngroups < 0) {
 		goto error;
 	}
-	if (pwd) {
-		if (initgroups (pwd->pw_name, ctx->gid) < 0) {
-			syslog(LOG_CRIT, "[access] cannot init groups for user %s: %s", pwd->pw_name, strerror(errno));
+	if (ngroups > 0) {
+		if (setgroups (ngroups, groups) < 0) {
+			syslog(LOG_CRIT, "[access] cannot init groups for uid %d: %s", uid, strerror(errno));
+			free (groups);
 			goto error;
 		}
 	}
+	free (groups);
 	
-	if (setfsgid (ctx->gid) < 0) {
-		syslog(LOG_CRIT, "[access] cannot seteuid to %d: %s", ctx->gid, strerror(errno));
+	if (setfsgid (gid) < 0) {
+		syslog(LOG_CRIT, "[access] cannot seteuid to %d: %s", gid, strerror(errno));
 		goto error;
 	}
 
-	if (setfsuid (ctx->uid) < 0) {
-		syslog(LOG_CRIT, "[access] cannot seteuid to %d: %s", ctx->uid, strerror(errno));
+	if (setfsuid (uid) < 0) {
+		syslog(LOG_CRIT, "[access] cannot seteuid to %d: %s", uid, strerror(errno));
 		goto error;
 	}
 
 	#ifdef FUSE_28
-	umask (ctx->umask);
+	umask (mask);
 	#endif
 	return 1;
 	
@@ -146,6 +421,12 @@ void sfs_end_access (void) {
 		umask (state->fuse_umask);
 		return;
 	}
+
+	if (state->thread_creds) {
+		sfs_thread_end_access ();
+		umask (state->fuse_umask);
+		return;
+	}
 	
 	if (setfsgid (0) < 0) {
 		syslog(LOG_CRIT, "[access] cannot seteuid back to 0: %s", strerror(errno));
@@ -160,6 +441,93 @@ void sfs_end_access (void) {
 	pthread_mutex_unlock (&(state->access_mutex));
 }
 
+void sfs_write_pid (SfsState* state) {
+	const char* pidpath = state->pid_path;
+	if (!pidpath) {
+		return;
+	}
+
+	FILE *pidfile = fopen (pidpath, "w");
+	if (!pidfile) {
+		syslog(LOG_ERR, "[main] cannot open %s for write: %s", pidpath, strerror (errno));
+	} else {
+		if (!fprintf(pidfile, "%d\n", state->pid)) {
+			syslog(LOG_ERR, "[main] can't write pid %d to %s: %s.\n",
+				   state->pid, pidpath, strerror (errno));
+		}
+		fflush (pidfile);
+		fclose (pidfile);
+	}
+}
+
+/* Capabilities wanted by both backends */
+void sfs_init_conn (SfsState* state, struct fuse_conn_info* conn) {
+	#ifdef FUSE_29
+	// move data between /dev/fuse and the backing files with splice()
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	#endif
+
+	#ifdef SFS_FUSE3
+	// lookups and readdirs in the same directory don't serialize
+	conn->want |= conn->capable & FUSE_CAP_PARALLEL_DIROPS;
+
+	if (state->writeback) {
+		if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+			conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+		} else {
+			syslog (LOG_WARNING, "[main] writeback cache not supported by the kernel");
+			state->writeback = 0;
+		}
+	}
+
+	#ifdef SFS_PASSTHROUGH
+	if (state->passthrough) {
+		if (conn->capable & FUSE_CAP_PASSTHROUGH) {
+			conn->want |= FUSE_CAP_PASSTHROUGH;
+			// the original filesystem must not be stacked itself
+			conn->max_backing_stack_depth = 1;
+		} else {
+			syslog (LOG_WARNING, "[main] passthrough not supported by the kernel");
+			state->passthrough = 0;
+		}
+	}
+	#endif
+
+	if (state->readdirplus) {
+		conn->want |= conn->capable & (FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO);
+	} else {
+		conn->want &= ~(FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO);
+	}
+
+	// libfuse lowers it to its buffer size, and asks for max_pages accordingly
+	conn->max_write = SFS_MAX_WRITE;
+	#endif
+}
+
+/* Flags to open the backing file with. With the writeback cache the kernel
+ * may read pages of files opened write-only, and handles O_APPEND itself
+ * since it knows the cached size. */
+int sfs_open_flags (int flags) {
+	if (SFS_STATE->writeback) {
+		if ((flags & O_ACCMODE) == O_WRONLY) {
+			flags = (flags & ~O_ACCMODE) | O_RDWR;
+		}
+		flags &= ~O_APPEND;
+	}
+	return flags;
+}
+
+#ifdef FUSE_29
+/* Data of buf if it's a single memory buffer, NULL if it's a pipe
+ * filled by splice() or spread over several buffers. */
+const void* sfs_buf_mem (const struct fuse_bufvec* buf) {
+	if (buf->count != 1 || buf->idx || (buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+		return NULL;
+	}
+	return (const char*) buf->buf[0].mem + buf->off;
+}
+#endif
+
 int sfs_is_directory (const char* path) {
 	struct stat buf;
 	int ret = stat (path, &buf);
@@ -173,19 +541,19 @@ int sfs_is_directory (const char* path) {
 	return 0;
 }
 
-int sfs_update_mtime (const char* domain, const char* path) {
+int sfs_update_mtime (const char* domain, int dirfd, const char* path) {
 	UpdateMTime update_mtime = SFS_STATE->update_mtime;
 	if (update_mtime == UPDATE_MTIME_TOUCH) {
 		struct timespec ts[2] = { {0}, {0} };
 		ts[0].tv_nsec = UTIME_OMIT;
 		ts[1].tv_nsec = UTIME_NOW;
-		if (utimensat(0, path, ts, 0) < 0) {
+		if (utimensat(dirfd, path, ts, 0) < 0) {
 			syslog(LOG_CRIT, "[%s] could not update mtime of %s: %s", domain, path, strerror(errno));
 			return 0;
 		}
 	} else if (update_mtime == UPDATE_MTIME_INCREMENT) {
 		struct stat statbuf;
-		if (stat(path, &statbuf) < 0) {
+		if (fstatat(dirfd, path, &statbuf, 0) < 0) {
 			syslog(LOG_CRIT, "[%s] could not stat %s: %s", domain, path, strerror(errno));
 			return 0;
 		}
@@ -194,7 +562,7 @@ int sfs_update_mtime (const char* domain, const char* path) {
 		ts[0].tv_nsec = UTIME_OMIT;
 		ts[1] = statbuf.st_mtim;
 		ts[1].tv_nsec++;
-		if (utimensat(0, path, ts, 0) < 0) {
+		if (utimensat(dirfd, path, ts, 0) < 0) {
 			syslog(LOG_CRIT, "[%s] could not update mtime of %s: %s", domain, path, strerror(errno));
 			return 0;
 		}
@@ -25,13 +25,30 @@
 #include <limits.h>
 #include "sfs.h"
 
-void sfs_fullpath (char fpath[PATH_MAX], const char *path);
+// large enough for /proc/self/fd/N/name
+#define SFS_XATTR_PATH_MAX (NAME_MAX + 64)
+
+int sfs_open_root (SfsState* state);
+int sfs_at (const char* path, const char** name);
+void sfs_at_release (int dirfd);
+int sfs_follow_flags (void);
+int sfs_openat (const char* path, int flags, mode_t mode);
+const char* sfs_xattr_path (char buf[SFS_XATTR_PATH_MAX], int dirfd, const char* name);
+int sfs_xattr_reserved (const char* name);
+ssize_t sfs_list_xattrs (const char* path, char* list, size_t size);
 int sfs_sync_path (const char *path, int data_only);
 void sfs_get_monotonic_time (SfsState* state, struct timespec *ts);
 int sfs_begin_access (void);
+int sfs_begin_access_as (uid_t uid, gid_t gid, mode_t mask);
 void sfs_end_access (void);
 int sfs_is_directory (const char* path);
-int sfs_update_mtime (const char* domain, const char* path);
+int sfs_update_mtime (const char* domain, int dirfd, const char* path);
+void sfs_write_pid (SfsState* state);
+void sfs_init_conn (SfsState* state, struct fuse_conn_info* conn);
+int sfs_open_flags (int flags);
+#ifdef FUSE_29
+const void* sfs_buf_mem (const struct fuse_bufvec* buf);
+#endif
 
 int sfs_timespec_subtract (struct timespec *result, struct timespec *x, struct timespec *y);
 
@@ -0,0 +1,184 @@
+/*
+ *  window.c - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Deduplication across the last batch_dedup_window sealed batches. The
+ * writer records the paths of each batch once they're written, and an
+ * event is skipped if its path is in a sealed batch that the sync
+ * daemon didn't take yet. A batch is taken when it's no longer in the
+ * tmp dir nor in batch_dir: the sync daemon removes it from batch_dir
+ * before reading the data it lists, so the data written before the
+ * check is still replicated. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sfs.h"
+#include "set.h"
+#include "stats.h"
+#include "window.h"
+#include "batch.h"
+
+typedef struct {
+	SfsSet* set;
+	char* tmp_path;
+	char* batch_path;
+	BatchType type;
+	// still waiting for the sync daemon
+	volatile int pending;
+} WindowBatch;
+
+static struct {
+	pthread_rwlock_t lock;
+	// the open batch of each shard and type, see BATCH_INDEX
+	SfsSet** open;
+	// the sealed batches, next is the oldest one
+	WindowBatch batches[WINDOW_MAX_BATCHES];
+	int size;
+	int next;
+} window = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER
+};
+
+int window_init (SfsState* state) {
+	int i;
+
+	if (!state->batch_dedup_window) {
+		return 1;
+	}
+
+	int count = state->batch_shards * BATCH_TYPES;
+	window.open = calloc (count, sizeof (SfsSet*));
+	if (!window.open) {
+		syslog(LOG_CRIT, "[init_thread] cannot allocate the batch dedup window");
+		return 0;
+	}
+
+	window.size = state->batch_dedup_window;
+	for (i=0; i < window.size + count; i++) {
+		SfsSet* set = sfs_set_new (state->batch_dedup_max_bytes);
+		if (!set) {
+			syslog(LOG_CRIT, "[init_thread] cannot allocate the batch dedup window");
+			return 0;
+		}
+		if (i < window.size) {
+			window.batches[i].set = set;
+		} else {
+			window.open[i - window.size] = set;
+		}
+	}
+	return 1;
+}
+
+/* Record a path written to the open batch of shard and type, line ends
+ * with a newline. */
+void window_add (int shard, BatchType type, const char* line, int len) {
+	if (window.size) {
+		sfs_set_add_len (window.open[BATCH_INDEX (shard, type)], line, len - 1);
+	}
+}
+
+/* The open batch of shard and type was sealed and will be published with
+ * name, from now on its paths can be skipped. */
+void window_seal (SfsState* state, int shard, BatchType type, const char* tmp_path, const char* name) {
+	if (!window.size) {
+		return;
+	}
+
+	int index = BATCH_INDEX (shard, type);
+	char* dir = batch_stream_dir (state, shard, type);
+
+	pthread_rwlock_wrlock (&(window.lock));
+	// the oldest batch leaves the window, its set is reused for the next open one
+	WindowBatch* batch = &(window.batches[window.next]);
+	SfsSet* set = batch->set;
+	batch->set = window.open[index];
+	window.open[index] = set;
+	sfs_set_clear (set);
+
+	free (batch->tmp_path);
+	free (batch->batch_path);
+	batch->batch_path = NULL;
+	batch->pending = 0;
+	batch->tmp_path = strdup (tmp_path);
+	if (!dir || !batch->tmp_path || asprintf (&(batch->batch_path), "%s/%s", dir, name) < 0) {
+		syslog(LOG_WARNING, "[batch_flush] cannot allocate dedup window entry of %s: %s", name, strerror (errno));
+		free (batch->tmp_path);
+		batch->tmp_path = NULL;
+		batch->batch_path = NULL;
+	} else {
+		batch->type = type;
+		batch->pending = 1;
+	}
+	window.next = (window.next + 1) % window.size;
+	pthread_rwlock_unlock (&(window.lock));
+	free (dir);
+}
+
+/* The open batch of shard and type was not published, forget its paths. */
+void window_discard (int shard, BatchType type) {
+	if (window.size) {
+		sfs_set_clear (window.open[BATCH_INDEX (shard, type)]);
+	}
+}
+
+/* Whether path is in a batch not yet taken by the sync daemon. A rec
+ * batch also covers norec events, but not the other way around. */
+int window_pending (SfsState* state, const char* path, BatchType type) {
+	int ret = 0;
+	int i;
+
+	if (!window.size) {
+		return 0;
+	}
+
+	pthread_rwlock_rdlock (&(window.lock));
+	for (i=0; i < window.size && !ret; i++) {
+		WindowBatch* batch = &(window.batches[i]);
+		if (!batch->pending || (batch->type != BATCH_TYPE_REC && batch->type != type)) {
+			continue;
+		}
+		if (!sfs_set_contains (batch->set, path)) {
+			continue;
+		}
+
+		// the publisher renames the tmp batch, check it first
+		if (!access (batch->tmp_path, F_OK) || !access (batch->batch_path, F_OK)) {
+			ret = 1;
+		} else {
+			batch->pending = 0;
+		}
+	}
+	pthread_rwlock_unlock (&(window.lock));
+
+	if (ret) {
+		stats_inc (STAT_BATCH_WINDOW_HITS);
+		if (state->log_debug) {
+			syslog(LOG_DEBUG, "[batch_event] %s is still pending, skipping", path);
+		}
+	}
+	return ret;
+}
@@ -0,0 +1,36 @@
+/*
+ *  window.h - SFS Asynchronous filesystem replication
+ *
+ *  Copyright © 2014  Immobiliare.it S.p.A.
+ *
+ *  This file is part of SFS.
+ *
+ *  SFS is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SFS is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SFS_WINDOW_H
+#define SFS_WINDOW_H
+
+#include "sfs.h"
+
+// upper bound of batch_dedup_window
+#define WINDOW_MAX_BATCHES 64
+
+int window_init (SfsState* state);
+void window_add (int shard, BatchType type, const char* line, int len);
+void window_seal (SfsState* state, int shard, BatchType type, const char* tmp_path, const char* name);
+void window_discard (int shard, BatchType type);
+int window_pending (SfsState* state, const char* path, BatchType type);
+
+#endif